@@ -0,0 +1,68 @@
+/* embedding interface for the interpreter in main.c
+        build liblisp.a with `make`, include this header and link with -pthread.
+        each Interpreter has its own global environment, buffers and output
+        streams, so separate instances can be used from separate threads.
+*/
+#ifndef LISP_H
+#define LISP_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// liblisp.a exports only what this header declares; everything else in it is local
+#if defined(__GNUC__)
+#define LISP_API __attribute__((visibility("default")))
+#else
+#define LISP_API
+#endif
+
+typedef struct Interpreter Interpreter;
+typedef struct SExp SExp;
+
+// limits for each top-level evaluation; 0 means no limit
+typedef struct LispLimits {
+    unsigned long steps;    // calls to eval
+    unsigned long ms;       // wall clock time in milliseconds
+    size_t bytes;           // memory allocated for values and environments
+    size_t depth;           // nested evaluations
+} LispLimits;
+
+// C function callable from lisp; args is the list of evaluated arguments
+typedef SExp* (*NativeFunction)(SExp* args, void* data);
+
+/* interpreter instances */
+LISP_API Interpreter* lispCreate(void);
+LISP_API void lispDestroy(Interpreter* lisp);
+// results and evaluation errors go to out, I/O errors to err (default: stdout, stderr)
+LISP_API void lispSetOutput(Interpreter* lisp, FILE* out, FILE* err);
+// nested evaluations allowed before "Error: Recursion limit exceeded" (default 1000000)
+LISP_API void lispSetMaxDepth(Interpreter* lisp, size_t depth);
+// an evaluation going past a limit returns "Error: Step/Time/Memory/Recursion limit exceeded"
+LISP_API void lispSetLimits(Interpreter* lisp, LispLimits limits);
+// most bytes of values and environments for the whole process, 0 for no limit;
+// the evaluation that goes past it returns "Error: Heap limit exceeded" and, since
+// nothing is freed, so does any later one that needs more; only a failed mmap exits
+LISP_API void lispSetMaxHeap(size_t bytes);
+
+/* evaluation */
+// evaluate one expression in the global environment and return its value
+LISP_API SExp* lispEvalString(Interpreter* lisp, const char* source);
+// evaluate every expression in a text or binary file, printing each result to out
+LISP_API bool lispEvalFile(Interpreter* lisp, const char* fileName);
+// bind name in the global environment to a C function; data is passed to every call
+LISP_API void lispRegister(Interpreter* lisp, const char* name, NativeFunction fn, void* data);
+// printed form of value, valid until the next call on the same instance
+LISP_API const char* lispToString(Interpreter* lisp, SExp* value);
+
+/* values: never freed, shared freely between instances */
+LISP_API SExp* makeLong(long value);
+LISP_API SExp* makeDouble(double value);
+LISP_API SExp* makeString(const char* value);
+LISP_API SExp* makeSymbol(const char* value);
+LISP_API SExp* cons(SExp* car, SExp* cdr);
+LISP_API SExp* car(SExp* list);
+LISP_API SExp* cdr(SExp* list);
+LISP_API bool getNumber(SExp* sexp, double* out);    // false if value is not a number
+LISP_API const char* lispText(SExp* value);          // symbol or string text, NULL otherwise
+
+#endif
@@ -1,22 +1,52 @@
+#define _GNU_SOURCE // pthread_getattr_np
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h> 
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <ucontext.h>
+#include <time.h>
+#include "lisp.h"
 
 /* list types of atom */
 typedef enum {
     ATOM_LONG, ATOM_DOUBLE, ATOM_SYMBOL, ATOM_STRING
 } AtomType;
 
-/* struct for atom: can be number | symbol | string */
+/* struct for string: text with its length and hash
+        concatenations of long strings are ropes (left + right) until their
+        text is first needed; substrings are slices into the text of the
+        original string and are not null-terminated
+*/
+typedef struct String {
+    size_t length;
+    _Atomic size_t hash;        // 0 until computed
+    const char* _Atomic chars;  // NULL for a rope that has not been flattened
+    bool slice;                 // chars[length] is not necessarily '\0'
+    struct String* left;        // rope halves, NULL otherwise
+    struct String* right;
+} String;
+
+/* struct for atom: can be number | symbol | string (type kept in the SExp header) */
 typedef struct Atom {
-    AtomType type;
     union { // allows storage of diff data types in one location
         long long_value;
         double double_value;
         char* symbol_value;
-        char* string_value;
+        String* string_value;
     } value;
 } Atom;
 
@@ -24,11 +54,10 @@ struct SExp;
 
 /* struct for cons cell:
         building block of lists
-        car (head): points to first s-expression
+        car (head): points to first s-expression, stored in the SExp header
         cdr (tail): points to rest of list (list or nil)
 */
 typedef struct ConsCell {
-    struct SExp* car; // head ptr
     struct SExp* cdr; // tail ptr
 } ConsCell;
 
@@ -40,74 +69,472 @@ typedef struct Lambda {
     struct Env* env;  // closure environment
 } Lambda;
 
-/* enum list for s-expression types */
+typedef struct Native {
+    NativeFunction fn;   // NULL after loading an image until registered again
+    void* data;          // passed back to fn on every call
+    const char* name;
+} Native;
+
+typedef struct Promise {
+    struct SExp* expr;          // delayed expression
+    struct Env* env;            // environment it is evaluated in
+    struct SExp* _Atomic value; // NULL until forced
+} Promise;
+
+/* call site of an arithmetic or comparison builtin in an optimized body:
+        it records the operand types it sees and specializes itself to them
+*/
+typedef enum {
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_LT, OP_GT, OP_LTE, OP_GTE, OP_EQ,
+    OP_COUNT
+} OpKind;
+
+const char* opNames[OP_COUNT] = { "add", "sub", "mul", "div", "mod", "lt", "gt", "lte", "gte", "eq" };
+
+typedef enum {
+    SITE_UNSEEN,    // not run yet
+    SITE_LONG,      // operands have been two longs
+    SITE_DOUBLE,    // operands have been two doubles
+    SITE_GENERIC    // other operands seen: getNumber path from now on
+} SiteState;
+
+typedef struct CallSite {
+    OpKind op;
+    _Atomic int state;  // SiteState
+} CallSite;
+
+// persistent hash map (see persistent maps and vectors)
+typedef struct Map {
+    struct MapNode* root;   // NULL when empty
+    size_t count;
+} Map;
+
+// persistent vector: elements before the tail are in the trie under root
+typedef struct Vector {
+    size_t count;
+    struct VectorNode* root;   // NULL while every element fits in the tail
+    struct VectorNode* tail;   // last 1 to 32 elements, NULL when empty
+} Vector;
+
+/* enum list for s-expression types (lists must be 0, see SExp) */
 typedef enum {
-    SEXP_ATOM, SEXP_LIST, SEXP_LAMBDA
+    SEXP_LIST, SEXP_ATOM, SEXP_LAMBDA, SEXP_FUTURE, SEXP_NATIVE, SEXP_PROMISE, SEXP_PORT, SEXP_SITE,
+    SEXP_MAP, SEXP_VECTOR,
+    SEXP_TYPE_COUNT
 } SExpType;
 
-/* struct for s-expression: can be atom | list | lambda */
+#define SEXP_TYPE_BITS 4
+#define SEXP_TYPE_MASK ((1 << SEXP_TYPE_BITS) - 1)
+
+/* struct for s-expression: can be atom | list | lambda | future | native | promise | port | map | vector
+        the header packs the type into its low 4 bits. every object is 16-byte
+        aligned, so a cons cell stores its car pointer in the header as is
+        (type 0) and takes 16 bytes; atoms keep their AtomType above the type
+        bits and also take 16, and functions keep their JitRecord there.
+        Objects only allocate the size their type needs.
+*/
 typedef struct SExp {
-    SExpType type;
+    uintptr_t header;
     union {
         Atom atom;
         ConsCell cons;
         Lambda func;
+        struct Task* future; // expression being evaluated by the thread pool
+        Native native;       // C function registered through lispRegister
+        Promise promise;     // result of delay, evaluated at most once by force
+        struct Port* port;   // file opened by open-input or open-output
+        CallSite site;       // head of a builtin call in an optimized body
+        Map map;             // made by hash-map and map-put
+        Vector vector;       // made by vector and vector-push
     } data;
 } SExp;
 
+#define ATOM_HEADER(atomType) ((uintptr_t)(atomType) << SEXP_TYPE_BITS | SEXP_ATOM)
+
 // global nil object
-SExp nil = { .type = SEXP_LIST, .data.cons = { .car = NULL, .cdr = NULL } };
+_Alignas(16) SExp nil = { .header = 0, .data.cons = { .cdr = NULL } };
 // global truth object
-SExp truth = {.type = SEXP_ATOM, .data.atom = {.type = ATOM_SYMBOL, .value.symbol_value = "t"}};
+_Alignas(16) SExp truth = { .header = ATOM_HEADER(ATOM_SYMBOL), .data.atom = { .value.symbol_value = "t" } };
+// end of file marker returned by read-line and read-sexp
+_Alignas(16) SExp eofObject = { .header = ATOM_HEADER(ATOM_SYMBOL), .data.atom = { .value.symbol_value = "#<eof>" } };
+
+static inline SExpType sexpType(SExp* s) {
+    return (SExpType)(s->header & SEXP_TYPE_MASK);
+}
+static inline AtomType atomType(SExp* s) {
+    return (AtomType)(s->header >> SEXP_TYPE_BITS);
+}
+static inline SExp* consCar(SExp* s) {
+    return (SExp*)s->header;
+}
+// car of a value cell that set and loops replace while other threads may look it up
+static inline SExp* cellLoad(SExp* cell) {
+    return (SExp*)atomic_load_explicit((_Atomic uintptr_t*)&cell->header, memory_order_acquire);
+}
+static inline void cellStore(SExp* cell, SExp* value) {
+    atomic_store_explicit((_Atomic uintptr_t*)&cell->header, (uintptr_t)value, memory_order_release);
+}
 // global environment: parallel lists of symbols and vals
 typedef struct Env {
     SExp* symbols;
     SExp* values;
     struct Env* parent;
+    atomic_uint version; // odd while set is updating symbols and values
 } Env;
 
-Env* globalEnv = NULL;
+// pointer-keyed hash map (open addressing) for optimizer bookkeeping
+typedef struct PtrMap {
+    void** keys;
+    void** values;
+    size_t capacity; // power of two
+    size_t count;
+} PtrMap;
+
+// state owned by one interpreter; nil, truth and builtins are shared read-only
+typedef struct Interpreter {
+    Env* globalEnv;
+    pthread_mutex_t envLock;    // serializes set between this instance's futures
+    PtrMap optimizedBodies;     // source body -> optimized body
+    PtrMap originalForms;       // rewritten call -> source form
+    PtrMap jitRecords;          // source body -> JitRecord
+    pthread_mutex_t optimizerLock; // guards the three maps
+    FILE* out;              // results and evaluation errors
+    FILE* err;              // I/O errors
+    char* exprBuffer;       // expression being read by readExpression
+    size_t exprCapacity;
+    char* lineBuffer;       // current line for readExpression
+    size_t lineCapacity;
+    char* stringBuffer;     // result of sexpToString
+    size_t stringCapacity;
+    LispLimits limits;      // budget of each top-level evaluation
+} Interpreter;
+
+#define DEFAULT_MAX_DEPTH 1000000
+
+Interpreter mainInterpreter = { .envLock = PTHREAD_MUTEX_INITIALIZER, .optimizerLock = PTHREAD_MUTEX_INITIALIZER, .limits = { .depth = DEFAULT_MAX_DEPTH } };
+_Thread_local Interpreter* interp = &mainInterpreter; // interpreter running on this thread
+_Thread_local size_t allocatedBytes; // values, strings and environments allocated by this thread
+
+/* strings */
+
+#define ROPE_MIN_LENGTH 64 // shorter concatenations are copied into a flat string
+
+// flat string holding a copy of text
+String* newString(const char* text, size_t length) {
+    char* chars = malloc(length + 1);
+    memcpy(chars, text, length);
+    chars[length] = '\0';
+
+    String* s = malloc(sizeof(String));
+    allocatedBytes += sizeof(String) + length + 1;
+    s->length = length;
+    atomic_init(&s->hash, 0);
+    atomic_init(&s->chars, chars);
+    s->slice = false;
+    s->left = NULL;
+    s->right = NULL;
+    return s;
+}
+
+// text of s, flattening a rope the first time (slices are not null-terminated)
+const char* stringChars(String* s) {
+    const char* chars = atomic_load_explicit(&s->chars, memory_order_acquire);
+    if (chars) return chars;
+
+    // copy the leaves left to right; an explicit stack handles deep ropes
+    char* flat = malloc(s->length + 1);
+    size_t at = 0;
+    size_t count = 0;
+    size_t capacity = 64;
+    String** stack = malloc(capacity * sizeof(String*));
+    stack[count++] = s;
+    while (count > 0) {
+        String* node = stack[--count];
+        const char* text = atomic_load_explicit(&node->chars, memory_order_acquire);
+        if (text) {
+            memcpy(flat + at, text, node->length);
+            at += node->length;
+            continue;
+        }
+        if (count + 2 > capacity) {
+            capacity *= 2;
+            stack = realloc(stack, capacity * sizeof(String*));
+        }
+        stack[count++] = node->right;
+        stack[count++] = node->left;
+    }
+    free(stack);
+    flat[at] = '\0';
+
+    // another thread may have flattened it meanwhile; keep the first result
+    const char* first = NULL;
+    if (!atomic_compare_exchange_strong(&s->chars, &first, flat)) {
+        free(flat);
+        return first;
+    }
+    return flat;
+}
+
+// null-terminated text of s; slices are copied
+const char* stringCString(String* s) {
+    const char* chars = stringChars(s);
+    return s->slice ? strndup(chars, s->length) : chars;
+}
+
+size_t textHash(const char* text, size_t length) {
+    uint64_t h = 1469598103934665603ULL; // FNV-1a
+    for (size_t i = 0; i < length; i++) {
+        h ^= (unsigned char)text[i];
+        h *= 1099511628211ULL;
+    }
+    return (size_t)h;
+}
+
+size_t stringHashOf(String* s) {
+    size_t hash = atomic_load_explicit(&s->hash, memory_order_relaxed);
+    if (hash == 0) {
+        hash = textHash(stringChars(s), s->length);
+        if (hash == 0) hash = 1; // 0 means not computed
+        atomic_store_explicit(&s->hash, hash, memory_order_relaxed);
+    }
+    return hash;
+}
+
+bool stringEqual(String* a, String* b) {
+    if (a == b) return true;
+    if (a->length != b->length) return false;
+    if (stringHashOf(a) != stringHashOf(b)) return false;
+    return memcmp(stringChars(a), stringChars(b), a->length) == 0;
+}
+
+// a followed by b: a rope node when long, so repeated appends do not recopy
+String* stringConcat(String* a, String* b) {
+    if (a->length == 0) return b;
+    if (b->length == 0) return a;
+
+    size_t length = a->length + b->length;
+    if (length < ROPE_MIN_LENGTH) {
+        char text[ROPE_MIN_LENGTH];
+        memcpy(text, stringChars(a), a->length);
+        memcpy(text + a->length, stringChars(b), b->length);
+        return newString(text, length);
+    }
+
+    String* s = malloc(sizeof(String));
+    allocatedBytes += sizeof(String) + length + 1; // text is allocated when first flattened
+    s->length = length;
+    atomic_init(&s->hash, 0);
+    atomic_init(&s->chars, NULL);
+    s->slice = false;
+    s->left = a;
+    s->right = b;
+    return s;
+}
+
+// characters [start, end) of s, sharing its text
+String* stringSlice(String* s, size_t start, size_t end) {
+    if (start == 0 && end == s->length) return s;
+
+    String* slice = malloc(sizeof(String));
+    allocatedBytes += sizeof(String);
+    slice->length = end - start;
+    atomic_init(&slice->hash, 0);
+    atomic_init(&slice->chars, stringChars(s) + start);
+    slice->slice = s->slice || end != s->length; // a suffix keeps the terminator
+    slice->left = NULL;
+    slice->right = NULL;
+    return slice;
+}
+
+/* heap
+        slabs are cut from large regions reserved with mmap and marked
+        MADV_HUGEPAGE, so a list of a million cells spans a few hundred
+        2MB pages instead of thousands of 4KB ones, with fewer page faults
+        and TLB misses while it is built and walked. Regions are reserved
+        64MB at a time without committing memory; the kernel backs them
+        as they are touched. Threads take whole slabs under a lock.
+        Going past -max-heap aborts the running evaluation like a budget;
+        only a failed mmap ends the process.
+*/
+
+#define SLAB_SIZE (64 * 1024)
+#define HEAP_REGION_SIZE (64UL * 1024 * 1024)
+#define HEAP_PAGE_SIZE (2UL * 1024 * 1024) // transparent huge page
+
+typedef struct Heap {
+    char* next;         // next free slab of the current region
+    char* end;
+    size_t used;        // bytes handed out as slabs
+    size_t reserved;    // bytes of all regions
+    size_t regions;
+    size_t hugeRegions; // regions madvise accepted MADV_HUGEPAGE for
+    size_t limit;       // most bytes handed out, 0 for no limit (-max-heap)
+    pthread_mutex_t lock;
+} Heap;
+
+Heap heap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+SExp* heapLimitError; // made when a limit is set, so reporting it needs no allocation
+
+extern _Thread_local size_t evalDepth; // defined with the evaluation budgets
+extern _Thread_local SExp* evalAbort;
+
+// map a new region aligned to a huge page and make it current
+bool heapGrow(void) {
+    char* base = mmap(NULL, HEAP_REGION_SIZE + HEAP_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) return false;
+    // give back the unaligned ends so the region starts and ends on huge pages
+    char* region = (char*)(((uintptr_t)base + HEAP_PAGE_SIZE - 1) & ~(HEAP_PAGE_SIZE - 1));
+    if (region > base) munmap(base, region - base);
+    munmap(region + HEAP_REGION_SIZE, base + HEAP_PAGE_SIZE - region);
+#ifdef MADV_HUGEPAGE
+    if (madvise(region, HEAP_REGION_SIZE, MADV_HUGEPAGE) == 0) heap.hugeRegions++;
+#endif
+    heap.next = region;
+    heap.end = region + HEAP_REGION_SIZE;
+    heap.reserved += HEAP_REGION_SIZE;
+    heap.regions++;
+    return true;
+}
+
+// one slab from the heap; only a failed mmap is fatal, like a failed malloc
+char* heapSlab(void) {
+    pthread_mutex_lock(&heap.lock);
+    if (heap.limit && heap.used + SLAB_SIZE > heap.limit && evalDepth > 0 && !evalAbort) {
+        // the slab is still handed out so the allocation in progress completes,
+        // and every eval on this thread's stack returns the error
+        evalAbort = heapLimitError;
+    }
+    if (heap.next == heap.end && !heapGrow()) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    char* slab = heap.next;
+    heap.next += SLAB_SIZE; // the slab size divides the region size
+    heap.used += SLAB_SIZE;
+    pthread_mutex_unlock(&heap.lock);
+    return slab;
+}
+
+void lispSetMaxHeap(size_t bytes) {
+    if (!heapLimitError) heapLimitError = makeSymbol("Error: Heap limit exceeded");
+    pthread_mutex_lock(&heap.lock);
+    heap.limit = bytes;
+    pthread_mutex_unlock(&heap.lock);
+}
+
+// minor page faults of the process so far
+long pageFaults(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return usage.ru_minflt;
+}
+
+// heap usage on one line, for -bench and -heap-stats
+void printHeapStats(FILE* out) {
+    pthread_mutex_lock(&heap.lock);
+    fprintf(out, "heap: %zu KB used of %zu MB reserved in %zu regions (%zu with huge pages), %ld page faults\n",
+            heap.used / 1024, heap.reserved / (1024 * 1024), heap.regions, heap.hugeRegions, pageFaults());
+    pthread_mutex_unlock(&heap.lock);
+}
+
+/* object pools
+        each type is allocated from its own 64KB slabs, so the cells of a
+        list built in one go sit next to each other instead of between its
+        elements. Every thread carves objects out of its own current slab,
+        so allocation takes no lock. Nothing is ever freed.
+*/
+
+typedef struct Slab {
+    char* next; // next free object
+    char* end;
+    size_t objects; // handed out so far, for -bench
+} Slab;
+
+_Thread_local Slab slabs[SEXP_TYPE_COUNT];
+_Thread_local Slab envSlab;
+
+// bytes taken by objects of type: header plus the union members the type uses
+size_t sexpSize(SExpType type) {
+    switch (type) {
+        case SEXP_LIST:
+        case SEXP_ATOM:
+        case SEXP_FUTURE:
+        case SEXP_PORT:
+        case SEXP_SITE:
+            return 16;
+        default:
+            return 32;
+    }
+}
+
+// size bytes from slab, starting a new slab when it is full
+void* slabTake(Slab* slab, size_t size) {
+    if (slab->next == slab->end) {
+        slab->next = heapSlab();
+        slab->end = slab->next + SLAB_SIZE; // every object size divides the slab size
+    }
+    void* object = slab->next;
+    slab->next += size;
+    slab->objects++;
+    allocatedBytes += size;
+    return object;
+}
+
+SExp* newSExp(SExpType type) {
+    SExp* s = slabTake(&slabs[type], sexpSize(type));
+    s->header = type;
+    return s;
+}
+
+Env* newEnvFrame(void) {
+    return slabTake(&envSlab, sizeof(Env));
+}
+
+SExp* newAtom(AtomType type) {
+    SExp* atom = newSExp(SEXP_ATOM);
+    atom->header = ATOM_HEADER(type);
+    return atom;
+}
 
 /* constructor functions */
 SExp* makeLong(long value) {
-    SExp* atom = malloc(sizeof(SExp));
-    atom->type = SEXP_ATOM;
-    atom->data.atom.type = ATOM_LONG;
+    SExp* atom = newAtom(ATOM_LONG);
     atom->data.atom.value.long_value = value;
     return atom;
 }
 SExp* makeDouble(double value) {
-    SExp* atom = malloc(sizeof(SExp));
-    atom->type = SEXP_ATOM;
-    atom->data.atom.type = ATOM_DOUBLE;
+    SExp* atom = newAtom(ATOM_DOUBLE);
     atom->data.atom.value.double_value = value;
     return atom;
 }
-SExp* makeString(const char* value) {
-    SExp* atom = malloc(sizeof(SExp));
-    atom->type = SEXP_ATOM;
-    atom->data.atom.type = ATOM_STRING;
-    atom->data.atom.value.string_value = strdup(value);
+SExp* makeStringFrom(String* value) {
+    SExp* atom = newAtom(ATOM_STRING);
+    atom->data.atom.value.string_value = value;
     return atom;
 }
+SExp* makeString(const char* value) {
+    return makeStringFrom(newString(value, strlen(value)));
+}
 SExp* makeSymbol(const char* value) {
-    SExp* atom = malloc(sizeof(SExp));
-    atom->type = SEXP_ATOM;
-    atom->data.atom.type = ATOM_SYMBOL;
+    SExp* atom = newAtom(ATOM_SYMBOL);
     atom->data.atom.value.symbol_value = strdup(value);
     return atom;
 }
+// constructors from text that is not null-terminated
+SExp* makeStringN(const char* text, size_t length) {
+    return makeStringFrom(newString(text, length));
+}
+SExp* makeSymbolN(const char* text, size_t length) {
+    SExp* atom = newAtom(ATOM_SYMBOL);
+    atom->data.atom.value.symbol_value = strndup(text, length);
+    return atom;
+}
 
 
 /* create new cons cell with supplied head and tail */
 SExp *cons(SExp* car, SExp* cdr) {
-    SExp* cell = malloc(sizeof(SExp)); 
-    if (cell == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(EXIT_FAILURE);
-    }
-    cell->type = SEXP_LIST;
-    cell->data.cons.car = car;
+    SExp* cell = newSExp(SEXP_LIST);
+    cell->header = (uintptr_t)car; // list type is 0
     cell->data.cons.cdr = cdr;
     return cell;
 }
@@ -115,20 +542,20 @@ SExp *cons(SExp* car, SExp* cdr) {
 /* returns the car (head) of list */
 SExp *car(SExp* list) {
     // if atom, return nil
-    if (list->type != SEXP_LIST) {
-        printf("Error: car called on Atom\n");
+    if (sexpType(list) != SEXP_LIST) {
+        fprintf(interp->out, "Error: car called on Atom\n");
         return &nil;
     }
     if (list == &nil) {
         return &nil;
     }
-    return list->data.cons.car;
+    return consCar(list);
 }
 
 /* returns the cdr (tail) of list */
 SExp *cdr(SExp* list) {
     // if atom, return nil
-    if (list->type != SEXP_LIST) {
+    if (sexpType(list) != SEXP_LIST) {
         return makeSymbol("Error: cdr called on Atom");
     }
     if (list == &nil) {
@@ -152,9 +579,33 @@ SExp* cadddr(SExp* x) {
 
 
 
+/* lexer
+        one table lookup gives the class of a character. Integers are
+        parsed by hand; only tokens that are not plain integers of up to
+        18 digits (fractions, exponents, huge values) go through strtod.
+*/
+
+enum {
+    CHAR_SPACE = 1,         // skipped between tokens
+    CHAR_DELIMITER = 2,     // ends an atom: space, parentheses, end of input
+    CHAR_DIGIT = 4,
+    CHAR_NUMBER_START = 8,  // digit, '-' or '.'
+};
+
+const unsigned char charClass[256] = {
+    ['\0'] = CHAR_DELIMITER,
+    [' '] = CHAR_SPACE | CHAR_DELIMITER, ['\t'] = CHAR_SPACE | CHAR_DELIMITER, ['\n'] = CHAR_SPACE | CHAR_DELIMITER,
+    ['\v'] = CHAR_SPACE | CHAR_DELIMITER, ['\f'] = CHAR_SPACE | CHAR_DELIMITER, ['\r'] = CHAR_SPACE | CHAR_DELIMITER,
+    ['('] = CHAR_DELIMITER, [')'] = CHAR_DELIMITER,
+    ['0' ... '9'] = CHAR_DIGIT | CHAR_NUMBER_START,
+    ['-'] = CHAR_NUMBER_START, ['.'] = CHAR_NUMBER_START,
+};
+
+#define CHAR_IS(c, classes) (charClass[(unsigned char)(c)] & (classes))
+
 // skip spaces when reading input
 void skipWhitespace(char** input) {
-    while (**input && isspace(**input)) {
+    while (CHAR_IS(**input, CHAR_SPACE)) {
         (*input)++;
     }
 }
@@ -166,6 +617,22 @@ void stripComment (char* line) {
     }
 }
 
+// integer token of at most 18 digits, or NULL if the token is anything else
+SExp* parseInteger(char** input) {
+    char* p = *input;
+    bool negative = (*p == '-');
+    if (negative) p++;
+    char* digits = p;
+    unsigned long value = 0;
+    while (CHAR_IS(*p, CHAR_DIGIT) && p - digits < 19) {
+        value = value * 10 + (*p - '0');
+        p++;
+    }
+    if (p == digits || p - digits > 18 || !CHAR_IS(*p, CHAR_DELIMITER)) return NULL;
+    *input = p;
+    return makeLong(negative ? -(long)value : (long)value);
+}
+
 SExp* parseAtom(char**input) {
     skipWhitespace(input); // skip leading spaces (if any)
     char* start = *input;
@@ -175,77 +642,60 @@ SExp* parseAtom(char**input) {
         (*input)++; // skip opening quote
         start = *input;
 
-        while (**input && **input != '"') {
-            (*input)++;
-        }
-
-        if (**input == '"') {
-            int length = *input - start; 
-            char *string = malloc(length + 1);
-            strncpy(string, start, length);
-            string[length] = '\0'; // append null-terminate
-            (*input)++; // skip closing quote
-
-            // construct new atom
-            SExp* atom = makeString(string);
-                // printf("[DEBUG] Parsed string: \"%s\"\n", string); // Debug message
-            return atom;
+        char* close = strchr(start, '"');
+        if (close) {
+            *input = close + 1; // skip closing quote
+            return makeStringN(start, close - start);
         } else {
+            *input += strlen(start);
             return makeSymbol("Error: Unterminated string"); 
         }
     }
 
     // numbers 
-    if (isdigit(**input) || **input == '-' || **input == '.') {
+    if (CHAR_IS(**input, CHAR_NUMBER_START)) {
+        SExp* integer = parseInteger(input);
+        if (integer) return integer;
+
         char* end;
         double value = strtod(*input, &end);
-        if (end != *input && (*end == '\0' || isspace(*end) || *end == '(' || *end == ')')) { // valid number check
+        if (end != *input && CHAR_IS(*end, CHAR_DELIMITER)) { // valid number check
             *input = end;
 
             // double or long?
             if (value == (long)value) {
-                // long
-                SExp* atom = makeLong((long)value);
-                    // printf("[DEBUG] Parsed long: %ld\n", (long)value); // Debug message
-                return atom;
+                return makeLong((long)value);
             }
             else {
-                // double
-                SExp* atom = makeDouble(value);
-                    // printf("[DEBUG] Parsed double: %f\n", value); // Debug message
-                return atom;
+                return makeDouble(value);
             }
         }
     }
 
     // symbols
-    while (**input && !isspace(**input) && **input != '(' && **input != ')') {
+    while (!CHAR_IS(**input, CHAR_DELIMITER)) {
         (*input)++; // increment until space or parentheses
     }
-
-    int length = *input - start;
-    char* symbol = malloc(length + 1);
-    strncpy(symbol, start, length);
-    symbol[length] = '\0'; // null-terminate
-
-    // construct new atom
-    SExp* atom = makeSymbol(symbol);
-        // printf("[DEBUG] Parsed symbol: %s\n", symbol); // Debug message
-    return atom;
+    return makeSymbolN(start, *input - start); // the only copy of the name
 }
 
 SExp* readSExpHelper(char** input); // forward declaration for parseList
 
-// parse list
+// parse list, after its opening parenthesis
 SExp* parseList(char** input) {
+    SExp* head = &nil;
+    SExp* last = NULL;
     skipWhitespace(input);
-    if (**input == ')') {
-        (*input)++; 
-        return &nil; // empty list
+    while (**input != ')') {
+        if (**input == '\0') return head; // unbalanced: callers check parentheses first
+        SExp* cell = cons(readSExpHelper(input), &nil);
+        if (last) last->data.cons.cdr = cell;
+        else head = cell;
+        last = cell;
+        skipWhitespace(input);
     }
-    SExp* car = readSExpHelper(input); // parse head
-    SExp* cdr = parseList(input); // parse tail
-    return cons(car, cdr);
+    (*input)++;
+    return head;
 }
 
 // recursive helper for readSExp
@@ -270,107 +720,177 @@ SExp* readSExpHelper(char** input) {
     }
 }
 
-// read s-expression from string
+// read s-expression from string; the parser never writes to its input
 SExp* sexp(const char* input) {
-    char* inputCopy = strdup(input); // mutable copy
-    char* cursor = inputCopy;
-    SExp* result = readSExpHelper(&cursor);
-    free(inputCopy);
-    return result;
+    char* cursor = (char*)input;
+    return readSExpHelper(&cursor);
 }
 
-// print s-expression
-void printSExp(SExp* sexp) {
-    if (sexp->type == SEXP_ATOM) {
+// persistent map and vector functions (defined after the environment functions)
+SExp* mapToList(SExp* m);
+SExp* vectorToList(SExp* v);
+
+// print s-expression to given stream
+void fprintSExp(FILE* out, SExp* sexp) {
+    if (sexpType(sexp) == SEXP_ATOM) {
         // print based on atom type
-        switch (sexp->data.atom.type) {
-            case ATOM_LONG: 
-                printf("%ld", sexp->data.atom.value.long_value);
+        switch (atomType(sexp)) {
+            case ATOM_LONG:
+                fprintf(out, "%ld", sexp->data.atom.value.long_value);
                 break;
             case ATOM_DOUBLE:
-                printf("%f", sexp->data.atom.value.double_value);
+                fprintf(out, "%f", sexp->data.atom.value.double_value);
                 break;
             case ATOM_SYMBOL:
-                printf("%s", sexp->data.atom.value.symbol_value);
+                fprintf(out, "%s", sexp->data.atom.value.symbol_value);
                 break;
             case ATOM_STRING:
-                printf("\"%s\"", sexp->data.atom.value.string_value);
+                fprintf(out, "\"%.*s\"", (int)sexp->data.atom.value.string_value->length, stringChars(sexp->data.atom.value.string_value));
                 break;
         }
     }
-    else if (sexp->type == SEXP_LIST) {
-        printf("(");
+    else if (sexpType(sexp) == SEXP_SITE) {
+        fprintf(out, "%s", opNames[sexp->data.site.op]); // printed as the builtin it calls
+    }
+    else if (sexpType(sexp) == SEXP_MAP) {
+        // {key value key value}
+        fprintf(out, "{");
+        for (SExp* rest = mapToList(sexp); rest != &nil; rest = rest->data.cons.cdr) {
+            fprintSExp(out, consCar(consCar(rest)));
+            fprintf(out, " ");
+            fprintSExp(out, consCar(rest)->data.cons.cdr);
+            if (rest->data.cons.cdr != &nil) fprintf(out, " ");
+        }
+        fprintf(out, "}");
+    }
+    else if (sexpType(sexp) == SEXP_VECTOR) {
+        fprintf(out, "[");
+        for (SExp* rest = vectorToList(sexp); rest != &nil; rest = rest->data.cons.cdr) {
+            fprintSExp(out, consCar(rest));
+            if (rest->data.cons.cdr != &nil) fprintf(out, " ");
+        }
+        fprintf(out, "]");
+    }
+    else if (sexpType(sexp) == SEXP_LIST) {
+        fprintf(out, "(");
 
         // traverse list from car to cdr until nil
         SExp* current = sexp;
         while (current != &nil) {
-            printSExp(current->data.cons.car); // recursive call to print
+            fprintSExp(out, consCar(current)); // recursive call to print
 
             // check if cdr is dotted pair
-            if (current->data.cons.cdr != &nil && current->data.cons.cdr->type != SEXP_LIST) { 
-                printf(" . "); 
-                printSExp(current->data.cons.cdr); 
-                break; 
+            if (current->data.cons.cdr != &nil && sexpType(current->data.cons.cdr) != SEXP_LIST) {
+                fprintf(out, " . ");
+                fprintSExp(out, current->data.cons.cdr);
+                break;
             }
 
             current = current->data.cons.cdr;
             if (current != &nil) {
-                printf(" ");
+                fprintf(out, " ");
             }
         }
-        printf(")");
+        fprintf(out, ")");
+    }
+}
+
+// print s-expression
+void printSExp(SExp* sexp) {
+    fprintSExp(stdout, sexp);
+}
+
+// append formatted text to the interpreter's string buffer, growing it as needed
+void bufferAppend(size_t* length, const char* format, ...) {
+    while (1) {
+        size_t room = interp->stringCapacity - *length;
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(interp->stringBuffer + *length, room, format, args);
+        va_end(args);
+        if ((size_t)written < room) {
+            *length += written;
+            return;
+        }
+        interp->stringCapacity = (*length + written + 1) * 2;
+        interp->stringBuffer = realloc(interp->stringBuffer, interp->stringCapacity);
     }
 }
 
-// helper function to convert to string (needed because of buffer string)
-void sexpToStringHelper(SExp* s, char* buffer, size_t size) {
+// helper function to convert to string
+void sexpToStringHelper(SExp* s, size_t* length) {
     // atom
-    if (s->type == SEXP_ATOM) {
-        switch (s->data.atom.type) {
+    if (sexpType(s) == SEXP_ATOM) {
+        switch (atomType(s)) {
             case ATOM_LONG:
-                snprintf(buffer + strlen(buffer), size - strlen(buffer), "%ld", s->data.atom.value.long_value);
+                bufferAppend(length, "%ld", s->data.atom.value.long_value);
                 break;
             case ATOM_DOUBLE:
-                snprintf(buffer + strlen(buffer), size - strlen(buffer), "%f", s->data.atom.value.double_value);
+                bufferAppend(length, "%f", s->data.atom.value.double_value);
                 break;
             case ATOM_SYMBOL:
-                snprintf(buffer + strlen(buffer), size - strlen(buffer), "%s", s->data.atom.value.symbol_value);
+                bufferAppend(length, "%s", s->data.atom.value.symbol_value);
                 break;
             case ATOM_STRING:
-                snprintf(buffer + strlen(buffer), size - strlen(buffer), "\"%s\"", s->data.atom.value.string_value);
+                bufferAppend(length, "\"%.*s\"", (int)s->data.atom.value.string_value->length, stringChars(s->data.atom.value.string_value));
                 break;
         }
     }
+    // specialized builtin call site
+    else if (sexpType(s) == SEXP_SITE) {
+        bufferAppend(length, "%s", opNames[s->data.site.op]);
+    }
+    // persistent map: {key value key value}
+    else if (sexpType(s) == SEXP_MAP) {
+        bufferAppend(length, "{");
+        for (SExp* rest = mapToList(s); rest != &nil; rest = rest->data.cons.cdr) {
+            sexpToStringHelper(consCar(consCar(rest)), length);
+            bufferAppend(length, " ");
+            sexpToStringHelper(consCar(rest)->data.cons.cdr, length);
+            if (rest->data.cons.cdr != &nil) bufferAppend(length, " ");
+        }
+        bufferAppend(length, "}");
+    }
+    // persistent vector: [x y z]
+    else if (sexpType(s) == SEXP_VECTOR) {
+        bufferAppend(length, "[");
+        for (SExp* rest = vectorToList(s); rest != &nil; rest = rest->data.cons.cdr) {
+            sexpToStringHelper(consCar(rest), length);
+            if (rest->data.cons.cdr != &nil) bufferAppend(length, " ");
+        }
+        bufferAppend(length, "]");
+    }
     // list
-    else if (s->type == SEXP_LIST) {
-        strncat(buffer, "(", size - strlen(buffer) - 1);
+    else if (sexpType(s) == SEXP_LIST) {
+        bufferAppend(length, "(");
         SExp* current = s;
         while (current != &nil) {
             // recursive call to handle nested lists
-            sexpToStringHelper(current->data.cons.car, buffer, size);
+            sexpToStringHelper(consCar(current), length);
 
             // dotted pair
-            if (current->data.cons.cdr != &nil && current->data.cons.cdr->type != SEXP_LIST) {
-                strncat(buffer, " . ", size - strlen(buffer) - 1);
-                sexpToStringHelper(current->data.cons.cdr, buffer, size);
+            if (current->data.cons.cdr != &nil && sexpType(current->data.cons.cdr) != SEXP_LIST) {
+                bufferAppend(length, " . ");
+                sexpToStringHelper(current->data.cons.cdr, length);
                 break;
             }
 
             current = current->data.cons.cdr;
             if (current != &nil) {
-                strncat(buffer, " ", size - strlen(buffer) - 1);
+                bufferAppend(length, " ");
             }
         }
-        strncat(buffer, ")", size - strlen(buffer) - 1);
+        bufferAppend(length, ")");
     }
 }
 
 // function to convert sexp to string (alternative to printSExp, similar implementation)
+// the result is reused by the next call on the same interpreter
 char* sexpToString(SExp* s) {
-    static char buffer[256];
-    buffer[0] = '\0';
-    sexpToStringHelper(s, buffer, sizeof(buffer));
-    return buffer;
+    size_t length = 0;
+    bufferAppend(&length, "");
+    sexpToStringHelper(s, &length);
+    return interp->stringBuffer;
 }
 
 
@@ -388,7 +908,7 @@ SExp* nilp(SExp* sexp) {
 }
 // check if s-expression is a symbol
 SExp* symbolp (SExp* sexp) {
-    if (sexp->type == SEXP_ATOM && sexp->data.atom.type == ATOM_SYMBOL) {
+    if (sexpType(sexp) == SEXP_ATOM && atomType(sexp) == ATOM_SYMBOL) {
         return &truth;
     }
     else {
@@ -397,7 +917,7 @@ SExp* symbolp (SExp* sexp) {
 }
 // check if s-expression is a number (long or double)
 SExp* numberp (SExp* sexp) {
-    if (sexp->type == SEXP_ATOM && (sexp->data.atom.type == ATOM_LONG || sexp->data.atom.type == ATOM_DOUBLE)) {
+    if (sexpType(sexp) == SEXP_ATOM && (atomType(sexp) == ATOM_LONG || atomType(sexp) == ATOM_DOUBLE)) {
         return &truth;
     }
     else {
@@ -406,7 +926,7 @@ SExp* numberp (SExp* sexp) {
 }
 // check if s-expression is a string
 SExp* stringp (SExp* sexp) {
-    if (sexp->type == SEXP_ATOM && sexp->data.atom.type == ATOM_STRING) {
+    if (sexpType(sexp) == SEXP_ATOM && atomType(sexp) == ATOM_STRING) {
         return &truth;
     }
     else {
@@ -415,7 +935,7 @@ SExp* stringp (SExp* sexp) {
 }
 // check if s-expression is a list (cons cell or nil)
 SExp* listp (SExp* sexp) {
-    if (sexp->type == SEXP_LIST) {
+    if (sexpType(sexp) == SEXP_LIST) {
         return &truth;
     }
     else {
@@ -430,12 +950,12 @@ bool sexpToBool (SExp* sexp) {
 /* logic functions (sprint 3)*/
 // helper to convert SExp to double (if applicable), pass to out
 bool getNumber(SExp* sexp, double* out) {
-    if (sexp->type == SEXP_ATOM) {
-        if (sexp->data.atom.type == ATOM_LONG) {
+    if (sexpType(sexp) == SEXP_ATOM) {
+        if (atomType(sexp) == ATOM_LONG) {
             *out = (double)(sexp->data.atom.value.long_value);
             return true;
         }
-        else if (sexp->data.atom.type == ATOM_DOUBLE) {
+        else if (atomType(sexp) == ATOM_DOUBLE) {
             *out = sexp->data.atom.value.double_value;
             return true;
         }
@@ -443,26 +963,30 @@ bool getNumber(SExp* sexp, double* out) {
     return false; // not a number
 }
 
+// result of arithmetic: long if it has no fractional part
+SExp* boxNumber(double result) {
+    return (result == (long)result) ? makeLong((long)result) : makeDouble(result);
+}
 // add
 SExp* add(SExp* a, SExp* b){
     double x,y;
     if (!getNumber(a, &x) || !getNumber(b, &y)) return makeSymbol("Error: Operand not a number");
     double result = x + y;
-    return (result == (long)result) ? makeLong((long)result) : makeDouble(result);
+    return boxNumber(result);
 }
 // subtract
 SExp* sub(SExp* a, SExp* b){
     double x,y;
     if (!getNumber(a, &x) || !getNumber(b, &y)) return makeSymbol("Error: Operand not a number");
     double result = x - y;
-    return (result == (long)result) ? makeLong((long)result) : makeDouble(result);
+    return boxNumber(result);
 }
 // multiply
 SExp* mul(SExp* a, SExp* b){
     double x,y;
     if (!getNumber(a, &x) || !getNumber(b, &y)) return makeSymbol("Error: Operand not a number");
     double result = x * y;
-    return (result == (long)result) ? makeLong((long)result) : makeDouble(result);
+    return boxNumber(result);
 }
 // divide (returns error if divide by 0)
 SExp* divide(SExp* a, SExp* b){
@@ -470,7 +994,7 @@ SExp* divide(SExp* a, SExp* b){
     if (!getNumber(a, &x) || !getNumber(b, &y)) return makeSymbol("Error: Operand not a number");
     if (y == 0) return makeSymbol("Error: Divide by zero");
     double result = x / y;
-    return (result == (long)result) ? makeLong((long)result) : makeDouble(result);
+    return boxNumber(result);
 }
 // modulo (only for long) (returns error if divide by 0)
 SExp* mod(SExp* a, SExp* b){
@@ -506,22 +1030,22 @@ SExp* gte(SExp* a, SExp* b){
 }
 // equality function: considers any atom type
 SExp* eq(SExp* a, SExp* b){
-    if (a->type != b->type) return makeSymbol("Error: Type mismatch"); // different types
-    if (a->type == SEXP_ATOM) {
+    if (sexpType(a) != sexpType(b)) return makeSymbol("Error: Type mismatch"); // different types
+    if (sexpType(a) == SEXP_ATOM) {
         // both atoms, check atom type
 
         // handle numeric equality (long and double)
-        if ((a->data.atom.type == ATOM_LONG || a->data.atom.type == ATOM_DOUBLE) &&
-            (b->data.atom.type == ATOM_LONG || b->data.atom.type == ATOM_DOUBLE)) {
-            double x, y;
+        if ((atomType(a) == ATOM_LONG || atomType(a) == ATOM_DOUBLE) &&
+            (atomType(b) == ATOM_LONG || atomType(b) == ATOM_DOUBLE)) {
+            double x = 0, y = 0;
             getNumber(a, &x);
             getNumber(b, &y);
             return (x == y) ? &truth : &nil;
         }
 
 
-        if (a->data.atom.type != b->data.atom.type) return makeSymbol("Error: Type mismatch"); // different atom types
-        switch (a->data.atom.type) {
+        if (atomType(a) != atomType(b)) return makeSymbol("Error: Type mismatch"); // different atom types
+        switch (atomType(a)) {
             case ATOM_LONG:
                 return (a->data.atom.value.long_value == b->data.atom.value.long_value) ? &truth : &nil;
             case ATOM_DOUBLE:
@@ -529,30 +1053,173 @@ SExp* eq(SExp* a, SExp* b){
             case ATOM_SYMBOL:
                 return (strcmp(a->data.atom.value.symbol_value, b->data.atom.value.symbol_value) == 0) ? &truth : &nil;
             case ATOM_STRING:
-                return (strcmp(a->data.atom.value.string_value, b->data.atom.value.string_value) == 0) ? &truth : &nil;
+                return stringEqual(a->data.atom.value.string_value, b->data.atom.value.string_value) ? &truth : &nil;
         }
     }
-    else if (a->type == SEXP_LIST) {
+    else if (sexpType(a) == SEXP_LIST) {
         return makeSymbol("Error: eq called on lists");
     }
     return &nil; // fallback
 }
+
+/* specialized call sites */
+
+SExp* (*opGeneric[OP_COUNT])(SExp*, SExp*) = { add, sub, mul, divide, mod, lt, gt, lte, gte, eq };
+
+#define EXACT_LONG (1L << 53) // longs up to this size convert to doubles exactly
+
+SExp* makeCallSite(OpKind op) {
+    SExp* s = newSExp(SEXP_SITE);
+    s->data.site.op = op;
+    atomic_init(&s->data.site.state, SITE_UNSEEN);
+    return s;
+}
+
+// op on two longs, giving what the generic (double) path gives; NULL where that
+// is not exact or is an error, leaving the case to the generic path
+SExp* siteLong(OpKind op, long x, long y) {
+    if (x > EXACT_LONG || x < -EXACT_LONG || y > EXACT_LONG || y < -EXACT_LONG) return NULL;
+    long result;
+    switch (op) {
+        case OP_ADD: result = x + y; break;
+        case OP_SUB: result = x - y; break;
+        case OP_MUL:
+            if (__builtin_mul_overflow(x, y, &result)) return NULL;
+            break;
+        case OP_DIV:
+            if (y == 0) return NULL;
+            return (x % y == 0) ? makeLong(x / y) : boxNumber((double)x / y);
+        case OP_MOD:
+            return (y == 0) ? NULL : makeLong(x % y);
+        case OP_LT: return (x < y) ? &truth : &nil;
+        case OP_GT: return (x > y) ? &truth : &nil;
+        case OP_LTE: return (x <= y) ? &truth : &nil;
+        case OP_GTE: return (x >= y) ? &truth : &nil;
+        case OP_EQ: return (x == y) ? &truth : &nil;
+        default: return NULL;
+    }
+    return (result > EXACT_LONG || result < -EXACT_LONG) ? NULL : makeLong(result);
+}
+
+// op on two doubles, NULL for the cases left to the generic path
+SExp* siteDouble(OpKind op, double x, double y) {
+    switch (op) {
+        case OP_ADD: return boxNumber(x + y);
+        case OP_SUB: return boxNumber(x - y);
+        case OP_MUL: return boxNumber(x * y);
+        case OP_DIV: return (y == 0) ? NULL : boxNumber(x / y);
+        case OP_LT: return (x < y) ? &truth : &nil;
+        case OP_GT: return (x > y) ? &truth : &nil;
+        case OP_LTE: return (x <= y) ? &truth : &nil;
+        case OP_GTE: return (x >= y) ? &truth : &nil;
+        case OP_EQ: return (x == y) ? &truth : &nil;
+        default: return NULL;
+    }
+}
+
+// call through a call site: the first run picks the specialization, and operands
+// that do not fit it send the site back to the generic path for good
+SExp* callSite(SExp* node, SExp* a, SExp* b) {
+    CallSite* site = &node->data.site;
+    bool longs = a->header == ATOM_HEADER(ATOM_LONG) && b->header == ATOM_HEADER(ATOM_LONG);
+    bool doubles = a->header == ATOM_HEADER(ATOM_DOUBLE) && b->header == ATOM_HEADER(ATOM_DOUBLE);
+    SExp* result = NULL;
+
+    switch (atomic_load_explicit(&site->state, memory_order_relaxed)) {
+        case SITE_LONG:
+            if (longs) result = siteLong(site->op, a->data.atom.value.long_value, b->data.atom.value.long_value);
+            else atomic_store_explicit(&site->state, SITE_GENERIC, memory_order_relaxed); // deoptimize
+            break;
+        case SITE_DOUBLE:
+            if (doubles) result = siteDouble(site->op, a->data.atom.value.double_value, b->data.atom.value.double_value);
+            else atomic_store_explicit(&site->state, SITE_GENERIC, memory_order_relaxed);
+            break;
+        case SITE_UNSEEN:
+            atomic_store_explicit(&site->state, longs ? SITE_LONG : doubles ? SITE_DOUBLE : SITE_GENERIC, memory_order_relaxed);
+            break;
+    }
+    return result ? result : opGeneric[site->op](a, b);
+}
 // logical not: takes boolean atom and returns opposite
 SExp* notf(SExp* a){
     return (a == &nil) ? &truth : &nil;
 }
 
+/* string functions */
+
+// string-append: concatenation of any number of strings
+SExp* stringAppend(SExp* strings) {
+    String* result = newString("", 0);
+    for (SExp* rest = strings; rest != &nil; rest = cdr(rest)) {
+        if (stringp(car(rest)) != &truth) return makeSymbol("Error: Not a string");
+        result = stringConcat(result, car(rest)->data.atom.value.string_value);
+    }
+    return makeStringFrom(result);
+}
+// index argument in [0, limit], -1 otherwise
+long stringIndex(SExp* index, size_t limit) {
+    double i;
+    if (!getNumber(index, &i) || i < 0 || i > (double)limit || i != (long)i) return -1;
+    return (long)i;
+}
+// substring: characters [start, end) sharing the text of s; end defaults to the length
+SExp* substring(SExp* s, SExp* start, SExp* end) {
+    if (stringp(s) != &truth) return makeSymbol("Error: Not a string");
+    String* text = s->data.atom.value.string_value;
+    long from = stringIndex(start, text->length);
+    long to = end ? stringIndex(end, text->length) : (long)text->length;
+    if (from < 0 || to < from) return makeSymbol("Error: Index out of range");
+    return makeStringFrom(stringSlice(text, from, to));
+}
+SExp* stringLength(SExp* s) {
+    if (stringp(s) != &truth) return makeSymbol("Error: Not a string");
+    return makeLong(s->data.atom.value.string_value->length);
+}
+// string-ref: one-character string at index
+SExp* stringRef(SExp* s, SExp* index) {
+    if (stringp(s) != &truth) return makeSymbol("Error: Not a string");
+    String* text = s->data.atom.value.string_value;
+    long i = stringIndex(index, text->length);
+    if (i < 0 || i == (long)text->length) return makeSymbol("Error: Index out of range");
+    return makeStringFrom(stringSlice(text, i, i + 1));
+}
+SExp* stringToSymbol(SExp* s) {
+    if (stringp(s) != &truth) return makeSymbol("Error: Not a string");
+    return makeSymbolN(stringChars(s->data.atom.value.string_value), s->data.atom.value.string_value->length);
+}
+// number->string: same text the number prints as
+SExp* numberToString(SExp* n) {
+    char text[64];
+    if (numberp(n) != &truth) return makeSymbol("Error: Operand not a number");
+    if (atomType(n) == ATOM_LONG) snprintf(text, sizeof(text), "%ld", n->data.atom.value.long_value);
+    else snprintf(text, sizeof(text), "%f", n->data.atom.value.double_value);
+    return makeString(text);
+}
+
 /* Sprint 5 functions */
 
+// read symbols and values as a matching pair while another thread may be in set
+void envSnapshot(Env* e, SExp** symbols, SExp** values) {
+    unsigned before, after;
+    do {
+        before = atomic_load_explicit(&e->version, memory_order_acquire);
+        *symbols = e->symbols;
+        *values = e->values;
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&e->version, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
+
 // lookup: find value from symbol in environment
 SExp* lookup(SExp* symbol, Env* env) {
 
     for (Env* e = env; e != NULL; e = e-> parent) { // iterate through environments if not found
-        SExp* syms = e->symbols;
-        SExp* vals = e->values;
+        SExp* syms;
+        SExp* vals;
+        envSnapshot(e, &syms, &vals);
         while (syms != &nil && vals != &nil) {
             if (strcmp(car(syms)->data.atom.value.symbol_value, symbol->data.atom.value.symbol_value) == 0) {
-                return car(vals);
+                return cellLoad(vals);
             }
             syms = cdr(syms);
             vals = cdr(vals);
@@ -564,12 +1231,19 @@ SExp* lookup(SExp* symbol, Env* env) {
 
 // adds new local env to chain of environments
 Env* consEnv(SExp* params, SExp* args, Env* parent) {
-    Env* e = malloc(sizeof(Env));
+    Env* e = newEnvFrame();
     e->symbols = params;
     e->values = args;
     e->parent = parent;
+    atomic_init(&e->version, 0);
     return e;
 }
+// give the running interpreter an empty global environment on first use
+void ensureGlobalEnv(void) {
+    if (!interp->globalEnv) {
+        interp->globalEnv = consEnv(&nil, &nil, NULL);
+    }
+}
 // helper to get length of list (for argument matching)
 int listLength (SExp* list) {
     int count = 0;
@@ -590,10 +1264,11 @@ SExp* reverseList(SExp* list){
 }
 // environment extension function to add new symbol value pairs
 Env* extendEnv (SExp* params, SExp* args, Env* parent) { 
-    Env* newEnv = malloc(sizeof(Env));
+    Env* newEnv = newEnvFrame();
     newEnv->symbols = &nil;
     newEnv->values = &nil;
     newEnv->parent = parent;
+    atomic_init(&newEnv->version, 0);
 
     while (params != &nil && args != &nil) {
         newEnv->symbols = cons(car(params), newEnv->symbols);
@@ -610,106 +1285,2322 @@ Env* extendEnv (SExp* params, SExp* args, Env* parent) {
 
 
 
-// set: add symbol-value pair to environment, will overwrite existing through recency in environment
-SExp* set(SExp* symbol, SExp* value, Env* env) {
+// add symbol-value pair in front of the bindings of env
+void envPush(Env* env, SExp* symbol, SExp* value) {
+    // odd version tells readers in envSnapshot to retry
+    atomic_fetch_add_explicit(&env->version, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
     env->symbols = cons(symbol, env->symbols);
     env->values = cons(value, env->values);
+    atomic_fetch_add_explicit(&env->version, 1, memory_order_release);
+}
+// value cell of symbol in env itself (not its parents), NULL if env does not bind it
+SExp* envCell(Env* env, SExp* symbol) {
+    if (symbolp(symbol) != &truth) return NULL;
+    SExp* vals = env->values;
+    for (SExp* syms = env->symbols; syms != &nil && vals != &nil; syms = syms->data.cons.cdr, vals = vals->data.cons.cdr) {
+        if (strcmp(consCar(syms)->data.atom.value.symbol_value, symbol->data.atom.value.symbol_value) == 0) return vals;
+    }
+    return NULL;
+}
+
+// set: add symbol-value pair to environment, will overwrite existing through recency in environment
+SExp* set(SExp* symbol, SExp* value, Env* env) {
+    pthread_mutex_lock(&interp->envLock);
+    // a local frame that binds symbol already is updated in place, so a loop
+    // setting its variables does not grow it; the global list is never scanned
+    SExp* cell = (env != interp->globalEnv) ? envCell(env, symbol) : NULL;
+    if (cell) cellStore(cell, value);
+    else envPush(env, symbol, value);
+    pthread_mutex_unlock(&interp->envLock);
     return value; // return stored value
 }
-// evaluate s-expression in given environment
-SExp* eval (SExp* sexp, Env* env) {
-    if (nilp(sexp) == &truth) return &nil; // nil returns nil
 
-    // atoms
-    if (sexp->type == SEXP_ATOM) {
-        switch (sexp->data.atom.type) {
+/* persistent maps and vectors
+        both are immutable: every update returns a new version that shares
+        all but the path to the change with the old one, so each takes
+        O(log32 n) time and memory and old versions stay valid.
+        Maps are hash array mapped tries (CHAMP layout): each node has a
+        32-bit map of positions holding a key and value inline and one of
+        positions holding a subnode, and stores only what is present.
+        Keys are compared by value (numbers, symbols, strings, lists) and
+        everything else by identity. Vectors are 32-way tries indexed by
+        the bits of the position, plus a tail leaf holding the last 1-32
+        elements so pushes and pops at the end rarely touch the trie.
+*/
+
+#define TRIE_BITS 5
+#define TRIE_WIDTH (1 << TRIE_BITS)
+#define TRIE_MASK (TRIE_WIDTH - 1)
+#define MAP_MAX_SHIFT 60 // deeper keys share all 64 hash bits: collision node
+
+typedef struct MapNode {
+    uint32_t dataMap;    // positions holding a key and value
+    uint32_t nodeMap;    // positions holding a subnode
+    uint32_t collisions; // entries of a collision node (both maps 0)
+    void* slots[];       // key and value per data position, then the subnodes
+} MapNode;
+
+typedef struct VectorNode {
+    uint32_t shift;      // 0 for leaves, whose slots are elements
+    uint32_t size;       // slots in use
+    void* slots[];
+} VectorNode;
+
+size_t ptrHash(void* key); // defined with the optimizer's maps
+
+size_t valueHash(SExp* s) {
+    if (s == &nil) return 0x9e3779b97f4a7c15ULL;
+    if (sexpType(s) == SEXP_ATOM) {
+        switch (atomType(s)) {
             case ATOM_LONG:
-            case ATOM_DOUBLE:
-            case ATOM_STRING:
-                return sexp; // self-evaluating
+                return ptrHash((void*)(uintptr_t)s->data.atom.value.long_value);
+            case ATOM_DOUBLE: {
+                double d = s->data.atom.value.double_value;
+                if (d == (long)d) return ptrHash((void*)(uintptr_t)(long)d); // equal to a long
+                uint64_t bits;
+                memcpy(&bits, &d, sizeof(bits));
+                return ptrHash((void*)(uintptr_t)bits);
+            }
             case ATOM_SYMBOL:
-                return lookup(sexp, env); // lookup in environment
+                return textHash(s->data.atom.value.symbol_value, strlen(s->data.atom.value.symbol_value));
+            case ATOM_STRING:
+                return stringHashOf(s->data.atom.value.string_value) * 31 + 7; // differ from the symbol
         }
     }
+    if (sexpType(s) == SEXP_LIST) {
+        size_t h = 17;
+        for (; sexpType(s) == SEXP_LIST && s != &nil; s = s->data.cons.cdr) h = h * 31 + valueHash(consCar(s));
+        return (s == &nil) ? h : h * 31 + valueHash(s);
+    }
+    return ptrHash(s);
+}
 
-    // lists
-    if (sexp->type == SEXP_LIST) {
-        SExp* func = car(sexp);
-        SExp* args = cdr(sexp);
+// key equality: numbers by value, symbols and strings by text, lists element-wise
+bool valueEqual(SExp* a, SExp* b) {
+    if (a == b) return true;
+    if (sexpType(a) != sexpType(b)) return false;
+    if (sexpType(a) == SEXP_ATOM) {
+        AtomType x = atomType(a), y = atomType(b);
+        if (x == ATOM_DOUBLE && y == ATOM_LONG) return valueEqual(b, a);
+        if (x == ATOM_LONG && y == ATOM_DOUBLE) {
+            double d = b->data.atom.value.double_value;
+            return d == (long)d && (long)d == a->data.atom.value.long_value;
+        }
+        if (x != y) return false;
+        switch (x) {
+            case ATOM_LONG: return a->data.atom.value.long_value == b->data.atom.value.long_value;
+            case ATOM_DOUBLE: return a->data.atom.value.double_value == b->data.atom.value.double_value;
+            case ATOM_SYMBOL: return strcmp(a->data.atom.value.symbol_value, b->data.atom.value.symbol_value) == 0;
+            case ATOM_STRING: return stringEqual(a->data.atom.value.string_value, b->data.atom.value.string_value);
+        }
+    }
+    if (sexpType(a) == SEXP_LIST) {
+        if (a == &nil || b == &nil) return false;
+        return valueEqual(consCar(a), consCar(b)) && valueEqual(a->data.cons.cdr, b->data.cons.cdr);
+    }
+    return false;
+}
 
-        if (func->type == SEXP_ATOM && func->data.atom.type == ATOM_SYMBOL) {
+size_t mapNodeSlots(MapNode* node) {
+    return 2 * (__builtin_popcount(node->dataMap) + node->collisions) + __builtin_popcount(node->nodeMap);
+}
 
-            char* fname = func->data.atom.value.symbol_value;
+MapNode* mapNodeNew(uint32_t dataMap, uint32_t nodeMap, uint32_t collisions) {
+    MapNode node = { dataMap, nodeMap, collisions };
+    size_t size = sizeof(MapNode) + mapNodeSlots(&node) * sizeof(void*);
+    MapNode* n = malloc(size);
+    allocatedBytes += size;
+    *n = node;
+    return n;
+}
 
-            // handle special forms
-            if (strcmp(fname, "quote") == 0) {
-                return car(args); // return quoted expression   
-            }
-            if (strcmp(fname, "set") == 0) {
-                SExp* var = car(args);
-                SExp* val = eval(cadr(args), env);
-                return set(var, val, env);
+// index in slots of the subnode at bit
+static inline size_t mapChildIndex(MapNode* node, uint32_t bit) {
+    return 2 * __builtin_popcount(node->dataMap) + __builtin_popcount(node->nodeMap & (bit - 1));
+}
+
+// slot holding the value of key, NULL if absent
+SExp** mapNodeFind(MapNode* node, SExp* key, size_t hash) {
+    for (int shift = 0; node != NULL; shift += TRIE_BITS) {
+        if (node->collisions) {
+            for (uint32_t i = 0; i < node->collisions; i++) {
+                if (valueEqual(node->slots[2 * i], key)) return (SExp**)&node->slots[2 * i + 1];
             }
-            if (strcmp(fname, "define") == 0) {
-                SExp* name = car(args);
-                SExp* value = cadr(args);
-                SExp* func = NULL;
+            return NULL;
+        }
+        uint32_t bit = 1u << ((hash >> shift) & TRIE_MASK);
+        if (node->dataMap & bit) {
+            size_t i = 2 * __builtin_popcount(node->dataMap & (bit - 1));
+            return valueEqual(node->slots[i], key) ? (SExp**)&node->slots[i + 1] : NULL;
+        }
+        if (!(node->nodeMap & bit)) return NULL;
+        node = node->slots[mapChildIndex(node, bit)];
+    }
+    return NULL;
+}
 
-                if (value->type == SEXP_LIST && car(value)->type == SEXP_ATOM && strcmp(car(value)->data.atom.value.symbol_value, "lambda") == 0) {
-                    func = eval(value, env);
-                }
-                else {
-                    SExp* params = cadr(args);
-                    SExp* body = caddr(args);
+// node holding two entries whose hashes agree below shift
+MapNode* mapNodePair(SExp* k1, SExp* v1, size_t h1, SExp* k2, SExp* v2, size_t h2, int shift) {
+    if (shift > MAP_MAX_SHIFT) {
+        MapNode* node = mapNodeNew(0, 0, 2);
+        node->slots[0] = k1; node->slots[1] = v1;
+        node->slots[2] = k2; node->slots[3] = v2;
+        return node;
+    }
+    uint32_t i1 = (h1 >> shift) & TRIE_MASK, i2 = (h2 >> shift) & TRIE_MASK;
+    if (i1 == i2) {
+        MapNode* node = mapNodeNew(0, 1u << i1, 0);
+        node->slots[0] = mapNodePair(k1, v1, h1, k2, v2, h2, shift + TRIE_BITS);
+        return node;
+    }
+    MapNode* node = mapNodeNew(1u << i1 | 1u << i2, 0, 0);
+    int first = i1 < i2 ? 0 : 2;
+    node->slots[first] = k1; node->slots[first + 1] = v1;
+    node->slots[2 - first] = k2; node->slots[3 - first] = v2;
+    return node;
+}
 
-                    func = malloc(sizeof(SExp));
-                    func->type = SEXP_LAMBDA;
-                    func->data.func.params = params;
-                    func->data.func.body = body;
-                    func->data.func.env = env;
-                }
+// copy of node with count slots inserted (count > 0) or removed (count < 0) at index
+MapNode* mapNodeSplice(MapNode* node, uint32_t dataMap, uint32_t nodeMap, uint32_t collisions, size_t index, int count) {
+    MapNode* copy = mapNodeNew(dataMap, nodeMap, collisions);
+    size_t old = mapNodeSlots(node);
+    if (count >= 0) {
+        memcpy(copy->slots, node->slots, index * sizeof(void*));
+        memcpy(copy->slots + index + count, node->slots + index, (old - index) * sizeof(void*));
+    }
+    else {
+        memcpy(copy->slots, node->slots, index * sizeof(void*));
+        memcpy(copy->slots + index, node->slots + index - count, (old - index + count) * sizeof(void*));
+    }
+    return copy;
+}
 
-                set(name, func, env);
+MapNode* mapNodeCopy(MapNode* node) {
+    return mapNodeSplice(node, node->dataMap, node->nodeMap, node->collisions, 0, 0);
+}
 
-                return name;
-            }
-            if (strcmp(fname, "lambda") == 0) {
-                SExp* params = car(args);
-                SExp* body = cadr(args);
+// copy of node with the entry at bit replaced by subnode child
+MapNode* mapNodeMoveDown(MapNode* node, uint32_t bit, MapNode* child) {
+    MapNode* copy = mapNodeNew(node->dataMap & ~bit, node->nodeMap | bit, 0);
+    size_t data = 2 * __builtin_popcount(node->dataMap);
+    size_t nodes = __builtin_popcount(node->nodeMap);
+    size_t i = 2 * __builtin_popcount(node->dataMap & (bit - 1));
+    size_t before = __builtin_popcount(node->nodeMap & (bit - 1));
+    memcpy(copy->slots, node->slots, i * sizeof(void*));
+    memcpy(copy->slots + i, node->slots + i + 2, (data - i - 2 + before) * sizeof(void*));
+    copy->slots[data - 2 + before] = child;
+    memcpy(copy->slots + data - 1 + before, node->slots + data + before, (nodes - before) * sizeof(void*));
+    return copy;
+}
 
-                SExp* func = malloc(sizeof(SExp));
-                func->type = SEXP_LAMBDA;
-                func->data.func.params = params;
-                func->data.func.body = body;
-                func->data.func.env = env;
+// copy of node with the subnode at bit replaced by its only entry
+MapNode* mapNodeMoveUp(MapNode* node, uint32_t bit, SExp* key, SExp* value) {
+    MapNode* copy = mapNodeNew(node->dataMap | bit, node->nodeMap & ~bit, 0);
+    size_t data = 2 * __builtin_popcount(node->dataMap);
+    size_t nodes = __builtin_popcount(node->nodeMap);
+    size_t i = 2 * __builtin_popcount(node->dataMap & (bit - 1));
+    size_t before = __builtin_popcount(node->nodeMap & (bit - 1));
+    memcpy(copy->slots, node->slots, i * sizeof(void*));
+    copy->slots[i] = key;
+    copy->slots[i + 1] = value;
+    memcpy(copy->slots + i + 2, node->slots + i, (data - i + before) * sizeof(void*));
+    memcpy(copy->slots + data + 2 + before, node->slots + data + before + 1, (nodes - before - 1) * sizeof(void*));
+    return copy;
+}
 
-                return func;
+// node with key bound to value; *added tells whether key is new
+MapNode* mapNodePut(MapNode* node, SExp* key, SExp* value, size_t hash, int shift, bool* added) {
+    if (node == NULL) {
+        *added = true;
+        MapNode* leaf = mapNodeNew(1u << ((hash >> shift) & TRIE_MASK), 0, 0);
+        leaf->slots[0] = key;
+        leaf->slots[1] = value;
+        return leaf;
+    }
+    if (node->collisions) {
+        for (uint32_t i = 0; i < node->collisions; i++) {
+            if (valueEqual(node->slots[2 * i], key)) {
+                MapNode* copy = mapNodeCopy(node);
+                copy->slots[2 * i + 1] = value;
+                return copy;
             }
+        }
+        *added = true;
+        MapNode* copy = mapNodeSplice(node, 0, 0, node->collisions + 1, 2 * node->collisions, 2);
+        copy->slots[2 * node->collisions] = key;
+        copy->slots[2 * node->collisions + 1] = value;
+        return copy;
+    }
 
+    uint32_t bit = 1u << ((hash >> shift) & TRIE_MASK);
+    if (node->dataMap & bit) {
+        size_t i = 2 * __builtin_popcount(node->dataMap & (bit - 1));
+        SExp* oldKey = node->slots[i];
+        SExp* oldValue = node->slots[i + 1];
+        if (valueEqual(oldKey, key)) {
+            if (oldValue == value) return node;
+            MapNode* copy = mapNodeCopy(node);
+            copy->slots[i + 1] = value;
+            return copy;
+        }
+        // two keys at one position: they move down into a subnode
+        *added = true;
+        MapNode* child = mapNodePair(oldKey, oldValue, valueHash(oldKey), key, value, hash, shift + TRIE_BITS);
+        return mapNodeMoveDown(node, bit, child);
+    }
+    if (node->nodeMap & bit) {
+        size_t at = mapChildIndex(node, bit);
+        MapNode* child = mapNodePut(node->slots[at], key, value, hash, shift + TRIE_BITS, added);
+        if (child == node->slots[at]) return node;
+        MapNode* copy = mapNodeCopy(node);
+        copy->slots[at] = child;
+        return copy;
+    }
+    *added = true;
+    size_t i = 2 * __builtin_popcount(node->dataMap & (bit - 1));
+    MapNode* copy = mapNodeSplice(node, node->dataMap | bit, node->nodeMap, 0, i, 2);
+    copy->slots[i] = key;
+    copy->slots[i + 1] = value;
+    return copy;
+}
 
-            // lists
-            if (strcmp(fname, "cons") == 0) {
-                SExp* head = eval(car(args), env);
-                SExp* tail = eval(cadr(args), env);
-                return cons(head, tail);
-            }
-            if (strcmp(fname, "car") == 0) {
-                return car(eval(car(args), env));
-            }
-            if (strcmp(fname, "cdr") == 0) {
-                return cdr(eval(car(args), env));
+// node without key, NULL if it became empty; *removed tells whether key was there
+MapNode* mapNodeRemove(MapNode* node, SExp* key, size_t hash, int shift, bool* removed) {
+    if (node->collisions) {
+        for (uint32_t i = 0; i < node->collisions; i++) {
+            if (valueEqual(node->slots[2 * i], key)) {
+                *removed = true;
+                if (node->collisions == 1) return NULL;
+                return mapNodeSplice(node, 0, 0, node->collisions - 1, 2 * i, -2);
             }
+        }
+        return node;
+    }
 
-            // short-circuiting functions
-            if (strcmp(fname, "and") == 0) {
-                SExp* first = eval(car(args), env);
-                if (first == &nil) return &nil;
-                return eval(cadr(args), env);
-            }
-            if (strcmp(fname, "or") == 0) {
-                SExp* first = eval(car(args), env);
-                if (first != &nil) return &truth;
-                return eval(cadr(args), env);
+    uint32_t bit = 1u << ((hash >> shift) & TRIE_MASK);
+    if (node->dataMap & bit) {
+        size_t i = 2 * __builtin_popcount(node->dataMap & (bit - 1));
+        if (!valueEqual(node->slots[i], key)) return node;
+        *removed = true;
+        if (node->dataMap == bit && node->nodeMap == 0) return NULL;
+        return mapNodeSplice(node, node->dataMap & ~bit, node->nodeMap, 0, i, -2);
+    }
+    if (!(node->nodeMap & bit)) return node;
+
+    size_t at = mapChildIndex(node, bit);
+    MapNode* child = mapNodeRemove(node->slots[at], key, hash, shift + TRIE_BITS, removed);
+    if (child == node->slots[at]) return node;
+    if (child == NULL) {
+        if (node->dataMap == 0 && node->nodeMap == bit) return NULL;
+        return mapNodeSplice(node, node->dataMap, node->nodeMap & ~bit, 0, at, -1);
+    }
+    // a subnode left with one entry is folded back into this node
+    bool single = child->nodeMap == 0 && (child->collisions == 1 || (child->collisions == 0 && __builtin_popcount(child->dataMap) == 1));
+    if (single) return mapNodeMoveUp(node, bit, child->slots[0], child->slots[1]);
+    MapNode* copy = mapNodeCopy(node);
+    copy->slots[at] = child;
+    return copy;
+}
+
+// prepend the (key . value) pairs under node to list
+SExp* mapNodeEntries(MapNode* node, SExp* list) {
+    if (node == NULL) return list;
+    size_t entries = node->collisions ? node->collisions : (size_t)__builtin_popcount(node->dataMap);
+    for (int i = __builtin_popcount(node->nodeMap); i > 0; i--) {
+        list = mapNodeEntries(node->slots[2 * entries + i - 1], list);
+    }
+    for (size_t i = entries; i > 0; i--) {
+        list = cons(cons(node->slots[2 * i - 2], node->slots[2 * i - 1]), list);
+    }
+    return list;
+}
+
+SExp* makeMap(MapNode* root, size_t count) {
+    SExp* s = newSExp(SEXP_MAP);
+    s->data.map.root = root;
+    s->data.map.count = count;
+    return s;
+}
+
+SExp* mapp(SExp* x) {
+    return (sexpType(x) == SEXP_MAP) ? &truth : &nil;
+}
+// (map-get m key): value of key, nil if absent
+SExp* mapGet(SExp* m, SExp* key) {
+    if (sexpType(m) != SEXP_MAP) return makeSymbol("Error: Not a map");
+    SExp** slot = mapNodeFind(m->data.map.root, key, valueHash(key));
+    return slot ? *slot : &nil;
+}
+SExp* mapContains(SExp* m, SExp* key) {
+    if (sexpType(m) != SEXP_MAP) return makeSymbol("Error: Not a map");
+    return mapNodeFind(m->data.map.root, key, valueHash(key)) ? &truth : &nil;
+}
+// (map-put m key value): m with key bound to value
+SExp* mapPut(SExp* m, SExp* key, SExp* value) {
+    if (sexpType(m) != SEXP_MAP) return makeSymbol("Error: Not a map");
+    bool added = false;
+    MapNode* root = mapNodePut(m->data.map.root, key, value, valueHash(key), 0, &added);
+    return (root == m->data.map.root) ? m : makeMap(root, m->data.map.count + added);
+}
+// (map-remove m key): m without key
+SExp* mapRemove(SExp* m, SExp* key) {
+    if (sexpType(m) != SEXP_MAP) return makeSymbol("Error: Not a map");
+    if (m->data.map.root == NULL) return m;
+    bool removed = false;
+    MapNode* root = mapNodeRemove(m->data.map.root, key, valueHash(key), 0, &removed);
+    return removed ? makeMap(root, m->data.map.count - 1) : m;
+}
+SExp* mapCount(SExp* m) {
+    if (sexpType(m) != SEXP_MAP) return makeSymbol("Error: Not a map");
+    return makeLong((long)m->data.map.count);
+}
+// (map->list m): list of (key . value) pairs, in no particular order
+SExp* mapToList(SExp* m) {
+    if (sexpType(m) != SEXP_MAP) return makeSymbol("Error: Not a map");
+    return mapNodeEntries(m->data.map.root, &nil);
+}
+SExp* mapKeys(SExp* m) {
+    if (sexpType(m) != SEXP_MAP) return makeSymbol("Error: Not a map");
+    SExp* keys = &nil;
+    for (SExp* rest = mapNodeEntries(m->data.map.root, &nil); rest != &nil; rest = cdr(rest)) {
+        keys = cons(consCar(consCar(rest)), keys);
+    }
+    return reverseList(keys);
+}
+// (hash-map key value ...): map of the given pairs, later ones winning
+SExp* hashMap(SExp* args) {
+    SExp* m = makeMap(NULL, 0);
+    for (; args != &nil; args = cdr(cdr(args))) {
+        if (cdr(args) == &nil) return makeSymbol("Error: Missing value");
+        m = mapPut(m, car(args), cadr(args));
+    }
+    return m;
+}
+
+VectorNode* vectorNodeNew(uint32_t shift, uint32_t size) {
+    size_t bytes = sizeof(VectorNode) + size * sizeof(void*);
+    VectorNode* node = malloc(bytes);
+    allocatedBytes += bytes;
+    node->shift = shift;
+    node->size = size;
+    return node;
+}
+
+// copy of node with size slots (more or fewer than it has)
+VectorNode* vectorNodeResize(VectorNode* node, uint32_t size) {
+    VectorNode* copy = vectorNodeNew(node->shift, size);
+    memcpy(copy->slots, node->slots, (size < node->size ? size : node->size) * sizeof(void*));
+    return copy;
+}
+
+// index of the first element in the tail
+static inline size_t vectorTailOffset(size_t count) {
+    return (count == 0) ? 0 : (count - 1) & ~(size_t)TRIE_MASK;
+}
+
+SExp* makeVectorFrom(size_t count, VectorNode* root, VectorNode* tail) {
+    SExp* s = newSExp(SEXP_VECTOR);
+    s->data.vector.count = count;
+    s->data.vector.root = root;
+    s->data.vector.tail = tail;
+    return s;
+}
+
+// leaf holding element i
+VectorNode* vectorLeaf(Vector* v, size_t i) {
+    if (i >= vectorTailOffset(v->count)) return v->tail;
+    VectorNode* node = v->root;
+    while (node->shift > 0) node = node->slots[(i >> node->shift) & TRIE_MASK];
+    return node;
+}
+
+// node with element i replaced by x
+VectorNode* vectorNodeSet(VectorNode* node, size_t i, SExp* x) {
+    VectorNode* copy = vectorNodeResize(node, node->size);
+    size_t at = (i >> node->shift) & TRIE_MASK;
+    copy->slots[at] = (node->shift == 0) ? (void*)x : (void*)vectorNodeSet(node->slots[at], i, x);
+    return copy;
+}
+
+// chain of single-child nodes from shift down to leaf
+VectorNode* vectorNodePath(uint32_t shift, VectorNode* leaf) {
+    if (shift == 0) return leaf;
+    VectorNode* node = vectorNodeNew(shift, 1);
+    node->slots[0] = vectorNodePath(shift - TRIE_BITS, leaf);
+    return node;
+}
+
+// node with leaf appended as the leaf of elements from offset on
+VectorNode* vectorNodePush(VectorNode* node, size_t offset, VectorNode* leaf) {
+    size_t at = (offset >> node->shift) & TRIE_MASK;
+    VectorNode* child;
+    if (node->shift == TRIE_BITS) child = leaf;
+    else if (at < node->size) child = vectorNodePush(node->slots[at], offset, leaf);
+    else child = vectorNodePath(node->shift - TRIE_BITS, leaf);
+    VectorNode* copy = vectorNodeResize(node, at < node->size ? node->size : at + 1);
+    copy->slots[at] = child;
+    return copy;
+}
+
+// node without its last leaf, which holds element i; NULL if nothing is left
+VectorNode* vectorNodePop(VectorNode* node, size_t i) {
+    size_t at = (i >> node->shift) & TRIE_MASK;
+    if (node->shift > TRIE_BITS) {
+        VectorNode* child = vectorNodePop(node->slots[at], i);
+        if (child == NULL && at == 0) return NULL;
+        VectorNode* copy = vectorNodeResize(node, child ? at + 1 : at);
+        if (child) copy->slots[at] = child;
+        return copy;
+    }
+    return (at == 0) ? NULL : vectorNodeResize(node, at);
+}
+
+SExp* vectorp(SExp* x) {
+    return (sexpType(x) == SEXP_VECTOR) ? &truth : &nil;
+}
+// (vector-push v x): v with x added at the end
+SExp* vectorPush(SExp* v, SExp* x) {
+    if (sexpType(v) != SEXP_VECTOR) return makeSymbol("Error: Not a vector");
+    Vector* vec = &v->data.vector;
+    size_t offset = vectorTailOffset(vec->count);
+    size_t tailSize = vec->count - offset;
+    if (vec->count == 0 || tailSize < TRIE_WIDTH) {
+        VectorNode* tail = vec->tail ? vectorNodeResize(vec->tail, tailSize + 1) : vectorNodeNew(0, 1);
+        tail->slots[tailSize] = x;
+        return makeVectorFrom(vec->count + 1, vec->root, tail);
+    }
+    // full tail moves into the trie, which grows a level when it is full too
+    VectorNode* root;
+    if (vec->root == NULL) {
+        root = vectorNodePath(TRIE_BITS, vec->tail);
+    }
+    else if (offset == (size_t)1 << (vec->root->shift + TRIE_BITS)) {
+        root = vectorNodeNew(vec->root->shift + TRIE_BITS, 2);
+        root->slots[0] = vec->root;
+        root->slots[1] = vectorNodePath(vec->root->shift, vec->tail);
+    }
+    else {
+        root = vectorNodePush(vec->root, offset, vec->tail);
+    }
+    VectorNode* tail = vectorNodeNew(0, 1);
+    tail->slots[0] = x;
+    return makeVectorFrom(vec->count + 1, root, tail);
+}
+// (vector-pop v): v without its last element
+SExp* vectorPop(SExp* v) {
+    if (sexpType(v) != SEXP_VECTOR) return makeSymbol("Error: Not a vector");
+    Vector* vec = &v->data.vector;
+    if (vec->count == 0) return makeSymbol("Error: Index out of range");
+    if (vec->count == 1) return makeVectorFrom(0, NULL, NULL);
+    size_t tailSize = vec->count - vectorTailOffset(vec->count);
+    if (tailSize > 1) return makeVectorFrom(vec->count - 1, vec->root, vectorNodeResize(vec->tail, tailSize - 1));
+
+    // the last leaf of the trie becomes the tail
+    VectorNode* tail = vectorLeaf(vec, vec->count - 2);
+    VectorNode* root = vectorNodePop(vec->root, vec->count - 2);
+    if (root && root->shift > TRIE_BITS && root->size == 1) root = root->slots[0];
+    return makeVectorFrom(vec->count - 1, root, tail);
+}
+// (vector-ref v i): element i
+SExp* vectorRef(SExp* v, SExp* index) {
+    if (sexpType(v) != SEXP_VECTOR) return makeSymbol("Error: Not a vector");
+    long i = stringIndex(index, v->data.vector.count);
+    if (i < 0 || (size_t)i == v->data.vector.count) return makeSymbol("Error: Index out of range");
+    return vectorLeaf(&v->data.vector, i)->slots[i & TRIE_MASK];
+}
+// (vector-set v i x): v with element i replaced by x
+SExp* vectorSet(SExp* v, SExp* index, SExp* x) {
+    if (sexpType(v) != SEXP_VECTOR) return makeSymbol("Error: Not a vector");
+    Vector* vec = &v->data.vector;
+    long i = stringIndex(index, vec->count);
+    if (i < 0 || (size_t)i == vec->count) return makeSymbol("Error: Index out of range");
+    if ((size_t)i >= vectorTailOffset(vec->count)) {
+        VectorNode* tail = vectorNodeResize(vec->tail, vec->tail->size);
+        tail->slots[i & TRIE_MASK] = x;
+        return makeVectorFrom(vec->count, vec->root, tail);
+    }
+    return makeVectorFrom(vec->count, vectorNodeSet(vec->root, i, x), vec->tail);
+}
+SExp* vectorLength(SExp* v) {
+    if (sexpType(v) != SEXP_VECTOR) return makeSymbol("Error: Not a vector");
+    return makeLong((long)v->data.vector.count);
+}
+SExp* vectorToList(SExp* v) {
+    if (sexpType(v) != SEXP_VECTOR) return makeSymbol("Error: Not a vector");
+    SExp* list = &nil;
+    for (size_t i = v->data.vector.count; i > 0; i--) {
+        list = cons(vectorLeaf(&v->data.vector, i - 1)->slots[(i - 1) & TRIE_MASK], list);
+    }
+    return list;
+}
+// (list->vector l) and (vector x ...)
+SExp* listToVector(SExp* list) {
+    if (sexpType(list) != SEXP_LIST) return makeSymbol("Error: Not a list");
+    SExp* v = makeVectorFrom(0, NULL, NULL);
+    for (; list != &nil && sexpType(list) == SEXP_LIST; list = list->data.cons.cdr) {
+        v = vectorPush(v, consCar(list));
+    }
+    return v;
+}
+
+/* optimizer: constant folding of function bodies */
+
+bool dumpOptimized = false; // -dump-opt: print each optimized body to stderr
+
+size_t ptrHash(void* key) {
+    uint64_t k = (uint64_t)(uintptr_t)key;
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    return (size_t)k;
+}
+
+void* ptrMapGet(PtrMap* map, void* key) {
+    if (map->count == 0) return NULL;
+    size_t mask = map->capacity - 1;
+    for (size_t i = ptrHash(key) & mask; map->keys[i] != NULL; i = (i + 1) & mask) {
+        if (map->keys[i] == key) return map->values[i];
+    }
+    return NULL;
+}
+
+void ptrMapPut(PtrMap* map, void* key, void* value) {
+    // grow at half load
+    if ((map->count + 1) * 2 > map->capacity) {
+        size_t oldCapacity = map->capacity;
+        void** oldKeys = map->keys;
+        void** oldValues = map->values;
+        map->capacity = oldCapacity ? oldCapacity * 2 : 64;
+        map->keys = calloc(map->capacity, sizeof(void*));
+        map->values = calloc(map->capacity, sizeof(void*));
+        map->count = 0;
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (oldKeys[i] != NULL) ptrMapPut(map, oldKeys[i], oldValues[i]);
+        }
+        free(oldKeys);
+        free(oldValues);
+    }
+    size_t mask = map->capacity - 1;
+    size_t i = ptrHash(key) & mask;
+    while (map->keys[i] != NULL && map->keys[i] != key) {
+        i = (i + 1) & mask;
+    }
+    if (map->keys[i] == NULL) map->count++;
+    map->keys[i] = key;
+    map->values[i] = value;
+}
+
+// check if s-expression is the symbol with given name
+bool isSymbolNamed(SExp* s, const char* name) {
+    return sexpType(s) == SEXP_ATOM && atomType(s) == ATOM_SYMBOL && strcmp(s->data.atom.value.symbol_value, name) == 0;
+}
+// check if s-expression is an error symbol returned by a builtin
+bool isErrorSExp(SExp* s) {
+    return sexpType(s) == SEXP_ATOM && atomType(s) == ATOM_SYMBOL && strncmp(s->data.atom.value.symbol_value, "Error", 5) == 0;
+}
+// check if list is nil-terminated (safe to walk with car/cdr without error output)
+bool isProperList(SExp* s) {
+    while (s != &nil) {
+        if (sexpType(s) != SEXP_LIST) return false;
+        s = s->data.cons.cdr;
+    }
+    return true;
+}
+// nil, numbers and strings evaluate to themselves
+bool isSelfEvaluating(SExp* s) {
+    return s == &nil || (sexpType(s) == SEXP_ATOM && atomType(s) != ATOM_SYMBOL);
+}
+// literal or quoted expression: evaluates to the same value every time
+bool isConstantExpr(SExp* s) {
+    if (isSelfEvaluating(s)) return true;
+    return sexpType(s) == SEXP_LIST && isProperList(s) && isSymbolNamed(car(s), "quote");
+}
+// value of a constant expression
+SExp* constantValue(SExp* s) {
+    return isSelfEvaluating(s) ? s : cadr(s);
+}
+// expression that evaluates to given value
+SExp* constantExpr(SExp* value) {
+    if (isSelfEvaluating(value)) return value;
+    return cons(makeSymbol("quote"), cons(value, &nil));
+}
+
+typedef struct PureBuiltin {
+    const char* name;
+    SExp* (*unary)(SExp*);          // one-argument builtins
+    SExp* (*binary)(SExp*, SExp*);  // two-argument builtins
+} PureBuiltin;
+
+// builtins without side effects; eval dispatches these by name before any
+// environment lookup, so user definitions can never shadow them
+PureBuiltin pureBuiltins[] = {
+    {"cons", NULL, cons}, {"car", car, NULL}, {"cdr", cdr, NULL},
+    {"add", NULL, add}, {"sub", NULL, sub}, {"mul", NULL, mul}, {"div", NULL, divide}, {"mod", NULL, mod},
+    {"lt", NULL, lt}, {"gt", NULL, gt}, {"lte", NULL, lte}, {"gte", NULL, gte}, {"eq", NULL, eq},
+    {"not", notf, NULL}, {"nil?", nilp, NULL}, {"symbol?", symbolp, NULL},
+    {"number?", numberp, NULL}, {"string?", stringp, NULL}, {"list?", listp, NULL},
+    {"string-length", stringLength, NULL}, {"string-ref", NULL, stringRef},
+    {"string->symbol", stringToSymbol, NULL}, {"number->string", numberToString, NULL},
+    {"map-get", NULL, mapGet}, {"map-remove", NULL, mapRemove}, {"map-contains?", NULL, mapContains},
+    {"map-count", mapCount, NULL}, {"map-keys", mapKeys, NULL}, {"map->list", mapToList, NULL}, {"map?", mapp, NULL},
+    {"vector-ref", NULL, vectorRef}, {"vector-push", NULL, vectorPush}, {"vector-pop", vectorPop, NULL},
+    {"vector-length", vectorLength, NULL}, {"vector->list", vectorToList, NULL}, {"list->vector", listToVector, NULL},
+    {"vector?", vectorp, NULL},
+    {NULL, NULL, NULL}
+};
+
+SExp* optimizeExpr(SExp* s); // forward declaration for optimizeArgs
+
+// optimize first count elements of argument list (all if count < 0), sharing unchanged structure
+SExp* optimizeArgs(SExp* args, int count) {
+    if (args == &nil || count == 0) return args;
+    SExp* head = optimizeExpr(car(args));
+    SExp* tail = optimizeArgs(cdr(args), count - 1);
+    if (head == car(args) && tail == cdr(args)) return args;
+    return cons(head, tail);
+}
+
+// check if first count arguments are constants (missing arguments evaluate to nil)
+bool allConstant(SExp* args, int count) {
+    for (int i = 0; i < count && args != &nil; i++) {
+        if (!isConstantExpr(car(args))) return false;
+        args = cdr(args);
+    }
+    return true;
+}
+
+// apply builtin to constant arguments, NULL if the result must be left to runtime
+SExp* foldBuiltin(PureBuiltin* builtin, SExp* args) {
+    SExp* x = constantValue(car(args));
+    SExp* result;
+    if (builtin->unary) {
+        // car/cdr on atoms report errors at runtime
+        if ((builtin->unary == car || builtin->unary == cdr) && sexpType(x) != SEXP_LIST) return NULL;
+        result = builtin->unary(x);
+    }
+    else {
+        result = builtin->binary(x, constantValue(cadr(args)));
+    }
+    return isErrorSExp(result) ? NULL : constantExpr(result);
+}
+
+SExp* optimizeExpr(SExp* s);
+
+// optimize the expressions after the name of each (name expr...) binding
+SExp* optimizeBindings(SExp* bindings) {
+    if (bindings == &nil) return bindings;
+    SExp* binding = car(bindings);
+    SExp* head = binding;
+    if (binding != &nil && sexpType(binding) == SEXP_LIST && isProperList(binding)) {
+        SExp* exprs = optimizeArgs(cdr(binding), -1);
+        if (exprs != cdr(binding)) head = cons(car(binding), exprs);
+    }
+    SExp* tail = optimizeBindings(cdr(bindings));
+    if (head == binding && tail == cdr(bindings)) return bindings;
+    return cons(head, tail);
+}
+
+// drop clauses with constant false tests and everything after a constant true test
+SExp* optimizeCond(SExp* s) {
+    SExp* clauses = &nil; // optimized clauses, reversed
+    bool changed = false;
+    for (SExp* rest = cdr(s); rest != &nil; rest = cdr(rest)) {
+        SExp* clause = car(rest);
+        if (!isProperList(clause)) return s; // malformed clauses report errors at runtime
+
+        SExp* newClause = optimizeArgs(clause, 2);
+        SExp* test = car(newClause);
+        if (newClause != clause) changed = true;
+        if (isConstantExpr(test)) {
+            if (!sexpToBool(constantValue(test))) {
+                changed = true; // never selected
+                continue;
+            }
+            if (clauses == &nil) return cadr(newClause); // always selected
+            clauses = cons(newClause, clauses);
+            if (cdr(rest) != &nil) changed = true; // later clauses unreachable
+            break;
+        }
+        clauses = cons(newClause, clauses);
+    }
+    if (!changed) return s;
+    return cons(car(s), reverseList(clauses));
+}
+
+// fold constant subexpressions and prune constant branches
+SExp* optimizeExpr(SExp* s) {
+    if (s == &nil || sexpType(s) != SEXP_LIST || !isProperList(s)) return s;
+    SExp* head = car(s);
+    SExp* args = cdr(s);
+
+    if (sexpType(head) == SEXP_ATOM && atomType(head) == ATOM_SYMBOL) {
+        char* fname = head->data.atom.value.symbol_value;
+
+        if (strcmp(fname, "quote") == 0) {
+            return isSelfEvaluating(car(args)) ? car(args) : s;
+        }
+        if (strcmp(fname, "lambda") == 0 || strcmp(fname, "define") == 0) {
+            return s; // optimized when the function is created
+        }
+        if (strcmp(fname, "let") == 0 || strcmp(fname, "let*") == 0 || strcmp(fname, "letrec") == 0 || strcmp(fname, "do") == 0) {
+            // (let bindings body...) and (do specs (test result...) body...): names stay, expressions are optimized
+            if (args == &nil || !isProperList(car(args))) return s;
+            SExp* bindings = optimizeBindings(car(args));
+            SExp* rest = optimizeArgs(cdr(args), -1);
+            return (bindings == car(args) && rest == cdr(args)) ? s : cons(head, cons(bindings, rest));
+        }
+        if (strcmp(fname, "while") == 0) {
+            SExp* newArgs = optimizeArgs(args, -1);
+            return (newArgs == args) ? s : cons(head, newArgs);
+        }
+        if (strcmp(fname, "set") == 0) {
+            if (args == &nil) return s;
+            SExp* value = optimizeArgs(cdr(args), 1);
+            return (value == cdr(args)) ? s : cons(head, cons(car(args), value));
+        }
+        if (strcmp(fname, "if") == 0) {
+            SExp* newArgs = optimizeArgs(args, 3);
+            if (isConstantExpr(car(newArgs))) {
+                return sexpToBool(constantValue(car(newArgs))) ? cadr(newArgs) : caddr(newArgs);
+            }
+            return (newArgs == args) ? s : cons(head, newArgs);
+        }
+        if (strcmp(fname, "and") == 0 || strcmp(fname, "or") == 0) {
+            SExp* newArgs = optimizeArgs(args, 2);
+            if (isConstantExpr(car(newArgs))) {
+                bool first = sexpToBool(constantValue(car(newArgs)));
+                if (strcmp(fname, "and") == 0) return first ? cadr(newArgs) : &nil;
+                return first ? constantExpr(&truth) : cadr(newArgs);
+            }
+            return (newArgs == args) ? s : cons(head, newArgs);
+        }
+        if (strcmp(fname, "cond") == 0) {
+            return optimizeCond(s);
+        }
+        for (PureBuiltin* builtin = pureBuiltins; builtin->name != NULL; builtin++) {
+            if (strcmp(fname, builtin->name) == 0) {
+                int arity = builtin->unary ? 1 : 2;
+                SExp* newArgs = optimizeArgs(args, arity);
+                if (allConstant(newArgs, arity)) {
+                    SExp* folded = foldBuiltin(builtin, newArgs);
+                    if (folded) return folded;
+                }
+                // arithmetic and comparisons get a call site of their own
+                for (int op = 0; op < OP_COUNT; op++) {
+                    if (strcmp(fname, opNames[op]) == 0) return cons(makeCallSite(op), newArgs);
+                }
+                return (newArgs == args) ? s : cons(head, newArgs);
+            }
+        }
+    }
+    else if (sexpType(head) != SEXP_LIST) {
+        return s; // non-function head: form evaluates to itself
+    }
+
+    // call of user function: eval returns the form itself if the callee turns
+    // out not to be a function, so remember the source of rewritten calls
+    SExp* newForm = optimizeArgs(s, -1);
+    if (newForm != s) ptrMapPut(&interp->originalForms, newForm, s);
+    return newForm;
+}
+
+// source form of a (possibly rewritten) call
+SExp* originalForm(SExp* s) {
+    pthread_mutex_lock(&interp->optimizerLock);
+    SExp* original = ptrMapGet(&interp->originalForms, s);
+    pthread_mutex_unlock(&interp->optimizerLock);
+    return original ? original : s;
+}
+
+// optimize function body once, reusing the result for closures created from the same source
+SExp* optimizeBody(const char* name, SExp* body) {
+    pthread_mutex_lock(&interp->optimizerLock);
+    SExp* optimized = ptrMapGet(&interp->optimizedBodies, body);
+    if (!optimized) {
+        optimized = optimizeExpr(body);
+        ptrMapPut(&interp->optimizedBodies, body, optimized);
+        if (dumpOptimized) {
+            fprintf(stderr, "[opt] %s: ", name);
+            fprintSExp(stderr, optimized);
+            fprintf(stderr, "\n");
+        }
+    }
+    pthread_mutex_unlock(&interp->optimizerLock);
+    return optimized;
+}
+
+void jitAttach(SExp* func, const char* name); // defined with the template JIT
+
+// construct function object; its body is optimized on the first call (see lambdaBody)
+SExp* makeLambda(const char* name, SExp* params, SExp* body, Env* env) {
+    SExp* func = newSExp(SEXP_LAMBDA);
+    func->data.func.params = params;
+    func->data.func.body = body;
+    func->data.func.env = env;
+    jitAttach(func, name);
+    return func;
+}
+
+// thread pool functions (defined after eval)
+SExp* makeFuture(SExp* expr, Env* env);
+SExp* touch(SExp* value);
+SExp* pmap(SExp* fn, SExp* fnExpr, SExp* list, Env* env);
+
+// promise and stream functions (defined after the thread pool)
+SExp* makePromise(SExp* expr, Env* env);
+SExp* force(SExp* value);
+SExp* streamCdr(SExp* stream);
+SExp* streamMap(SExp* fn, SExp* fnExpr, SExp* stream, Env* env);
+SExp* streamFilter(SExp* fn, SExp* fnExpr, SExp* stream, Env* env);
+SExp* streamTake(SExp* stream, SExp* count);
+
+// file port functions (defined after streams)
+SExp* openInput(SExp* path);
+SExp* openOutput(SExp* path);
+SExp* readLine(SExp* port);
+SExp* readSExp(SExp* port);
+SExp* writeString(SExp* text, SExp* port);
+SExp* closePort(SExp* port);
+
+/* binary s-expression format:
+        varint integers, raw IEEE doubles, length-prefixed text,
+        one symbol table per stream and back-references for shared structure
+*/
+
+#define BINARY_MAGIC "LSPB\x01"
+#define BINARY_MAGIC_SIZE 5
+
+typedef enum {
+    BIN_NIL,        // ()
+    BIN_LONG,       // zigzag varint
+    BIN_DOUBLE,     // 8 bytes, little-endian IEEE 754
+    BIN_STRING,     // varint length + bytes
+    BIN_SYMBOL,     // varint length + bytes, adds symbol to table
+    BIN_SYMBOL_REF, // varint index into symbol table
+    BIN_LIST,       // varint count n, n elements, then the final cdr
+    BIN_SHARE,      // next object is referenced again later
+    BIN_REF         // varint index of earlier shared object
+} BinaryTag;
+
+// string-keyed hash map from symbol name to index in stream
+typedef struct SymbolTable {
+    const char** names;
+    size_t* indices;
+    size_t capacity; // power of two
+    size_t count;
+} SymbolTable;
+
+size_t stringHash(const char* s) {
+    return textHash(s, strlen(s));
+}
+
+// index of symbol name, -1 if not in table
+long symbolTableGet(SymbolTable* table, const char* name) {
+    if (table->count == 0) return -1;
+    size_t mask = table->capacity - 1;
+    for (size_t i = stringHash(name) & mask; table->names[i] != NULL; i = (i + 1) & mask) {
+        if (strcmp(table->names[i], name) == 0) return (long)table->indices[i];
+    }
+    return -1;
+}
+
+// add symbol name with the next free index
+void symbolTableAdd(SymbolTable* table, const char* name) {
+    if ((table->count + 1) * 2 > table->capacity) {
+        size_t oldCapacity = table->capacity;
+        const char** oldNames = table->names;
+        size_t* oldIndices = table->indices;
+        table->capacity = oldCapacity ? oldCapacity * 2 : 64;
+        table->names = calloc(table->capacity, sizeof(char*));
+        table->indices = calloc(table->capacity, sizeof(size_t));
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (oldNames[i] == NULL) continue;
+            size_t j = stringHash(oldNames[i]) & (table->capacity - 1);
+            while (table->names[j] != NULL) j = (j + 1) & (table->capacity - 1);
+            table->names[j] = oldNames[i];
+            table->indices[j] = oldIndices[i];
+        }
+        free(oldNames);
+        free(oldIndices);
+    }
+    size_t mask = table->capacity - 1;
+    size_t i = stringHash(name) & mask;
+    while (table->names[i] != NULL) i = (i + 1) & mask;
+    table->names[i] = name;
+    table->indices[i] = table->count++;
+}
+
+typedef struct BinaryWriter {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+    SymbolTable symbols;
+    PtrMap refCounts;  // object -> number of references to it
+    PtrMap shared;     // shared object already written -> index + 1
+    size_t sharedCount;
+} BinaryWriter;
+
+void binaryPutBytes(BinaryWriter* w, const void* bytes, size_t length) {
+    while (w->size + length > w->capacity) {
+        w->capacity = w->capacity ? w->capacity * 2 : 4096;
+        w->data = realloc(w->data, w->capacity);
+    }
+    memcpy(w->data + w->size, bytes, length);
+    w->size += length;
+}
+
+void binaryPutByte(BinaryWriter* w, unsigned char byte) {
+    binaryPutBytes(w, &byte, 1);
+}
+
+// unsigned LEB128
+void binaryPutVarint(BinaryWriter* w, uint64_t value) {
+    unsigned char bytes[10];
+    int n = 0;
+    do {
+        bytes[n] = value & 0x7f;
+        value >>= 7;
+        if (value) bytes[n] |= 0x80;
+        n++;
+    } while (value);
+    binaryPutBytes(w, bytes, n);
+}
+
+void binaryPutText(BinaryWriter* w, const char* text, size_t length) {
+    binaryPutVarint(w, length);
+    binaryPutBytes(w, text, length);
+}
+
+// count references to each object so shared structure is written once
+void binaryCountRefs(BinaryWriter* w, SExp* s) {
+    while ((s = touch(s)) != &nil && !(sexpType(s) == SEXP_ATOM && atomType(s) == ATOM_SYMBOL)) {
+        size_t count = (size_t)(uintptr_t)ptrMapGet(&w->refCounts, s);
+        ptrMapPut(&w->refCounts, s, (void*)(uintptr_t)(count + 1));
+        if (count > 0 || sexpType(s) != SEXP_LIST) return; // already counted or no children
+        binaryCountRefs(w, consCar(s));
+        s = s->data.cons.cdr; // walk list spine iteratively
+    }
+}
+
+bool binaryIsShared(BinaryWriter* w, SExp* s) {
+    return (size_t)(uintptr_t)ptrMapGet(&w->refCounts, s) > 1;
+}
+
+// write one object, false if it contains something that cannot be serialized
+bool binaryWrite(BinaryWriter* w, SExp* s) {
+    s = touch(s); // futures are written as their value
+    if (s == &nil) {
+        binaryPutByte(w, BIN_NIL);
+        return true;
+    }
+    if (sexpType(s) == SEXP_ATOM && atomType(s) == ATOM_SYMBOL) {
+        long index = symbolTableGet(&w->symbols, s->data.atom.value.symbol_value);
+        if (index >= 0) {
+            binaryPutByte(w, BIN_SYMBOL_REF);
+            binaryPutVarint(w, index);
+        }
+        else {
+            symbolTableAdd(&w->symbols, s->data.atom.value.symbol_value);
+            binaryPutByte(w, BIN_SYMBOL);
+            binaryPutText(w, s->data.atom.value.symbol_value, strlen(s->data.atom.value.symbol_value));
+        }
+        return true;
+    }
+    if (sexpType(s) != SEXP_ATOM && sexpType(s) != SEXP_LIST) return false;
+
+    void* written = ptrMapGet(&w->shared, s);
+    if (written) {
+        binaryPutByte(w, BIN_REF);
+        binaryPutVarint(w, (uintptr_t)written - 1);
+        return true;
+    }
+    if (binaryIsShared(w, s)) {
+        binaryPutByte(w, BIN_SHARE);
+        ptrMapPut(&w->shared, s, (void*)(uintptr_t)(++w->sharedCount));
+    }
+
+    if (sexpType(s) == SEXP_ATOM) {
+        switch (atomType(s)) {
+            case ATOM_LONG: {
+                int64_t v = s->data.atom.value.long_value;
+                binaryPutByte(w, BIN_LONG);
+                binaryPutVarint(w, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63)); // zigzag
+                break;
+            }
+            case ATOM_DOUBLE: {
+                uint64_t bits;
+                unsigned char bytes[8];
+                memcpy(&bits, &s->data.atom.value.double_value, sizeof(bits));
+                for (int i = 0; i < 8; i++) bytes[i] = (bits >> (8 * i)) & 0xff;
+                binaryPutByte(w, BIN_DOUBLE);
+                binaryPutBytes(w, bytes, 8);
+                break;
+            }
+            case ATOM_STRING:
+                binaryPutByte(w, BIN_STRING);
+                binaryPutText(w, stringChars(s->data.atom.value.string_value), s->data.atom.value.string_value->length);
+                break;
+            case ATOM_SYMBOL:
+                break; // handled above
+        }
+        return true;
+    }
+
+    // list: elements of the unshared part of the spine, then whatever ends it
+    size_t count = 1;
+    SExp* last = s;
+    while (last->data.cons.cdr != &nil && sexpType(last->data.cons.cdr) == SEXP_LIST && !binaryIsShared(w, last->data.cons.cdr)) {
+        last = last->data.cons.cdr;
+        count++;
+    }
+    binaryPutByte(w, BIN_LIST);
+    binaryPutVarint(w, count);
+    for (SExp* cell = s; ; cell = cell->data.cons.cdr) {
+        if (!binaryWrite(w, consCar(cell))) return false;
+        if (cell == last) break;
+    }
+    return binaryWrite(w, last->data.cons.cdr);
+}
+
+// encode sequence of objects sharing one symbol table, NULL if one cannot be serialized
+// findShared false skips the reference counting pass for objects known to be trees, like parsed source
+unsigned char* binaryEncode(SExp** objects, size_t count, size_t* size, bool findShared) {
+    BinaryWriter w = {0};
+    binaryPutBytes(&w, BINARY_MAGIC, BINARY_MAGIC_SIZE);
+    for (size_t i = 0; i < count && findShared; i++) {
+        binaryCountRefs(&w, objects[i]);
+    }
+    bool ok = true;
+    for (size_t i = 0; i < count && ok; i++) {
+        ok = binaryWrite(&w, objects[i]);
+    }
+    free(w.symbols.names);
+    free(w.symbols.indices);
+    free(w.refCounts.keys);
+    free(w.refCounts.values);
+    free(w.shared.keys);
+    free(w.shared.values);
+    if (!ok) {
+        free(w.data);
+        return NULL;
+    }
+    *size = w.size;
+    return w.data;
+}
+
+typedef struct BinaryReader {
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+    SExp** symbols;
+    size_t symbolCount;
+    size_t symbolCapacity;
+    SExp** shared;
+    size_t sharedCount;
+    size_t sharedCapacity;
+} BinaryReader;
+
+// start reading stream, false if it does not begin with the magic header
+bool binaryReaderInit(BinaryReader* r, const unsigned char* data, size_t size) {
+    memset(r, 0, sizeof(*r));
+    r->data = data;
+    r->size = size;
+    r->pos = BINARY_MAGIC_SIZE;
+    return size >= BINARY_MAGIC_SIZE && memcmp(data, BINARY_MAGIC, BINARY_MAGIC_SIZE) == 0;
+}
+
+void binaryReaderFree(BinaryReader* r) {
+    free(r->symbols);
+    free(r->shared);
+}
+
+bool binaryAtEnd(BinaryReader* r) {
+    return r->pos >= r->size;
+}
+
+bool binaryGetVarint(BinaryReader* r, uint64_t* out) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (r->pos >= r->size) return false;
+        unsigned char byte = r->data[r->pos++];
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *out = value;
+            return true;
+        }
+    }
+    return false; // too long
+}
+
+// read length-prefixed text, pointing into the stream
+bool binaryGetText(BinaryReader* r, const char** text, size_t* length) {
+    uint64_t n;
+    if (!binaryGetVarint(r, &n) || n > r->size - r->pos) return false;
+    *text = (const char*)r->data + r->pos;
+    *length = n;
+    r->pos += n;
+    return true;
+}
+
+// append to growable array of objects
+void binaryPush(SExp*** items, size_t* count, size_t* capacity, SExp* item) {
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *items = realloc(*items, *capacity * sizeof(SExp*));
+    }
+    (*items)[(*count)++] = item;
+}
+
+// read one object, NULL if the data is malformed
+SExp* binaryRead(BinaryReader* r) {
+    if (r->pos >= r->size) return NULL;
+    unsigned char tag = r->data[r->pos++];
+    uint64_t n;
+    const char* text;
+    size_t length;
+
+    switch (tag) {
+        case BIN_NIL:
+            return &nil;
+        case BIN_LONG:
+            if (!binaryGetVarint(r, &n)) return NULL;
+            return makeLong((long)((n >> 1) ^ (~(n & 1) + 1))); // undo zigzag
+        case BIN_DOUBLE: {
+            if (r->size - r->pos < 8) return NULL;
+            uint64_t bits = 0;
+            for (int i = 0; i < 8; i++) bits |= (uint64_t)r->data[r->pos + i] << (8 * i);
+            r->pos += 8;
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            return makeDouble(value);
+        }
+        case BIN_STRING:
+            if (!binaryGetText(r, &text, &length)) return NULL;
+            return makeStringN(text, length);
+        case BIN_SYMBOL: {
+            if (!binaryGetText(r, &text, &length)) return NULL;
+            SExp* symbol = makeSymbolN(text, length);
+            binaryPush(&r->symbols, &r->symbolCount, &r->symbolCapacity, symbol);
+            return symbol;
+        }
+        case BIN_SYMBOL_REF:
+            if (!binaryGetVarint(r, &n) || n >= r->symbolCount) return NULL;
+            return r->symbols[n];
+        case BIN_LIST: {
+            // every element takes at least one byte
+            if (!binaryGetVarint(r, &n) || n == 0 || n > r->size - r->pos) return NULL;
+            // spine is taken from the list slab before any element, so its cells are
+            // contiguous except where it crosses into a new slab
+            Slab* slab = &slabs[SEXP_LIST];
+            SExp* head = newSExp(SEXP_LIST);
+            char* slabEnd = slab->end;
+            SExp* last = head;
+            for (uint64_t i = 1; i < n; i++) {
+                SExp* cell = newSExp(SEXP_LIST);
+                last->data.cons.cdr = cell;
+                last = cell;
+            }
+            SExp* cell = head;
+            bool ok = true;
+            for (uint64_t i = 0; i < n && ok; i++, cell = cell->data.cons.cdr) {
+                SExp* element = binaryRead(r);
+                if (element) cell->header = (uintptr_t)element;
+                else ok = false;
+            }
+            SExp* tail = ok ? binaryRead(r) : NULL;
+            if (!tail) {
+                // the whole read fails, so the cells from the spine on are unused: give
+                // them back when they are still in the current slab
+                if (slab->end == slabEnd) {
+                    size_t unused = slab->next - (char*)head;
+                    slab->objects -= unused / sexpSize(SEXP_LIST);
+                    allocatedBytes -= unused;
+                    slab->next = (char*)head;
+                }
+                return NULL;
+            }
+            last->data.cons.cdr = tail;
+            return head;
+        }
+        case BIN_SHARE: {
+            // reserve index before reading so nested shares keep writer order
+            size_t index = r->sharedCount;
+            binaryPush(&r->shared, &r->sharedCount, &r->sharedCapacity, NULL);
+            SExp* object = binaryRead(r);
+            r->shared[index] = object;
+            return object;
+        }
+        case BIN_REF:
+            if (!binaryGetVarint(r, &n) || n >= r->sharedCount) return NULL;
+            return r->shared[n];
+        default:
+            return NULL;
+    }
+}
+
+// read entire file into memory
+unsigned char* readWholeFile(const char* fileName, size_t* size) {
+    FILE* file = fopen(fileName, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char* data = (length >= 0) ? malloc(length + 1) : NULL;
+    if (data && fread(data, 1, length, file) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    if (data) *size = length;
+    return data;
+}
+
+// write-binary: serialize value to file, returns t
+SExp* writeBinary(SExp* value, SExp* path) {
+    if (stringp(path) != &truth) return makeSymbol("Error: Path not a string");
+    size_t size;
+    unsigned char* data = binaryEncode(&value, 1, &size, true);
+    if (!data) return makeSymbol("Error: Cannot serialize function");
+
+    FILE* file = fopen(stringCString(path->data.atom.value.string_value), "wb");
+    bool ok = file && fwrite(data, 1, size, file) == size;
+    if (file && fclose(file) != 0) ok = false;
+    free(data);
+    return ok ? &truth : makeSymbol("Error: Cannot write file");
+}
+
+// read-binary: first value stored in file
+SExp* readBinary(SExp* path) {
+    if (stringp(path) != &truth) return makeSymbol("Error: Path not a string");
+    size_t size;
+    unsigned char* data = readWholeFile(stringCString(path->data.atom.value.string_value), &size);
+    if (!data) return makeSymbol("Error: Cannot read file");
+
+    BinaryReader r;
+    SExp* value = binaryReaderInit(&r, data, size) ? binaryRead(&r) : NULL;
+    binaryReaderFree(&r);
+    free(data);
+    return value ? value : makeSymbol("Error: Invalid binary data");
+}
+
+/* evaluation budgets
+        each top-level evaluation starts with a budget built from
+        interp->limits. eval counts its calls and compares the count and
+        its depth with the budget; allocation and the clock are only
+        checked every 1024 steps, when a memory or time limit is set.
+        Going past a limit aborts the whole evaluation: every eval still
+        on the stack returns the error, and the outermost one clears it.
+*/
+
+#define TIME_CHECK_INTERVAL 1024 // steps between memory and clock checks
+
+typedef struct Budget {
+    uint64_t steps;      // evals so far
+    uint64_t nextCheck;  // step at which to look at the other limits
+    uint64_t maxSteps;
+    size_t maxDepth;
+    size_t maxBytes;     // limit on allocatedBytes
+    double deadline;     // monotonic seconds, 0 for none
+} Budget;
+
+_Thread_local Budget budget;
+_Thread_local size_t evalDepth;              // evals in progress on this thread
+_Thread_local SExp* evalAbort;               // error unwinding the current evaluation
+
+double monotonicSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void budgetScheduleCheck(Budget* b) {
+    b->nextCheck = (b->maxSteps == UINT64_MAX) ? UINT64_MAX : b->maxSteps + 1;
+    if ((b->maxBytes != SIZE_MAX || b->deadline) && b->steps + TIME_CHECK_INTERVAL < b->nextCheck) {
+        b->nextCheck = b->steps + TIME_CHECK_INTERVAL;
+    }
+}
+
+// budget for limits starting now; steps and depth count from the current ones
+Budget budgetFor(LispLimits limits) {
+    Budget b = { .steps = budget.steps, .maxSteps = UINT64_MAX, .maxDepth = SIZE_MAX, .maxBytes = SIZE_MAX, .deadline = 0 };
+    if (limits.steps) b.maxSteps = budget.steps + limits.steps;
+    if (limits.depth) b.maxDepth = evalDepth + limits.depth;
+    if (limits.bytes) b.maxBytes = allocatedBytes + limits.bytes;
+    if (limits.ms) b.deadline = monotonicSeconds() + limits.ms / 1e3;
+    budgetScheduleCheck(&b);
+    return b;
+}
+
+// error for the first limit the current evaluation is past, or NULL
+SExp* budgetExceeded(void) {
+    if (evalDepth >= budget.maxDepth) return makeSymbol("Error: Recursion limit exceeded");
+    if (budget.steps > budget.maxSteps) return makeSymbol("Error: Step limit exceeded");
+    if (allocatedBytes > budget.maxBytes) return makeSymbol("Error: Memory limit exceeded");
+    if (budget.deadline && monotonicSeconds() > budget.deadline) return makeSymbol("Error: Time limit exceeded");
+    budgetScheduleCheck(&budget);
+    return NULL;
+}
+
+/* evaluation stack
+        eval recurses on the C stack. When a thread's stack runs low, the
+        nested eval continues on a new segment mapped from the heap and
+        returns to the old stack when it is done, so recursion depth is
+        bounded by memory and the depth limit, not by the stack size.
+*/
+
+#define STACK_SEGMENT_SIZE (16u << 20) // address space reserved per segment
+#define STACK_RESERVE (256 * 1024)     // left free for builtins, printing and the switch itself
+#define STACK_GUARD_SIZE (64 * 1024)   // inaccessible bottom of each segment, so overruns fault
+
+typedef struct StackSegment {
+    char* base;
+    struct StackSegment* next; // next spare segment
+} StackSegment;
+
+// eval running on a new segment
+typedef struct SegmentCall {
+    SExp* sexp;
+    Env* env;
+    SExp* result;
+    ucontext_t caller;
+} SegmentCall;
+
+_Thread_local char* stackLimit;              // switch segments below this address
+_Thread_local StackSegment* spareSegments;   // segments no longer in use, kept for reuse
+_Thread_local SegmentCall* segmentCall;      // call for segmentMain to run
+
+SExp* evalForm(SExp* sexp, Env* env);
+
+// lowest address eval may reach on this thread's own stack
+char* threadStackLimit(void) {
+    pthread_attr_t attr;
+    void* low;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) return NULL;
+    int failed = pthread_attr_getstack(&attr, &low, &size);
+    pthread_attr_destroy(&attr);
+    return failed ? NULL : (char*)low + STACK_RESERVE;
+}
+
+void segmentMain(void) {
+    SegmentCall* call = segmentCall;
+    call->result = evalForm(call->sexp, call->env);
+} // returns to call->caller through uc_link
+
+SExp* evalOnNewSegment(SExp* sexp, Env* env) {
+    StackSegment* segment = spareSegments;
+    if (segment) {
+        spareSegments = segment->next;
+    }
+    else {
+        char* base = mmap(NULL, STACK_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (base == MAP_FAILED) return evalAbort = makeSymbol("Error: Recursion limit exceeded");
+        // C recursion past the reserve (printing or hashing a deep car chain) stops here
+        // instead of writing into whatever is mapped below, as on the thread's own stack
+        if (mprotect(base, STACK_GUARD_SIZE, PROT_NONE) != 0) {
+            munmap(base, STACK_SEGMENT_SIZE);
+            return evalAbort = makeSymbol("Error: Recursion limit exceeded");
+        }
+        segment = malloc(sizeof(StackSegment));
+        segment->base = base;
+    }
+
+    SegmentCall call = { .sexp = sexp, .env = env, .result = &nil };
+    ucontext_t context;
+    getcontext(&context);
+    context.uc_stack.ss_sp = segment->base + STACK_GUARD_SIZE;
+    context.uc_stack.ss_size = STACK_SEGMENT_SIZE - STACK_GUARD_SIZE;
+    context.uc_link = &call.caller;
+    makecontext(&context, segmentMain, 0);
+
+    char* savedLimit = stackLimit;
+    stackLimit = segment->base + STACK_GUARD_SIZE + STACK_RESERVE;
+    segmentCall = &call;
+    swapcontext(&call.caller, &context);
+    stackLimit = savedLimit;
+
+    segment->next = spareSegments;
+    spareSegments = segment;
+    return call.result;
+}
+
+// evaluate s-expression in given environment
+SExp* eval(SExp* sexp, Env* env) {
+    if (evalAbort) return evalAbort;
+    if (evalDepth == 0) {
+        budget.steps = 0;
+        budget = budgetFor(interp->limits);
+    }
+    if (++budget.steps >= budget.nextCheck || evalDepth >= budget.maxDepth) {
+        SExp* error = budgetExceeded();
+        if (error) {
+            if (evalDepth > 0) evalAbort = error;
+            return error;
+        }
+    }
+    if (!stackLimit) stackLimit = threadStackLimit();
+
+    evalDepth++;
+    SExp* result = ((char*)__builtin_frame_address(0) < stackLimit) ? evalOnNewSegment(sexp, env) : evalForm(sexp, env);
+    evalDepth--;
+    if (evalAbort) {
+        result = evalAbort;
+        if (evalDepth == 0) evalAbort = NULL; // outermost eval: the interpreter is usable again
+    }
+    return result;
+}
+
+// evaluate as an evaluation of its own with a fresh budget, e.g. a future's task inside a touch
+SExp* evalIsolated(SExp* sexp, Env* env) {
+    size_t savedDepth = evalDepth;
+    SExp* savedAbort = evalAbort;
+    Budget savedBudget = budget;
+    evalDepth = 0;
+    evalAbort = NULL;
+    SExp* result = eval(sexp, env);
+    evalDepth = savedDepth;
+    evalAbort = savedAbort;
+    budget = savedBudget;
+    return result;
+}
+
+// (with-limits (steps n ms n bytes n depth n) expr): evaluate expr within the
+// given limits (and the enclosing ones); going past them returns the error here
+SExp* withLimits(SExp* spec, SExp* expr, Env* env) {
+    LispLimits limits = {0};
+    for (; spec != &nil; spec = cdr(cdr(spec))) {
+        SExp* name = car(spec);
+        SExp* value = (cdr(spec) == &nil) ? &nil : eval(cadr(spec), env);
+        if (evalAbort) return evalAbort;
+        if (symbolp(name) != &truth || sexpType(value) != SEXP_ATOM || atomType(value) != ATOM_LONG || value->data.atom.value.long_value <= 0) {
+            return makeSymbol("Error: Invalid limit");
+        }
+        unsigned long n = value->data.atom.value.long_value;
+        const char* key = name->data.atom.value.symbol_value;
+        if (strcmp(key, "steps") == 0) limits.steps = n;
+        else if (strcmp(key, "ms") == 0) limits.ms = n;
+        else if (strcmp(key, "bytes") == 0) limits.bytes = n;
+        else if (strcmp(key, "depth") == 0) limits.depth = n;
+        else return makeSymbol("Error: Invalid limit");
+    }
+
+    Budget outer = budget;
+    Budget inner = budgetFor(limits);
+    // never looser than the enclosing budget
+    if (outer.maxSteps < inner.maxSteps) inner.maxSteps = outer.maxSteps;
+    if (outer.maxDepth < inner.maxDepth) inner.maxDepth = outer.maxDepth;
+    if (outer.maxBytes < inner.maxBytes) inner.maxBytes = outer.maxBytes;
+    if (outer.deadline && (!inner.deadline || outer.deadline < inner.deadline)) inner.deadline = outer.deadline;
+    budget = inner;
+
+    SExp* result = eval(expr, env);
+    outer.steps = budget.steps;
+    budget = outer;
+    if (evalAbort) {
+        result = evalAbort;
+        bool outerExceeded = budget.steps > budget.maxSteps || allocatedBytes > budget.maxBytes
+            || (budget.deadline && monotonicSeconds() > budget.deadline) || evalAbort == heapLimitError;
+        if (!outerExceeded) evalAbort = NULL; // only this form is aborted
+    }
+    return result;
+}
+
+/* local bindings and loops
+        let, let*, letrec and do bind their variables in one new frame
+        instead of calling a lambda. do and while loop in C, so iterations
+        take no stack, and do assigns its steps to the value cells of its
+        frame, so the frame is built once per loop rather than per turn.
+*/
+
+typedef enum { LET_PARALLEL, LET_SEQUENTIAL, LET_RECURSIVE } LetKind;
+
+#define LOOP_LOCAL_STEPS 8 // do loops with more stepped variables allocate their step table
+
+typedef struct LoopStep {
+    SExp* expr;     // step expression
+    SExp* cell;     // value cell of its variable
+    SExp* value;    // next value, assigned once every step is evaluated
+} LoopStep;
+
+// (name) or (name expr...) with a symbol name
+bool isBinding(SExp* binding) {
+    return binding != &nil && sexpType(binding) == SEXP_LIST && isProperList(binding) && symbolp(car(binding)) == &truth;
+}
+
+// append value to the list ending at *tail, *list while it is empty
+void listAppend(SExp** list, SExp** tail, SExp* value) {
+    SExp* cell = cons(value, &nil);
+    if (*tail) (*tail)->data.cons.cdr = cell;
+    else *list = cell;
+    *tail = cell;
+}
+
+// evaluate forms in order, value of the last one (nil for none)
+SExp* evalBody(SExp* body, Env* env) {
+    SExp* result = &nil;
+    for (; body != &nil; body = cdr(body)) {
+        result = eval(car(body), env);
+        if (evalAbort) return evalAbort;
+    }
+    return result;
+}
+
+// (let ((name init)...) body...), let* and letrec
+SExp* evalLet(SExp* args, Env* env, LetKind kind) {
+    SExp* bindings = car(args);
+    if (!isProperList(bindings)) return makeSymbol("Error: Invalid binding");
+    for (SExp* rest = bindings; rest != &nil; rest = cdr(rest)) {
+        if (!isBinding(car(rest))) return makeSymbol("Error: Invalid binding");
+    }
+
+    Env* frame = consEnv(&nil, &nil, env);
+    SExp* symbolTail = NULL;
+    SExp* valueTail = NULL;
+    if (kind == LET_RECURSIVE) {
+        // every name is bound before any init runs, so lambdas in them see each other
+        for (SExp* rest = bindings; rest != &nil; rest = cdr(rest)) {
+            listAppend(&frame->symbols, &symbolTail, car(car(rest)));
+            listAppend(&frame->values, &valueTail, &nil);
+        }
+    }
+    SExp* cell = frame->values;
+    for (SExp* rest = bindings; rest != &nil; rest = cdr(rest)) {
+        SExp* binding = car(rest);
+        SExp* value = (cdr(binding) == &nil) ? &nil : eval(cadr(binding), kind == LET_PARALLEL ? env : frame);
+        if (evalAbort) return evalAbort;
+        switch (kind) {
+            case LET_PARALLEL:
+                // inits cannot see the frame, so it is filled in order
+                listAppend(&frame->symbols, &symbolTail, car(binding));
+                listAppend(&frame->values, &valueTail, value);
+                break;
+            case LET_SEQUENTIAL:
+                envPush(frame, car(binding), value); // shadows an earlier binding of the same name
+                break;
+            case LET_RECURSIVE:
+                cellStore(cell, value);
+                cell = cell->data.cons.cdr;
+                break;
+        }
+    }
+    return evalBody(cdr(args), frame);
+}
+
+// (do ((name init step)...) (test result...) body...): until test is true, run
+// body and then assign every step at once; the value of the last result
+SExp* evalDo(SExp* args, Env* env) {
+    SExp* specs = car(args);
+    SExp* exit = cadr(args);
+    if (!isProperList(specs) || exit == &nil || sexpType(exit) != SEXP_LIST || !isProperList(exit)) return makeSymbol("Error: Invalid loop");
+    size_t stepCount = 0;
+    for (SExp* rest = specs; rest != &nil; rest = cdr(rest)) {
+        SExp* spec = car(rest);
+        if (!isBinding(spec) || listLength(spec) > 3) return makeSymbol("Error: Invalid loop");
+        if (listLength(spec) == 3) stepCount++;
+    }
+
+    Env* frame = consEnv(&nil, &nil, env);
+    SExp* symbolTail = NULL;
+    SExp* valueTail = NULL;
+    LoopStep local[LOOP_LOCAL_STEPS];
+    LoopStep* steps = (stepCount <= LOOP_LOCAL_STEPS) ? local : malloc(stepCount * sizeof(LoopStep));
+    size_t step = 0;
+    for (SExp* rest = specs; rest != &nil; rest = cdr(rest)) {
+        SExp* spec = car(rest);
+        SExp* value = (cdr(spec) == &nil) ? &nil : eval(cadr(spec), env);
+        if (evalAbort) break;
+        listAppend(&frame->symbols, &symbolTail, car(spec));
+        listAppend(&frame->values, &valueTail, value);
+        if (cdr(cdr(spec)) != &nil) steps[step++] = (LoopStep){ .expr = caddr(spec), .cell = valueTail };
+    }
+
+    SExp* result = evalAbort;
+    while (!result) {
+        SExp* test = eval(car(exit), frame);
+        if (evalAbort || isErrorSExp(test)) {
+            result = evalAbort ? evalAbort : test;
+        }
+        else if (sexpToBool(test)) {
+            result = evalBody(cdr(exit), frame);
+        }
+        else {
+            evalBody(cdr(cdr(args)), frame);
+            for (size_t i = 0; i < stepCount && !evalAbort; i++) {
+                steps[i].value = eval(steps[i].expr, frame);
+            }
+            if (evalAbort) result = evalAbort;
+            // steps see the values from before any of them is assigned
+            for (size_t i = 0; i < stepCount && !result; i++) {
+                cellStore(steps[i].cell, steps[i].value);
+            }
+        }
+    }
+    if (steps != local) free(steps);
+    return result;
+}
+
+// (while test body...): run body as long as test is true; nil when it stops
+SExp* evalWhile(SExp* args, Env* env) {
+    while (true) {
+        SExp* test = eval(car(args), env);
+        if (evalAbort) return evalAbort;
+        if (isErrorSExp(test)) return test;
+        if (!sexpToBool(test)) return &nil;
+        evalBody(cdr(args), env);
+        if (evalAbort) return evalAbort;
+    }
+}
+
+/* template JIT
+        a function called JIT_THRESHOLD times is compiled to x86-64: each form
+        of its optimized body becomes a fixed instruction sequence. Values
+        stay boxed. Arithmetic and comparisons on longs, car, cdr and nil? are
+        inline, other pure builtins are called, and calls of the function by
+        its own name are direct calls; bodies using anything else (free
+        variables, other functions, side effects) stay interpreted.
+        Compiled code does not count steps, so it only runs while no step,
+        time or memory limit is set. When the stack or the depth budget runs
+        low it gives up and the call is interpreted from the start, which is
+        safe because compiled bodies have no side effects.
+*/
+
+#define JIT_THRESHOLD 64  // interpreted calls before a function is compiled
+#define JIT_MAX_PARAMS 8
+
+bool jitEnabled = true; // -no-jit: interpret everything
+
+typedef enum {
+    JIT_COLD,        // counting calls
+    JIT_COMPILED,
+    JIT_UNSUPPORTED  // body uses forms the compiler does not handle
+} JitState;
+
+// state shared by compiled frames of one call from the interpreter
+typedef struct JitContext {
+    char* stackLimit;   // give up below this address
+    long depthLeft;     // compiled frames allowed before giving up
+} JitContext;
+
+typedef SExp* (*JitCode)(SExp** args, JitContext* context);
+
+// one per optimized body, shared by the closures made from it; 16-byte
+// aligned so it fits in the header of a function object above the type
+typedef struct JitRecord {
+    _Atomic unsigned long calls;
+    _Atomic int state;  // JitState
+    JitCode code;       // args are passed last to first
+    SExp* name;         // symbol the body calls itself by, NULL for lambdas
+    SExp* params;
+    SExp* source;       // body as written, the key of jitRecords
+    struct JitRecord* next; // another record for the same source with other params or name
+    _Atomic(SExp*) body; // optimized body, NULL until the first call
+    int paramCount;
+    bool recursive;     // body calls itself by name
+    size_t levelEvals;  // interpreter evals per level of self-calls, at most
+} JitRecord;
+
+// names evalForm handles itself before looking up a function
+const char* specialNames[] = {
+    "quote", "set", "define", "lambda", "and", "or", "if", "cond", "string-append", "substring",
+    "let", "let*", "letrec", "do", "while",
+    "hash-map", "map-put", "vector", "vector-set",
+    "future", "touch", "pmap", "delay", "force", "stream-cons", "stream-car", "stream-cdr",
+    "stream-map", "stream-filter", "stream-take", "open-input", "open-output", "read-line",
+    "read-sexp", "write-string", "close", "eof?", "with-limits", "write-binary", "read-binary", NULL
+};
+
+static inline JitRecord* lambdaJit(SExp* func) {
+    return (JitRecord*)(func->header & ~(uintptr_t)SEXP_TYPE_MASK);
+}
+
+// give a new function the record of its source body; name is its define label
+void jitAttach(SExp* func, const char* name) {
+    SExp* body = func->data.func.body;
+    bool anonymous = strcmp(name, "lambda") == 0 || strcmp(name, "define") == 0;
+    pthread_mutex_lock(&interp->optimizerLock);
+    // code is compiled against the params and name, so only closures of one definition
+    // share a record; the binary reader shares symbol atoms, so equal bodies of
+    // different functions can have the same pointer
+    JitRecord* first = ptrMapGet(&interp->jitRecords, body);
+    JitRecord* jit = first;
+    while (jit && (jit->params != func->data.func.params || (jit->name == NULL) != anonymous
+                   || (jit->name && strcmp(jit->name->data.atom.value.symbol_value, name) != 0))) {
+        jit = jit->next;
+    }
+    if (!jit) {
+        jit = aligned_alloc(16, (sizeof(JitRecord) + 15) & ~(size_t)15);
+        atomic_init(&jit->calls, 0);
+        atomic_init(&jit->state, JIT_COLD);
+        jit->code = NULL;
+        jit->name = anonymous ? NULL : makeSymbol(name);
+        jit->params = func->data.func.params;
+        jit->source = body;
+        jit->next = first;
+        atomic_init(&jit->body, NULL);
+        jit->paramCount = 0;
+        jit->recursive = false;
+        jit->levelEvals = 0;
+        ptrMapPut(&interp->jitRecords, body, jit);
+    }
+    pthread_mutex_unlock(&interp->optimizerLock);
+    func->header = (uintptr_t)jit | SEXP_LAMBDA;
+}
+
+// optimized body of func, made on the first call of any function with the same source
+SExp* lambdaBody(SExp* func) {
+    JitRecord* jit = lambdaJit(func);
+    if (!jit) return func->data.func.body; // image closure before its first call, optimized before it was saved
+    SExp* body = atomic_load_explicit(&jit->body, memory_order_acquire);
+    if (!body) {
+        // optimizeBody is memoized under the lock, so racing first calls agree
+        body = optimizeBody(jit->name ? jit->name->data.atom.value.symbol_value : "lambda", jit->source);
+        atomic_store_explicit(&jit->body, body, memory_order_release);
+    }
+    return body;
+}
+
+// give a function loaded from an image a record; its body was optimized before it was saved
+JitRecord* jitAttachLoaded(SExp* func, const char* name) {
+    jitAttach(func, name);
+    JitRecord* jit = lambdaJit(func);
+    SExp* none = NULL;
+    atomic_compare_exchange_strong(&jit->body, &none, jit->source);
+    return jit;
+}
+
+typedef struct JitCompiler {
+    JitRecord* jit;
+    unsigned char* code;
+    size_t length;
+    size_t capacity;
+    int depth;          // words pushed since the prologue, for call alignment
+    size_t* bails;      // jumps to the give-up exit
+    size_t bailCount;
+    size_t bailCapacity;
+    size_t maxNest;     // deepest eval nesting in the body
+} JitCompiler;
+
+// x86-64 registers
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12 };
+
+void jitBytes(JitCompiler* c, const void* bytes, size_t length) {
+    if (c->length + length > c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 4096;
+        c->code = realloc(c->code, c->capacity);
+    }
+    memcpy(c->code + c->length, bytes, length);
+    c->length += length;
+}
+#define JIT_EMIT(c, ...) jitBytes(c, (const unsigned char[]){ __VA_ARGS__ }, sizeof((const unsigned char[]){ __VA_ARGS__ }))
+
+void jitWord(JitCompiler* c, uint64_t value, size_t size) {
+    jitBytes(c, &value, size); // little endian
+}
+
+// mov reg, imm64
+void jitMovImm(JitCompiler* c, int reg, const void* value) {
+    JIT_EMIT(c, reg >= R8 ? 0x49 : 0x48, 0xb8 + (reg & 7));
+    jitWord(c, (uintptr_t)value, 8);
+}
+
+// jmp or jcc (0x80 + condition) with a 32-bit displacement patched later
+size_t jitJump(JitCompiler* c, int condition) {
+    if (condition < 0) JIT_EMIT(c, 0xe9);
+    else JIT_EMIT(c, 0x0f, 0x80 + condition);
+    jitWord(c, 0, 4);
+    return c->length - 4;
+}
+#define JCC_O 0x0
+#define JCC_B 0x2
+#define JCC_E 0x4
+#define JCC_NE 0x5
+#define JCC_A 0x7
+#define JCC_L 0xc
+#define JCC_GE 0xd
+#define JCC_LE 0xe
+#define JCC_G 0xf
+
+// point the jump at patch to the current position
+void jitPatch(JitCompiler* c, size_t patch) {
+    int32_t offset = (int32_t)(c->length - (patch + 4));
+    memcpy(c->code + patch, &offset, 4);
+}
+
+void jitBail(JitCompiler* c, int condition) {
+    if (c->bailCount == c->bailCapacity) {
+        c->bailCapacity = c->bailCapacity ? c->bailCapacity * 2 : 16;
+        c->bails = realloc(c->bails, c->bailCapacity * sizeof(size_t));
+    }
+    c->bails[c->bailCount++] = jitJump(c, condition);
+}
+
+// call C function with the stack 16-byte aligned
+void jitCall(JitCompiler* c, const void* function) {
+    if (c->depth % 2) JIT_EMIT(c, 0x48, 0x83, 0xec, 0x08);      // sub rsp, 8
+    jitMovImm(c, R11, function);
+    JIT_EMIT(c, 0x41, 0xff, 0xd3);                              // call r11
+    if (c->depth % 2) JIT_EMIT(c, 0x48, 0x83, 0xc4, 0x08);      // add rsp, 8
+}
+
+// jump to fail unless reg is within EXACT_LONG (r11 = EXACT_LONG, rdx = 2 * EXACT_LONG)
+void jitRangeCheck(JitCompiler* c, int reg, size_t* fail, size_t* failCount) {
+    JIT_EMIT(c, 0x4d, 0x89, 0xc2 | (reg & 7) << 3);             // mov r10, reg
+    JIT_EMIT(c, 0x4d, 0x01, 0xda);                              // add r10, r11
+    JIT_EMIT(c, 0x49, 0x39, 0xd2);                              // cmp r10, rdx
+    fail[(*failCount)++] = jitJump(c, JCC_A);
+}
+
+// result of cmp in rax: truth if condition holds, nil otherwise
+void jitBoolean(JitCompiler* c, int condition) {
+    jitMovImm(c, RAX, &nil);
+    jitMovImm(c, RDX, &truth);
+    JIT_EMIT(c, 0x48, 0x0f, 0x40 + condition, 0xc2);            // cmovcc rax, rdx
+}
+
+bool jitExpr(JitCompiler* c, SExp* s, size_t nest);
+
+// two arguments: first in rax, second in rcx
+bool jitOperands(JitCompiler* c, SExp* args, size_t nest) {
+    if (!jitExpr(c, car(args), nest)) return false;
+    JIT_EMIT(c, 0x50);                                          // push rax
+    c->depth++;
+    if (!jitExpr(c, cadr(args), nest)) return false;
+    JIT_EMIT(c, 0x48, 0x89, 0xc1);                              // mov rcx, rax
+    JIT_EMIT(c, 0x58);                                          // pop rax
+    c->depth--;
+    return true;
+}
+
+// arithmetic or comparison: inline when both operands are longs the generic
+// path handles exactly, a call of the generic builtin otherwise
+bool jitOp(JitCompiler* c, OpKind op, SExp* args, size_t nest) {
+    if (!jitOperands(c, args, nest)) return false;
+    size_t slow[8];
+    size_t slowCount = 0;
+    size_t done = 0;
+    bool fast = op != OP_DIV && op != OP_MOD;
+    if (fast) {
+        JIT_EMIT(c, 0xba);                                      // mov edx, long header
+        jitWord(c, ATOM_HEADER(ATOM_LONG), 4);
+        JIT_EMIT(c, 0x48, 0x39, 0x10);                          // cmp [rax], rdx
+        slow[slowCount++] = jitJump(c, JCC_NE);
+        JIT_EMIT(c, 0x48, 0x39, 0x11);                          // cmp [rcx], rdx
+        slow[slowCount++] = jitJump(c, JCC_NE);
+        JIT_EMIT(c, 0x4c, 0x8b, 0x40, 0x08);                    // mov r8, [rax + 8]
+        JIT_EMIT(c, 0x4c, 0x8b, 0x49, 0x08);                    // mov r9, [rcx + 8]
+        jitMovImm(c, R11, (void*)EXACT_LONG);
+        jitMovImm(c, RDX, (void*)(2 * EXACT_LONG));
+        jitRangeCheck(c, R8, slow, &slowCount);
+        jitRangeCheck(c, R9, slow, &slowCount);
+        switch (op) {
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+                if (op == OP_ADD) JIT_EMIT(c, 0x4d, 0x01, 0xc8);        // add r8, r9
+                if (op == OP_SUB) JIT_EMIT(c, 0x4d, 0x29, 0xc8);        // sub r8, r9
+                if (op == OP_MUL) {
+                    JIT_EMIT(c, 0x4d, 0x0f, 0xaf, 0xc1);                // imul r8, r9
+                    slow[slowCount++] = jitJump(c, JCC_O);
+                }
+                jitRangeCheck(c, R8, slow, &slowCount);
+                JIT_EMIT(c, 0x4c, 0x89, 0xc7);                          // mov rdi, r8
+                jitCall(c, makeLong);
+                break;
+            default:
+                JIT_EMIT(c, 0x4d, 0x39, 0xc8);                          // cmp r8, r9
+                jitBoolean(c, op == OP_LT ? JCC_L : op == OP_GT ? JCC_G : op == OP_LTE ? JCC_LE : op == OP_GTE ? JCC_GE : JCC_E);
+                break;
+        }
+        done = jitJump(c, -1);
+    }
+    for (size_t i = 0; i < slowCount; i++) jitPatch(c, slow[i]);
+    JIT_EMIT(c, 0x48, 0x89, 0xc7);                              // mov rdi, rax
+    JIT_EMIT(c, 0x48, 0x89, 0xce);                              // mov rsi, rcx
+    jitCall(c, opGeneric[op]);
+    if (fast) jitPatch(c, done);
+    return true;
+}
+
+// car or cdr: a load for cons cells; car of an atom gives up, since car
+// reports that error on the output
+bool jitAccessor(JitCompiler* c, bool head, SExp* args, size_t nest) {
+    if (!jitExpr(c, car(args), nest)) return false;
+    jitMovImm(c, RCX, &nil);
+    JIT_EMIT(c, 0x48, 0x39, 0xc8);                              // cmp rax, rcx
+    size_t isNil = jitJump(c, JCC_E);
+    JIT_EMIT(c, 0xf6, 0x00, SEXP_TYPE_MASK);                    // test byte [rax], type mask
+    if (head) {
+        jitBail(c, JCC_NE);
+        JIT_EMIT(c, 0x48, 0x8b, 0x00);                          // mov rax, [rax]
+        jitPatch(c, isNil);
+        return true;
+    }
+    size_t atom = jitJump(c, JCC_NE);
+    JIT_EMIT(c, 0x48, 0x8b, 0x40, 0x08);                        // mov rax, [rax + 8]
+    size_t done = jitJump(c, -1);
+    jitPatch(c, atom);
+    JIT_EMIT(c, 0x48, 0x89, 0xc7);                              // mov rdi, rax
+    jitCall(c, cdr);
+    jitPatch(c, done);
+    jitPatch(c, isNil);
+    return true;
+}
+
+// test in rax against nil: returns the jump taken when it is nil
+size_t jitTest(JitCompiler* c) {
+    jitMovImm(c, RCX, &nil);
+    JIT_EMIT(c, 0x48, 0x39, 0xc8);                              // cmp rax, rcx
+    return jitJump(c, JCC_E);
+}
+
+bool jitCond(JitCompiler* c, SExp* clauses, size_t nest) {
+    size_t ends[64];
+    size_t endCount = 0;
+    for (; clauses != &nil; clauses = cdr(clauses)) {
+        SExp* clause = car(clauses);
+        if (sexpType(clause) != SEXP_LIST || !isProperList(clause) || endCount == 64) return false;
+        if (!jitExpr(c, car(clause), nest)) return false;
+        size_t next = jitTest(c);
+        if (!jitExpr(c, cadr(clause), nest)) return false;
+        ends[endCount++] = jitJump(c, -1);
+        jitPatch(c, next);
+    }
+    jitMovImm(c, RDI, "Error: No selected branch");
+    jitCall(c, makeSymbol);
+    for (size_t i = 0; i < endCount; i++) jitPatch(c, ends[i]);
+    return true;
+}
+
+// call of the function being compiled: arguments pushed first to last
+bool jitSelfCall(JitCompiler* c, SExp* args, size_t nest) {
+    int count = listLength(args);
+    if (count != c->jit->paramCount) return false; // argument count error at runtime
+    c->jit->recursive = true;
+    int padding = (c->depth + count) % 2;
+    if (padding) JIT_EMIT(c, 0x48, 0x83, 0xec, 0x08);           // sub rsp, 8
+    c->depth += padding;
+    for (; args != &nil; args = cdr(args)) {
+        if (!jitExpr(c, car(args), nest)) return false;
+        JIT_EMIT(c, 0x50);                                      // push rax
+        c->depth++;
+    }
+    JIT_EMIT(c, 0x48, 0x89, 0xe7);                              // mov rdi, rsp
+    JIT_EMIT(c, 0x48, 0x89, 0xde);                              // mov rsi, rbx
+    JIT_EMIT(c, 0xe8);                                          // call entry
+    jitWord(c, (uint32_t)-(int32_t)(c->length + 4), 4);
+    JIT_EMIT(c, 0x48, 0x81, 0xc4);                              // add rsp, pushed bytes
+    jitWord(c, 8 * (count + padding), 4);
+    c->depth -= count + padding;
+    JIT_EMIT(c, 0x48, 0x85, 0xc0);                              // test rax, rax
+    jitBail(c, JCC_E);                                          // callee gave up
+    return true;
+}
+
+// index of parameter named by symbol s, -1 if it is not one
+int jitParam(JitCompiler* c, SExp* s) {
+    int i = 0;
+    for (SExp* p = c->jit->params; p != &nil; p = cdr(p), i++) {
+        if (strcmp(car(p)->data.atom.value.symbol_value, s->data.atom.value.symbol_value) == 0) return i;
+    }
+    return -1;
+}
+
+// code leaving the value of s in rax; false if s uses an unsupported form
+bool jitExpr(JitCompiler* c, SExp* s, size_t nest) {
+    if (nest > c->maxNest) c->maxNest = nest;
+    if (isSelfEvaluating(s)) {
+        jitMovImm(c, RAX, s);
+        return true;
+    }
+    if (sexpType(s) == SEXP_ATOM) {
+        int i = jitParam(c, s);
+        if (i < 0) return false; // global or free variable
+        JIT_EMIT(c, 0x49, 0x8b, 0x84, 0x24);                    // mov rax, [r12 + offset]
+        jitWord(c, 8 * (c->jit->paramCount - 1 - i), 4);
+        return true;
+    }
+    if (sexpType(s) != SEXP_LIST || !isProperList(s)) return false;
+    SExp* head = car(s);
+    SExp* args = cdr(s);
+
+    if (sexpType(head) == SEXP_SITE) return jitOp(c, head->data.site.op, args, nest + 1);
+    if (sexpType(head) != SEXP_ATOM || atomType(head) != ATOM_SYMBOL) return false;
+    const char* fname = head->data.atom.value.symbol_value;
+
+    if (strcmp(fname, "quote") == 0) {
+        jitMovImm(c, RAX, car(args));
+        return true;
+    }
+    if (strcmp(fname, "if") == 0) {
+        if (!jitExpr(c, car(args), nest + 1)) return false;
+        size_t otherwise = jitTest(c);
+        if (!jitExpr(c, cadr(args), nest + 1)) return false;
+        size_t done = jitJump(c, -1);
+        jitPatch(c, otherwise);
+        if (!jitExpr(c, caddr(args), nest + 1)) return false;
+        jitPatch(c, done);
+        return true;
+    }
+    if (strcmp(fname, "and") == 0 || strcmp(fname, "or") == 0) {
+        if (!jitExpr(c, car(args), nest + 1)) return false;
+        size_t second = jitTest(c);
+        size_t done = 0;
+        if (fname[0] == 'o') {
+            jitMovImm(c, RAX, &truth);
+            done = jitJump(c, -1);
+            jitPatch(c, second);
+        }
+        if (!jitExpr(c, cadr(args), nest + 1)) return false;
+        jitPatch(c, fname[0] == 'o' ? done : second); // nil is already in rax
+        return true;
+    }
+    if (strcmp(fname, "cond") == 0) {
+        return jitCond(c, args, nest + 1);
+    }
+    for (PureBuiltin* builtin = pureBuiltins; builtin->name != NULL; builtin++) {
+        if (strcmp(fname, builtin->name) != 0) continue;
+        for (int op = 0; op < OP_COUNT; op++) {
+            if (strcmp(fname, opNames[op]) == 0) return jitOp(c, op, args, nest + 1);
+        }
+        if (builtin->unary == car || builtin->unary == cdr) return jitAccessor(c, builtin->unary == car, args, nest + 1);
+        if (builtin->unary == nilp || builtin->unary == notf) {
+            if (!jitExpr(c, car(args), nest + 1)) return false;
+            jitMovImm(c, RCX, &nil);
+            JIT_EMIT(c, 0x48, 0x39, 0xc8);                      // cmp rax, rcx
+            jitBoolean(c, JCC_E);
+            return true;
+        }
+        if (builtin->unary) {
+            if (!jitExpr(c, car(args), nest + 1)) return false;
+            JIT_EMIT(c, 0x48, 0x89, 0xc7);                      // mov rdi, rax
+            jitCall(c, builtin->unary);
+            return true;
+        }
+        if (!jitOperands(c, args, nest + 1)) return false;
+        JIT_EMIT(c, 0x48, 0x89, 0xc7);                          // mov rdi, rax
+        JIT_EMIT(c, 0x48, 0x89, 0xce);                          // mov rsi, rcx
+        jitCall(c, builtin->binary);
+        return true;
+    }
+    for (const char** name = specialNames; *name; name++) {
+        if (strcmp(fname, *name) == 0) return false;
+    }
+    SExp* self = c->jit->name;
+    if (self && strcmp(fname, self->data.atom.value.symbol_value) == 0 && jitParam(c, head) < 0) {
+        return jitSelfCall(c, args, nest + 1);
+    }
+    return false; // other functions are looked up at runtime
+}
+
+// compile the body of jit; the thread that brings it to the threshold does this once
+JitState jitCompile(JitRecord* jit) {
+    JitState state = JIT_UNSUPPORTED;
+    JitCompiler c = { .jit = jit };
+    int count = 0;
+    for (SExp* p = jit->params; p != &nil; p = cdr(p), count++) {
+        if (sexpType(p) != SEXP_LIST || symbolp(car(p)) != &truth) count = JIT_MAX_PARAMS;
+        if (count == JIT_MAX_PARAMS) break;
+    }
+    jit->paramCount = count;
+
+    JIT_EMIT(&c, 0x55);                                         // push rbp
+    JIT_EMIT(&c, 0x48, 0x89, 0xe5);                             // mov rbp, rsp
+    JIT_EMIT(&c, 0x53);                                         // push rbx
+    JIT_EMIT(&c, 0x41, 0x54);                                   // push r12
+    JIT_EMIT(&c, 0x48, 0x89, 0xf3);                             // mov rbx, rsi
+    JIT_EMIT(&c, 0x49, 0x89, 0xfc);                             // mov r12, rdi
+    JIT_EMIT(&c, 0x48, 0x3b, 0x23);                             // cmp rsp, [rbx]
+    jitBail(&c, JCC_B);
+    JIT_EMIT(&c, 0x48, 0x83, 0x6b, 0x08, 0x01);                 // sub qword [rbx + 8], 1
+    jitBail(&c, JCC_L);
+
+    if (count < JIT_MAX_PARAMS && jitExpr(&c, jit->body, 1)) {
+        JIT_EMIT(&c, 0x48, 0x83, 0x43, 0x08, 0x01);             // add qword [rbx + 8], 1
+        size_t exit = c.length;
+        JIT_EMIT(&c, 0x48, 0x8d, 0x65, 0xf0);                   // lea rsp, [rbp - 16]
+        JIT_EMIT(&c, 0x41, 0x5c);                               // pop r12
+        JIT_EMIT(&c, 0x5b);                                     // pop rbx
+        JIT_EMIT(&c, 0x5d);                                     // pop rbp
+        JIT_EMIT(&c, 0xc3);                                     // ret
+        for (size_t i = 0; i < c.bailCount; i++) jitPatch(&c, c.bails[i]);
+        JIT_EMIT(&c, 0x31, 0xc0);                               // xor eax, eax
+        JIT_EMIT(&c, 0xe9);                                     // jmp exit
+        jitWord(&c, (uint32_t)(int32_t)(exit - (c.length + 4)), 4);
+
+        size_t size = (c.length + 4095) & ~(size_t)4095;
+        void* code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code != MAP_FAILED) {
+            memcpy(code, c.code, c.length);
+            if (mprotect(code, size, PROT_READ | PROT_EXEC) == 0) {
+                jit->code = (JitCode)code;
+                // interpreter evals from one self-call to the next, and below the last
+                jit->levelEvals = c.maxNest + 1;
+                state = JIT_COMPILED;
+                if (dumpOptimized) fprintf(stderr, "[jit] %s: %zu bytes\n", jit->name ? jit->name->data.atom.value.symbol_value : "lambda", c.length);
+            }
+            else {
+                munmap(code, size);
+            }
+        }
+    }
+    free(c.code);
+    free(c.bails);
+    atomic_store_explicit(&jit->state, state, memory_order_release);
+    return state;
+}
+
+_Thread_local int jitSuspended; // calls being interpreted after compiled code gave up
+
+// run the compiled function on evaluated args; NULL to interpret the call
+SExp* jitRun(JitRecord* jit, SExp* func, SExp* args) {
+    if (jitSuspended || budget.nextCheck != UINT64_MAX || !stackLimit) return NULL; // limits need every eval counted
+    size_t room = budget.maxDepth - evalDepth;
+    if (room <= 2 * jit->levelEvals) return NULL;
+    if (jit->recursive && lookup(jit->name, func->data.func.env) != func) return NULL; // name now bound to something else
+
+    SExp* slots[JIT_MAX_PARAMS];
+    SExp* rest = args;
+    for (int i = jit->paramCount - 1; i >= 0; i--, rest = cdr(rest)) {
+        slots[i] = consCar(rest);
+    }
+    // a compiled frame stands for at most levelEvals interpreter evals, so it
+    // never finishes a call the interpreter would have stopped
+    JitContext context = { .stackLimit = stackLimit, .depthLeft = (long)((room - jit->levelEvals) / jit->levelEvals) - 1 };
+    SExp* result = jit->code(slots, &context);
+    if (result) return result;
+
+    // gave up: interpret the call, and everything below it, which would give up again
+    jitSuspended++;
+    result = eval(lambdaBody(func), extendEnv(func->data.func.params, args, func->data.func.env));
+    jitSuspended--;
+    return result;
+}
+
+// count an interpreted call of func, compiling it at the threshold; the
+// result of the compiled code if it ran, NULL to interpret the call
+SExp* jitInvoke(SExp* func, SExp* args) {
+    if (!jitEnabled) return NULL;
+    JitRecord* jit = lambdaJit(func);
+    if (!jit) jit = jitAttachLoaded(func, "lambda"); // closure from an image
+
+    int state = atomic_load_explicit(&jit->state, memory_order_acquire);
+    if (state == JIT_COLD) {
+        if (atomic_fetch_add_explicit(&jit->calls, 1, memory_order_relaxed) + 1 != JIT_THRESHOLD) return NULL;
+        state = jitCompile(jit);
+    }
+    return (state == JIT_COMPILED) ? jitRun(jit, func, args) : NULL;
+}
+
+// evaluate one form, recursing through eval
+SExp* evalForm(SExp* sexp, Env* env) {
+    if (nilp(sexp) == &truth) return &nil; // nil returns nil
+    if (sexpType(sexp) != SEXP_ATOM && sexpType(sexp) != SEXP_LIST) return sexp; // function, future, promise and port values
+
+    // atoms
+    if (sexpType(sexp) == SEXP_ATOM) {
+        switch (atomType(sexp)) {
+            case ATOM_LONG:
+            case ATOM_DOUBLE:
+            case ATOM_STRING:
+                return sexp; // self-evaluating
+            case ATOM_SYMBOL:
+                return lookup(sexp, env); // lookup in environment
+        }
+    }
+
+    // lists
+    if (sexpType(sexp) == SEXP_LIST) {
+        SExp* func = car(sexp);
+        SExp* args = cdr(sexp);
+
+        // builtin call rewritten by the optimizer
+        if (sexpType(func) == SEXP_SITE) {
+            SExp* a = eval(car(args), env);
+            return callSite(func, a, eval(cadr(args), env));
+        }
+
+        if (sexpType(func) == SEXP_ATOM && atomType(func) == ATOM_SYMBOL) {
+
+            char* fname = func->data.atom.value.symbol_value;
+
+            // handle special forms
+            if (strcmp(fname, "quote") == 0) {
+                return car(args); // return quoted expression   
+            }
+            if (strcmp(fname, "set") == 0) {
+                SExp* var = car(args);
+                SExp* val = eval(cadr(args), env);
+                return set(var, val, env);
+            }
+            if (strcmp(fname, "define") == 0) {
+                SExp* name = car(args);
+                SExp* value = cadr(args);
+                SExp* func = NULL;
+                const char* label = symbolp(name) == &truth ? name->data.atom.value.symbol_value : "define";
+
+                if (sexpType(value) == SEXP_LIST && sexpType(car(value)) == SEXP_ATOM && strcmp(car(value)->data.atom.value.symbol_value, "lambda") == 0) {
+                    func = makeLambda(label, cadr(value), caddr(value), env);
+                }
+                else {
+                    SExp* params = cadr(args);
+                    SExp* body = caddr(args);
+
+                    func = makeLambda(label, params, body, env);
+                }
+
+                set(name, func, env);
+
+                return name;
+            }
+            if (strcmp(fname, "lambda") == 0) {
+                SExp* params = car(args);
+                SExp* body = cadr(args);
+
+                return makeLambda("lambda", params, body, env);
+            }
+
+            // local bindings and loops
+            if (strcmp(fname, "let") == 0) {
+                return evalLet(args, env, LET_PARALLEL);
+            }
+            if (strcmp(fname, "let*") == 0) {
+                return evalLet(args, env, LET_SEQUENTIAL);
+            }
+            if (strcmp(fname, "letrec") == 0) {
+                return evalLet(args, env, LET_RECURSIVE);
+            }
+            if (strcmp(fname, "do") == 0) {
+                return evalDo(args, env);
+            }
+            if (strcmp(fname, "while") == 0) {
+                return evalWhile(args, env);
+            }
+
+
+            // lists
+            if (strcmp(fname, "cons") == 0) {
+                SExp* head = eval(car(args), env);
+                SExp* tail = eval(cadr(args), env);
+                return cons(head, tail);
+            }
+            if (strcmp(fname, "car") == 0) {
+                return car(eval(car(args), env));
+            }
+            if (strcmp(fname, "cdr") == 0) {
+                return cdr(eval(car(args), env));
+            }
+
+            // short-circuiting functions
+            if (strcmp(fname, "and") == 0) {
+                SExp* first = eval(car(args), env);
+                if (first == &nil) return &nil;
+                return eval(cadr(args), env);
+            }
+            if (strcmp(fname, "or") == 0) {
+                SExp* first = eval(car(args), env);
+                if (first != &nil) return &truth;
+                return eval(cadr(args), env);
             }
             // conditionals
             if (strcmp(fname, "if") == 0) {
@@ -783,11 +3674,172 @@ SExp* eval (SExp* sexp, Env* env) {
             if (strcmp(fname, "list?") == 0) {
                 return listp(eval(car(args), env));
             }
+
+            // strings
+            if (strcmp(fname, "string-append") == 0) {
+                SExp* values = &nil;
+                for (SExp* rest = args; rest != &nil; rest = cdr(rest)) {
+                    values = cons(eval(car(rest), env), values);
+                }
+                return stringAppend(reverseList(values));
+            }
+            if (strcmp(fname, "substring") == 0) {
+                SExp* s = eval(car(args), env);
+                SExp* start = eval(cadr(args), env);
+                return substring(s, start, (cdr(cdr(args)) == &nil) ? NULL : eval(caddr(args), env));
+            }
+            if (strcmp(fname, "string-length") == 0) {
+                return stringLength(eval(car(args), env));
+            }
+            if (strcmp(fname, "string-ref") == 0) {
+                return stringRef(eval(car(args), env), eval(cadr(args), env));
+            }
+            if (strcmp(fname, "string->symbol") == 0) {
+                return stringToSymbol(eval(car(args), env));
+            }
+            if (strcmp(fname, "number->string") == 0) {
+                return numberToString(eval(car(args), env));
+            }
+
+            // persistent maps and vectors
+            if (strcmp(fname, "hash-map") == 0 || strcmp(fname, "vector") == 0) {
+                SExp* values = &nil;
+                for (SExp* rest = args; rest != &nil; rest = cdr(rest)) {
+                    values = cons(eval(car(rest), env), values);
+                }
+                values = reverseList(values);
+                return (fname[0] == 'h') ? hashMap(values) : listToVector(values);
+            }
+            if (strcmp(fname, "map-get") == 0) {
+                return mapGet(eval(car(args), env), eval(cadr(args), env));
+            }
+            if (strcmp(fname, "map-put") == 0) {
+                SExp* m = eval(car(args), env);
+                SExp* key = eval(cadr(args), env);
+                return mapPut(m, key, eval(caddr(args), env));
+            }
+            if (strcmp(fname, "map-remove") == 0) {
+                return mapRemove(eval(car(args), env), eval(cadr(args), env));
+            }
+            if (strcmp(fname, "map-contains?") == 0) {
+                return mapContains(eval(car(args), env), eval(cadr(args), env));
+            }
+            if (strcmp(fname, "map-count") == 0) {
+                return mapCount(eval(car(args), env));
+            }
+            if (strcmp(fname, "map-keys") == 0) {
+                return mapKeys(eval(car(args), env));
+            }
+            if (strcmp(fname, "map->list") == 0) {
+                return mapToList(eval(car(args), env));
+            }
+            if (strcmp(fname, "map?") == 0) {
+                return mapp(eval(car(args), env));
+            }
+            if (strcmp(fname, "vector-ref") == 0) {
+                return vectorRef(eval(car(args), env), eval(cadr(args), env));
+            }
+            if (strcmp(fname, "vector-set") == 0) {
+                SExp* v = eval(car(args), env);
+                SExp* index = eval(cadr(args), env);
+                return vectorSet(v, index, eval(caddr(args), env));
+            }
+            if (strcmp(fname, "vector-push") == 0) {
+                return vectorPush(eval(car(args), env), eval(cadr(args), env));
+            }
+            if (strcmp(fname, "vector-pop") == 0) {
+                return vectorPop(eval(car(args), env));
+            }
+            if (strcmp(fname, "vector-length") == 0) {
+                return vectorLength(eval(car(args), env));
+            }
+            if (strcmp(fname, "vector->list") == 0) {
+                return vectorToList(eval(car(args), env));
+            }
+            if (strcmp(fname, "list->vector") == 0) {
+                return listToVector(eval(car(args), env));
+            }
+            if (strcmp(fname, "vector?") == 0) {
+                return vectorp(eval(car(args), env));
+            }
+
+            // futures
+            if (strcmp(fname, "future") == 0) {
+                return makeFuture(car(args), env);
+            }
+            if (strcmp(fname, "touch") == 0) {
+                return touch(eval(car(args), env));
+            }
+            if (strcmp(fname, "pmap") == 0) {
+                return pmap(eval(car(args), env), car(args), eval(cadr(args), env), env);
+            }
+
+            // promises and streams
+            if (strcmp(fname, "delay") == 0) {
+                return makePromise(car(args), env);
+            }
+            if (strcmp(fname, "force") == 0) {
+                return force(eval(car(args), env));
+            }
+            if (strcmp(fname, "stream-cons") == 0) {
+                return cons(eval(car(args), env), makePromise(cadr(args), env));
+            }
+            if (strcmp(fname, "stream-car") == 0) {
+                return car(eval(car(args), env));
+            }
+            if (strcmp(fname, "stream-cdr") == 0) {
+                return streamCdr(eval(car(args), env));
+            }
+            if (strcmp(fname, "stream-map") == 0) {
+                return streamMap(eval(car(args), env), car(args), eval(cadr(args), env), env);
+            }
+            if (strcmp(fname, "stream-filter") == 0) {
+                return streamFilter(eval(car(args), env), car(args), eval(cadr(args), env), env);
+            }
+            if (strcmp(fname, "stream-take") == 0) {
+                return streamTake(eval(car(args), env), eval(cadr(args), env));
+            }
+
+            // file ports
+            if (strcmp(fname, "open-input") == 0) {
+                return openInput(eval(car(args), env));
+            }
+            if (strcmp(fname, "open-output") == 0) {
+                return openOutput(eval(car(args), env));
+            }
+            if (strcmp(fname, "read-line") == 0) {
+                return readLine(eval(car(args), env));
+            }
+            if (strcmp(fname, "read-sexp") == 0) {
+                return readSExp(eval(car(args), env));
+            }
+            if (strcmp(fname, "write-string") == 0) {
+                return writeString(eval(car(args), env), cdr(args) == &nil ? NULL : eval(cadr(args), env));
+            }
+            if (strcmp(fname, "close") == 0) {
+                return closePort(eval(car(args), env));
+            }
+            if (strcmp(fname, "eof?") == 0) {
+                return (eval(car(args), env) == &eofObject) ? &truth : &nil;
+            }
+
+            // resource limits
+            if (strcmp(fname, "with-limits") == 0) {
+                return withLimits(car(args), cadr(args), env);
+            }
+
+            // binary serialization
+            if (strcmp(fname, "write-binary") == 0) {
+                return writeBinary(eval(car(args), env), eval(cadr(args), env));
+            }
+            if (strcmp(fname, "read-binary") == 0) {
+                return readBinary(eval(car(args), env));
+            }
         }
         // check for user-defined function
         SExp* op = eval(func, env);
 
-        if (op->type == SEXP_LAMBDA) {
+        if (sexpType(op) == SEXP_LAMBDA) {
             // check arg count
             int expected = listLength(op->data.func.params);
             int given = listLength(args);
@@ -806,29 +3858,918 @@ SExp* eval (SExp* sexp, Env* env) {
                 actuals = cdr(actuals);
             }
             evaluatedArgs = reverseList(evaluatedArgs);
+            SExp* body = lambdaBody(op);
+
+            // compiled code, once the function is hot
+            SExp* compiled = evalAbort ? NULL : jitInvoke(op, evaluatedArgs);
+            if (compiled) return compiled;
+
+            // extend enviro
+            Env* newEnv = extendEnv(formalParams, evaluatedArgs, op->data.func.env);
+
+            // eval body in new env
+            return eval (body, newEnv);
+
+        }
+        if (sexpType(op) == SEXP_NATIVE) {
+            if (!op->data.native.fn) {
+                return makeSymbol("Error: Native function not registered");
+            }
+            SExp* evaluatedArgs = &nil;
+            for (SExp* actuals = args; actuals != &nil; actuals = cdr(actuals)) {
+                evaluatedArgs = cons(eval(car(actuals), env), evaluatedArgs);
+            }
+            return op->data.native.fn(reverseList(evaluatedArgs), op->data.native.data);
+        }
+        return originalForm(sexp);
+    }
+    return makeSymbol("EvalError"); // fallback
+}
+
+/* futures: work-stealing thread pool
+        each worker owns a deque; it pushes and pops at the bottom while
+        idle workers steal from the top of other deques. Threads outside
+        the pool push to a shared injection deque.
+*/
+
+typedef enum {
+    TASK_PENDING, TASK_RUNNING, TASK_DONE
+} TaskState;
+
+typedef struct Task {
+    SExp* expr;
+    Env* env;
+    SExp* result;
+    Interpreter* interp; // interpreter that created the future
+    atomic_int state; // claimed with compare-and-swap, so each task runs once
+} Task;
+
+typedef struct WorkQueue {
+    pthread_mutex_t lock;
+    Task** tasks;    // ring buffer
+    size_t capacity; // power of two
+    size_t top;      // next task to steal
+    size_t bottom;   // next free slot
+} WorkQueue;
+
+typedef struct ThreadPool {
+    int workerCount;
+    WorkQueue* queues;      // one per worker, then the injection queue
+    atomic_size_t queued;   // tasks sitting in queues
+    pthread_mutex_t idleLock;
+    pthread_cond_t idleCond; // signalled when a task is queued
+    pthread_mutex_t doneLock;
+    pthread_cond_t doneCond; // broadcast when a task finishes
+} ThreadPool;
+
+ThreadPool pool;
+pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+_Thread_local int workerId = -1; // index of this thread's deque, -1 outside the pool
+
+void queuePush(WorkQueue* q, Task* task) {
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom - q->top == q->capacity) {
+        size_t capacity = q->capacity ? q->capacity * 2 : 64;
+        Task** tasks = malloc(capacity * sizeof(Task*));
+        for (size_t i = q->top; i != q->bottom; i++) {
+            tasks[i & (capacity - 1)] = q->tasks[i & (q->capacity - 1)];
+        }
+        free(q->tasks);
+        q->tasks = tasks;
+        q->capacity = capacity;
+    }
+    q->tasks[q->bottom++ & (q->capacity - 1)] = task;
+    pthread_mutex_unlock(&q->lock);
+}
+
+// newest task (owner end), NULL if empty
+Task* queuePop(WorkQueue* q) {
+    Task* task = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom != q->top) task = q->tasks[--q->bottom & (q->capacity - 1)];
+    pthread_mutex_unlock(&q->lock);
+    return task;
+}
+
+// oldest task (thief end), NULL if empty
+Task* queueSteal(WorkQueue* q) {
+    Task* task = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom != q->top) task = q->tasks[q->top++ & (q->capacity - 1)];
+    pthread_mutex_unlock(&q->lock);
+    return task;
+}
+
+bool claimTask(Task* task) {
+    int expected = TASK_PENDING;
+    return atomic_compare_exchange_strong(&task->state, &expected, TASK_RUNNING);
+}
+
+void runTask(Task* task) {
+    Interpreter* saved = interp;
+    interp = task->interp;
+    task->result = evalIsolated(task->expr, task->env);
+    interp = saved;
+    atomic_store_explicit(&task->state, TASK_DONE, memory_order_release);
+
+    pthread_mutex_lock(&pool.doneLock);
+    pthread_cond_broadcast(&pool.doneCond);
+    pthread_mutex_unlock(&pool.doneLock);
+}
+
+// claim a queued task: own deque first, then steal round-robin; NULL if none left
+Task* findWork(void) {
+    int queueCount = pool.workerCount + 1;
+    int start = (workerId >= 0) ? workerId : pool.workerCount;
+    for (int i = 0; i < queueCount; i++) {
+        WorkQueue* q = &pool.queues[(start + i) % queueCount];
+        Task* task;
+        // tasks claimed directly by touch are still queued; skip them
+        while ((task = (i == 0 && workerId >= 0) ? queuePop(q) : queueSteal(q)) != NULL) {
+            atomic_fetch_sub(&pool.queued, 1);
+            if (claimTask(task)) return task;
+        }
+    }
+    return NULL;
+}
+
+void* workerMain(void* arg) {
+    workerId = (int)(intptr_t)arg;
+    while (1) {
+        Task* task = findWork();
+        if (task) {
+            runTask(task);
+            continue;
+        }
+        pthread_mutex_lock(&pool.idleLock);
+        while (atomic_load(&pool.queued) == 0) {
+            pthread_cond_wait(&pool.idleCond, &pool.idleLock);
+        }
+        pthread_mutex_unlock(&pool.idleLock);
+    }
+    return NULL;
+}
+
+// start one worker per core
+void startPool(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    pool.workerCount = (cores > 0) ? (int)cores : 1;
+    pool.queues = calloc(pool.workerCount + 1, sizeof(WorkQueue));
+    for (int i = 0; i <= pool.workerCount; i++) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+    }
+    atomic_init(&pool.queued, 0);
+    pthread_mutex_init(&pool.idleLock, NULL);
+    pthread_cond_init(&pool.idleCond, NULL);
+    pthread_mutex_init(&pool.doneLock, NULL);
+    pthread_cond_init(&pool.doneCond, NULL);
+
+    for (int i = 0; i < pool.workerCount; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, workerMain, (void*)(intptr_t)i);
+        pthread_detach(thread);
+    }
+}
+
+// future: start evaluating expression in the pool, returns handle for touch
+SExp* makeFuture(SExp* expr, Env* env) {
+    pthread_once(&poolOnce, startPool);
+
+    Task* task = malloc(sizeof(Task));
+    task->expr = expr;
+    task->env = env;
+    task->result = NULL;
+    task->interp = interp;
+    atomic_init(&task->state, TASK_PENDING);
+
+    SExp* future = newSExp(SEXP_FUTURE);
+    future->data.future = task;
+
+    queuePush(&pool.queues[(workerId >= 0) ? workerId : pool.workerCount], task);
+    atomic_fetch_add(&pool.queued, 1);
+    pthread_mutex_lock(&pool.idleLock);
+    pthread_cond_signal(&pool.idleCond);
+    pthread_mutex_unlock(&pool.idleLock);
+    return future;
+}
+
+// touch: wait for future's value (other values are returned as is)
+SExp* touch(SExp* value) {
+    if (sexpType(value) != SEXP_FUTURE) return value;
+    Task* task = value->data.future;
+
+    // not started yet: run it here rather than wait for a worker
+    if (claimTask(task)) runTask(task);
+
+    // otherwise help with queued work until it finishes
+    while (atomic_load_explicit(&task->state, memory_order_acquire) != TASK_DONE) {
+        Task* other = findWork();
+        if (other) {
+            runTask(other);
+            continue;
+        }
+        pthread_mutex_lock(&pool.doneLock);
+        if (atomic_load_explicit(&task->state, memory_order_acquire) != TASK_DONE) {
+            pthread_cond_wait(&pool.doneCond, &pool.doneLock);
+        }
+        pthread_mutex_unlock(&pool.doneLock);
+    }
+    return task->result;
+}
+
+// builtins are called by name, functions are passed as values
+SExp* calleeOf(SExp* fn, SExp* fnExpr) {
+    return (sexpType(fn) == SEXP_LAMBDA || sexpType(fn) == SEXP_NATIVE) ? fn : fnExpr;
+}
+
+// (callee 'arg): call on an argument that is already evaluated
+SExp* quotedCall(SExp* callee, SExp* arg) {
+    return cons(callee, cons(cons(makeSymbol("quote"), cons(arg, &nil)), &nil));
+}
+
+// pmap: apply function to each element of list in parallel, results in order
+SExp* pmap(SExp* fn, SExp* fnExpr, SExp* list, Env* env) {
+    if (sexpType(list) != SEXP_LIST) return makeSymbol("Error: pmap called on Atom");
+
+    SExp* callee = calleeOf(fn, fnExpr);
+    SExp* futures = &nil;
+    for (SExp* rest = list; rest != &nil && sexpType(rest) == SEXP_LIST; rest = cdr(rest)) {
+        futures = cons(makeFuture(quotedCall(callee, car(rest)), env), futures);
+    }
+    futures = reverseList(futures);
+
+    SExp* results = &nil;
+    for (SExp* rest = futures; rest != &nil; rest = cdr(rest)) {
+        results = cons(touch(car(rest)), results);
+    }
+    return reverseList(results);
+}
+
+/* promises and streams
+        a stream is a cons cell whose cdr is a promise for the rest of the
+        stream (or any ordinary list). Only the elements that are consumed
+        are ever computed.
+*/
+
+SExp* makePromise(SExp* expr, Env* env) {
+    SExp* promise = newSExp(SEXP_PROMISE);
+    promise->data.promise.expr = expr;
+    promise->data.promise.env = env;
+    atomic_init(&promise->data.promise.value, NULL);
+    return promise;
+}
+
+// value of promise, evaluating it on first use; other values are returned unchanged
+SExp* force(SExp* value) {
+    if (sexpType(value) != SEXP_PROMISE) return value;
+    Promise* promise = &value->data.promise;
+    SExp* result = atomic_load_explicit(&promise->value, memory_order_acquire);
+    if (result) return result;
+
+    result = eval(promise->expr, promise->env);
+    if (evalAbort) return result; // stopped by a limit: a later force evaluates it again
+    // if another thread (or a nested force) finished first, its value wins
+    SExp* first = NULL;
+    if (!atomic_compare_exchange_strong(&promise->value, &first, result)) result = first;
+    return result;
+}
+
+SExp* streamCdr(SExp* stream) {
+    return force(cdr(stream));
+}
+
+// (name callee (stream-cdr 'stream)): rest of a derived stream, built when forced
+SExp* streamRest(const char* name, SExp* callee, SExp* stream) {
+    SExp* rest = cons(makeSymbol("stream-cdr"), cons(cons(makeSymbol("quote"), cons(stream, &nil)), &nil));
+    return cons(makeSymbol(name), cons(callee, cons(rest, &nil)));
+}
+
+SExp* streamMap(SExp* fn, SExp* fnExpr, SExp* stream, Env* env) {
+    if (sexpType(stream) != SEXP_LIST) return makeSymbol("Error: stream-map called on Atom");
+    if (stream == &nil) return &nil;
+
+    SExp* callee = calleeOf(fn, fnExpr);
+    SExp* head = eval(quotedCall(callee, car(stream)), env);
+    return cons(head, makePromise(streamRest("stream-map", callee, stream), env));
+}
+
+// skips rejected elements in a loop, so long gaps do not nest calls
+SExp* streamFilter(SExp* fn, SExp* fnExpr, SExp* stream, Env* env) {
+    SExp* callee = calleeOf(fn, fnExpr);
+    while (stream != &nil) {
+        if (sexpType(stream) != SEXP_LIST) return makeSymbol("Error: stream-filter called on Atom");
+        SExp* head = car(stream);
+        if (eval(quotedCall(callee, head), env) != &nil) {
+            return cons(head, makePromise(streamRest("stream-filter", callee, stream), env));
+        }
+        stream = streamCdr(stream);
+    }
+    return &nil;
+}
+
+// list of the first count elements; forces nothing past the last one taken
+SExp* streamTake(SExp* stream, SExp* count) {
+    double n;
+    if (!getNumber(count, &n)) return makeSymbol("Error: stream-take count not a number");
+
+    SExp* result = &nil;
+    for (long i = 0; i < (long)n && stream != &nil; i++) {
+        if (sexpType(stream) != SEXP_LIST) return makeSymbol("Error: stream-take called on Atom");
+        result = cons(car(stream), result);
+        if (i + 1 < (long)n) stream = streamCdr(stream);
+    }
+    return reverseList(result);
+}
+
+/* file ports
+        input ports read into a large buffer and hand out lines and
+        expressions straight from it; output ports are stdio streams with an
+        equally large buffer.
+*/
+
+#define PORT_BUFFER_SIZE (64 * 1024)
+
+typedef struct Port {
+    int fd;          // input file, -1 for output ports and once closed
+    FILE* file;      // output file, NULL for input ports and once closed
+    char* buffer;    // input bytes not consumed yet are buffer[start, end)
+    size_t start;
+    size_t end;
+    size_t capacity; // buffer holds capacity + 1 bytes, for a terminating null
+    bool eof;
+} Port;
+
+SExp* makePort(Port* port) {
+    SExp* s = newSExp(SEXP_PORT);
+    s->data.port = port;
+    return s;
+}
+
+SExp* openInput(SExp* path) {
+    if (stringp(path) != &truth) return makeSymbol("Error: Path not a string");
+    int fd = open(stringCString(path->data.atom.value.string_value), O_RDONLY);
+    if (fd < 0) return makeSymbol("Error: Cannot open file");
+
+    Port* port = calloc(1, sizeof(Port));
+    port->fd = fd;
+    port->file = NULL;
+    port->capacity = PORT_BUFFER_SIZE;
+    port->buffer = malloc(port->capacity + 1);
+    port->buffer[0] = '\0';
+    return makePort(port);
+}
+
+SExp* openOutput(SExp* path) {
+    if (stringp(path) != &truth) return makeSymbol("Error: Path not a string");
+    FILE* file = fopen(stringCString(path->data.atom.value.string_value), "w");
+    if (!file) return makeSymbol("Error: Cannot open file");
+    setvbuf(file, NULL, _IOFBF, PORT_BUFFER_SIZE);
+
+    Port* port = calloc(1, sizeof(Port));
+    port->fd = -1;
+    port->file = file;
+    return makePort(port);
+}
+
+// open input port, or NULL if value is not one
+Port* inputPort(SExp* value) {
+    if (sexpType(value) != SEXP_PORT || !value->data.port || value->data.port->fd < 0) return NULL;
+    return value->data.port;
+}
+
+// read more of the file after buffer[end], moving unconsumed bytes to the front and
+// growing the buffer when they fill it; false once nothing more can be read
+bool portFill(Port* port) {
+    if (port->eof) return false;
+    if (port->start > 0) {
+        memmove(port->buffer, port->buffer + port->start, port->end - port->start);
+        port->end -= port->start;
+        port->start = 0;
+    }
+    if (port->end == port->capacity) {
+        port->capacity *= 2;
+        port->buffer = realloc(port->buffer, port->capacity + 1);
+    }
+    ssize_t n;
+    do {
+        n = read(port->fd, port->buffer + port->end, port->capacity - port->end);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        port->eof = true;
+        return false;
+    }
+    port->end += n;
+    port->buffer[port->end] = '\0';
+    return true;
+}
+
+// next line without its line ending, or eofObject
+SExp* readLine(SExp* value) {
+    Port* port = inputPort(value);
+    if (!port) return makeSymbol("Error: Not an open input port");
+
+    size_t scanned = port->start;
+    while (1) {
+        char* newline = memchr(port->buffer + scanned, '\n', port->end - scanned);
+        if (newline) {
+            size_t length = newline - (port->buffer + port->start);
+            char* line = port->buffer + port->start;
+            port->start += length + 1;
+            if (length > 0 && line[length - 1] == '\r') length--;
+            return makeStringN(line, length);
+        }
+        size_t consumed = port->start;
+        scanned = port->end;
+        if (!portFill(port)) break;
+        scanned -= consumed - port->start; // fill may have moved the data to the front
+    }
+
+    // last line without a newline
+    if (port->start == port->end) return &eofObject;
+    SExp* line = makeStringN(port->buffer + port->start, port->end - port->start);
+    port->start = port->end;
+    return line;
+}
+
+// index just past the expression starting at buffer[start], reading more as needed;
+// comments are blanked out so the parser sees plain text. 0 at end of file
+size_t portExpressionEnd(Port* port, bool* complete) {
+    size_t i = port->start;
+    int depth = 0;
+    bool started = false;   // past leading whitespace
+    bool inAtom = false;
+    bool inString = false;
+    bool inComment = false;
+    *complete = true;
+    while (1) {
+        if (i == port->end) {
+            size_t consumed = port->start;
+            bool more = portFill(port);
+            i -= consumed - port->start; // unconsumed bytes moved to the front
+            if (!more) {
+                if (inAtom && depth == 0) return i; // atom ending at end of file
+                if (started) *complete = false;
+                return 0;
+            }
+            continue;
+        }
+
+        char c = port->buffer[i];
+        if (inComment) {
+            if (c == '\n') inComment = false;
+            else port->buffer[i] = ' ';
+        }
+        else if (inString) {
+            if (c == '"') {
+                inString = false;
+                if (depth == 0) return i + 1;
+            }
+        }
+        else if (inAtom && depth == 0 && (isspace((unsigned char)c) || c == '(' || c == ')' || c == ';')) {
+            return i;
+        }
+        else if (c == ';') {
+            inComment = true;
+            port->buffer[i] = ' ';
+        }
+        else if (isspace((unsigned char)c)) {
+            if (!started) port->start = i + 1;
+        }
+        else {
+            started = true;
+            if (c == '"') inString = true;
+            else if (c == '(') depth++;
+            else if (c == ')') {
+                if (--depth <= 0) return i + 1;
+            }
+            else if (c != '\'') inAtom = true;
+        }
+        i++;
+    }
+}
+
+// next expression in the file, or eofObject
+SExp* readSExp(SExp* value) {
+    Port* port = inputPort(value);
+    if (!port) return makeSymbol("Error: Not an open input port");
+
+    bool complete;
+    size_t end = portExpressionEnd(port, &complete);
+    if (end == 0) return complete ? &eofObject : makeSymbol("Error: Unexpected end of file");
+
+    // parse in place, with the expression temporarily null-terminated
+    char saved = port->buffer[end];
+    port->buffer[end] = '\0';
+    char* cursor = port->buffer + port->start;
+    SExp* result = readSExpHelper(&cursor);
+    port->buffer[end] = saved;
+    port->start = end;
+    return result;
+}
+
+// write-string: text of a string, printed form of anything else; stdout without a port
+SExp* writeString(SExp* text, SExp* value) {
+    FILE* out = interp->out;
+    if (value) {
+        if (sexpType(value) != SEXP_PORT || !value->data.port || !value->data.port->file) {
+            return makeSymbol("Error: Not an open output port");
+        }
+        out = value->data.port->file;
+    }
+    if (stringp(text) == &truth) fwrite(stringChars(text->data.atom.value.string_value), 1, text->data.atom.value.string_value->length, out);
+    else fprintSExp(out, text);
+    return &truth;
+}
+
+SExp* closePort(SExp* value) {
+    if (sexpType(value) != SEXP_PORT) return makeSymbol("Error: Not a port");
+    Port* port = value->data.port;
+    if (!port) return &truth;
+    if (port->fd >= 0) {
+        close(port->fd);
+        port->fd = -1;
+        free(port->buffer);
+        port->buffer = NULL;
+    }
+    if (port->file) {
+        bool ok = fclose(port->file) == 0;
+        port->file = NULL;
+        if (!ok) return makeSymbol("Error: Cannot write file");
+    }
+    return &truth;
+}
+
+/* heap images: snapshot of globalEnv and everything reachable from it */
+
+#define IMAGE_MAGIC "LISPIMG3"
+#define IMAGE_LAYOUT ((uint64_t)sizeof(SExp) << 32 | sizeof(Env))
+
+// encoded pointers: offset of the object in the image, or one of these
+#define IMAGE_NULL  0
+#define IMAGE_NIL   1
+#define IMAGE_TRUTH 2
+
+typedef struct ImageHeader {
+    char magic[8];
+    uint64_t layout;      // object sizes of the build that wrote the image
+    uint64_t size;        // total bytes in image
+    uint64_t globalEnv;   // encoded pointer to global environment
+    uint64_t relocOffset; // table of offsets of fields holding encoded pointers
+    uint64_t relocCount;
+    uint64_t formsOffset; // (rewritten call, source form) pairs for originalForms
+    uint64_t formsCount;
+} ImageHeader;
+
+typedef enum {
+    IMAGE_SEXP, IMAGE_ENV, IMAGE_CHARS, IMAGE_STRING, IMAGE_MAP_NODE, IMAGE_VECTOR_NODE
+} ImageObjectType;
+
+// object with space reserved in the image
+typedef struct ImagePending {
+    void* object;
+    ImageObjectType type;
+    uint64_t offset;
+} ImagePending;
+
+typedef struct ImageWriter {
+    char* data;
+    size_t size;
+    size_t capacity;
+    PtrMap offsets;        // object -> offset in image
+    uint64_t* relocs;      // offsets of pointer fields
+    size_t relocCount;
+    size_t relocCapacity;
+    ImagePending* pending; // objects with reserved space
+    size_t pendingCount;
+    size_t pendingCapacity;
+    size_t copied;         // pending objects already copied
+} ImageWriter;
+
+// reserve 16-byte aligned, zeroed space in image, returning its offset
+// (cons headers hold car pointers, whose low bits must stay clear)
+uint64_t imageAlloc(ImageWriter* w, size_t size) {
+    size_t offset = (w->size + 15) & ~(size_t)15;
+    while (offset + size > w->capacity) {
+        w->capacity = w->capacity ? w->capacity * 2 : 4096;
+        w->data = realloc(w->data, w->capacity);
+    }
+    memset(w->data + w->size, 0, offset + size - w->size);
+    w->size = offset + size;
+    return offset;
+}
+
+// encoded pointer for object, reserving space for it on first sight
+uint64_t imageRef(ImageWriter* w, void* object, ImageObjectType type) {
+    if (type == IMAGE_SEXP && object != NULL) object = touch(object); // futures are stored as their value
+    if (object == NULL) return IMAGE_NULL;
+    if (object == &nil) return IMAGE_NIL;
+    if (object == &truth) return IMAGE_TRUTH;
+
+    void* known = ptrMapGet(&w->offsets, object);
+    if (known) return (uint64_t)(uintptr_t)known;
+
+    size_t size;
+    switch (type) {
+        case IMAGE_SEXP: size = sexpSize(sexpType(object)); break;
+        case IMAGE_ENV: size = sizeof(Env); break;
+        case IMAGE_STRING: size = sizeof(String) + ((String*)object)->length + 1; break; // text follows the struct
+        case IMAGE_MAP_NODE: size = sizeof(MapNode) + mapNodeSlots(object) * sizeof(void*); break;
+        case IMAGE_VECTOR_NODE: size = sizeof(VectorNode) + ((VectorNode*)object)->size * sizeof(void*); break;
+        default: size = strlen(object) + 1; break;
+    }
+    uint64_t offset = imageAlloc(w, size);
+    ptrMapPut(&w->offsets, object, (void*)(uintptr_t)offset);
+
+    if (w->pendingCount == w->pendingCapacity) {
+        w->pendingCapacity = w->pendingCapacity ? w->pendingCapacity * 2 : 256;
+        w->pending = realloc(w->pending, w->pendingCapacity * sizeof(ImagePending));
+    }
+    w->pending[w->pendingCount++] = (ImagePending){ object, type, offset };
+    return offset;
+}
+
+// store encoded pointer in the pointer field at given image offset
+void imageStoreEncoded(ImageWriter* w, uint64_t fieldOffset, uint64_t ref) {
+    memcpy(w->data + fieldOffset, &ref, sizeof(ref));
+
+    if (ref != IMAGE_NULL) {
+        if (w->relocCount == w->relocCapacity) {
+            w->relocCapacity = w->relocCapacity ? w->relocCapacity * 2 : 256;
+            w->relocs = realloc(w->relocs, w->relocCapacity * sizeof(uint64_t));
+        }
+        w->relocs[w->relocCount++] = fieldOffset;
+    }
+}
+
+// store encoded pointer to object in the pointer field at given image offset
+void imageStoreRef(ImageWriter* w, uint64_t fieldOffset, void* object, ImageObjectType type) {
+    uint64_t ref = imageRef(w, object, type); // may grow w->data
+    imageStoreEncoded(w, fieldOffset, ref);
+}
+
+// copy object into its reserved space, encoding its pointer fields
+void imageCopy(ImageWriter* w, ImagePending item) {
+    if (item.type == IMAGE_CHARS) {
+        strcpy(w->data + item.offset, item.object);
+        return;
+    }
+    if (item.type == IMAGE_STRING) {
+        // stored flat, whatever its shape in memory
+        String* s = item.object;
+        String flat = { .length = s->length, .slice = false };
+        memcpy(w->data + item.offset, &flat, sizeof(String));
+        memcpy(w->data + item.offset + sizeof(String), stringChars(s), s->length);
+        imageStoreEncoded(w, item.offset + offsetof(String, chars), item.offset + sizeof(String));
+        return;
+    }
+    if (item.type == IMAGE_MAP_NODE) {
+        MapNode* node = item.object;
+        size_t slots = mapNodeSlots(node);
+        size_t entries = slots - __builtin_popcount(node->nodeMap);
+        memcpy(w->data + item.offset, node, sizeof(MapNode));
+        for (size_t i = 0; i < slots; i++) {
+            imageStoreRef(w, item.offset + offsetof(MapNode, slots) + i * sizeof(void*), node->slots[i], i < entries ? IMAGE_SEXP : IMAGE_MAP_NODE);
+        }
+        return;
+    }
+    if (item.type == IMAGE_VECTOR_NODE) {
+        VectorNode* node = item.object;
+        memcpy(w->data + item.offset, node, sizeof(VectorNode));
+        for (size_t i = 0; i < node->size; i++) {
+            imageStoreRef(w, item.offset + offsetof(VectorNode, slots) + i * sizeof(void*), node->slots[i], node->shift ? IMAGE_VECTOR_NODE : IMAGE_SEXP);
+        }
+        return;
+    }
+    if (item.type == IMAGE_ENV) {
+        Env* e = item.object;
+        memcpy(w->data + item.offset, e, sizeof(Env));
+        imageStoreRef(w, item.offset + offsetof(Env, symbols), e->symbols, IMAGE_SEXP);
+        imageStoreRef(w, item.offset + offsetof(Env, values), e->values, IMAGE_SEXP);
+        imageStoreRef(w, item.offset + offsetof(Env, parent), e->parent, IMAGE_ENV);
+        return;
+    }
+
+    SExp* s = item.object;
+    memcpy(w->data + item.offset, s, sexpSize(sexpType(s)));
+    switch (sexpType(s)) {
+        case SEXP_ATOM:
+            if (atomType(s) == ATOM_SYMBOL) {
+                imageStoreRef(w, item.offset + offsetof(SExp, data.atom.value.symbol_value), s->data.atom.value.symbol_value, IMAGE_CHARS);
+            }
+            else if (atomType(s) == ATOM_STRING) {
+                imageStoreRef(w, item.offset + offsetof(SExp, data.atom.value.string_value), s->data.atom.value.string_value, IMAGE_STRING);
+            }
+            break;
+        case SEXP_LIST:
+            imageStoreRef(w, item.offset + offsetof(SExp, header), consCar(s), IMAGE_SEXP); // car pointer, list type 0
+            imageStoreRef(w, item.offset + offsetof(SExp, data.cons.cdr), s->data.cons.cdr, IMAGE_SEXP);
+            break;
+        case SEXP_LAMBDA:
+            ((SExp*)(w->data + item.offset))->header = SEXP_LAMBDA; // JIT records and code are per process
+            imageStoreRef(w, item.offset + offsetof(SExp, data.func.params), s->data.func.params, IMAGE_SEXP);
+            imageStoreRef(w, item.offset + offsetof(SExp, data.func.body), lambdaBody(s), IMAGE_SEXP); // saved optimized, never analyzed again
+            imageStoreRef(w, item.offset + offsetof(SExp, data.func.env), s->data.func.env, IMAGE_ENV);
+            break;
+        case SEXP_FUTURE:
+            break; // replaced by its value in imageRef
+        case SEXP_NATIVE:
+            // code addresses differ between runs: keep the name, the host registers it again
+            memset((char*)w->data + item.offset + offsetof(SExp, data.native), 0, sizeof(Native));
+            imageStoreRef(w, item.offset + offsetof(SExp, data.native.name), (void*)s->data.native.name, IMAGE_CHARS);
+            break;
+        case SEXP_PROMISE:
+            imageStoreRef(w, item.offset + offsetof(SExp, data.promise.expr), s->data.promise.expr, IMAGE_SEXP);
+            imageStoreRef(w, item.offset + offsetof(SExp, data.promise.env), s->data.promise.env, IMAGE_ENV);
+            imageStoreRef(w, item.offset + offsetof(SExp, data.promise.value), atomic_load(&s->data.promise.value), IMAGE_SEXP);
+            break;
+        case SEXP_MAP:
+            imageStoreRef(w, item.offset + offsetof(SExp, data.map.root), s->data.map.root, IMAGE_MAP_NODE);
+            break;
+        case SEXP_VECTOR:
+            imageStoreRef(w, item.offset + offsetof(SExp, data.vector.root), s->data.vector.root, IMAGE_VECTOR_NODE);
+            imageStoreRef(w, item.offset + offsetof(SExp, data.vector.tail), s->data.vector.tail, IMAGE_VECTOR_NODE);
+            break;
+        case SEXP_PORT:
+            // open files do not survive the process: the loaded port is closed
+            memset((char*)w->data + item.offset + offsetof(SExp, data.port), 0, sizeof(struct Port*));
+            break;
+    default:
+            break;
+    }
+}
+
+// copy every reserved object, breadth first (copying reserves children)
+void imageFlush(ImageWriter* w) {
+    while (w->copied < w->pendingCount) {
+        imageCopy(w, w->pending[w->copied++]);
+    }
+}
+
+// write globalEnv and everything reachable from it to file
+bool saveImage(const char* fileName) {
+    ImageWriter w = {0};
+    uint64_t headerOffset = imageAlloc(&w, sizeof(ImageHeader));
+    uint64_t globalRef = imageRef(&w, interp->globalEnv, IMAGE_ENV);
+    imageFlush(&w);
+
+    // keep source forms of rewritten calls that made it into the image
+    uint64_t formsCount = 0;
+    for (size_t i = 0; i < interp->originalForms.capacity; i++) {
+        if (interp->originalForms.keys[i] != NULL && ptrMapGet(&w.offsets, interp->originalForms.keys[i]) != NULL) formsCount++;
+    }
+    uint64_t formsOffset = imageAlloc(&w, formsCount * 2 * sizeof(uint64_t));
+    uint64_t pair = formsOffset;
+    for (size_t i = 0; i < interp->originalForms.capacity; i++) {
+        void* call = interp->originalForms.keys[i];
+        if (call == NULL || ptrMapGet(&w.offsets, call) == NULL) continue;
+        imageStoreRef(&w, pair, call, IMAGE_SEXP);
+        imageStoreRef(&w, pair + sizeof(uint64_t), interp->originalForms.values[i], IMAGE_SEXP);
+        pair += 2 * sizeof(uint64_t);
+    }
+    imageFlush(&w);
+
+    uint64_t relocOffset = imageAlloc(&w, w.relocCount * sizeof(uint64_t));
+    memcpy(w.data + relocOffset, w.relocs, w.relocCount * sizeof(uint64_t));
+
+    ImageHeader header = {0};
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.layout = IMAGE_LAYOUT;
+    header.size = w.size;
+    header.globalEnv = globalRef;
+    header.relocOffset = relocOffset;
+    header.relocCount = w.relocCount;
+    header.formsOffset = formsOffset;
+    header.formsCount = formsCount;
+    memcpy(w.data + headerOffset, &header, sizeof(header));
+
+    FILE* file = fopen(fileName, "wb");
+    bool ok = file && fwrite(w.data, 1, w.size, file) == w.size;
+    if (file) fclose(file);
+    if (!ok) perror("Failed to write image");
+
+    free(w.data);
+    free(w.relocs);
+    free(w.pending);
+    free(w.offsets.keys);
+    free(w.offsets.values);
+    return ok;
+}
+
+// decode pointer stored in image mapped at base
+void* imagePointer(char* base, uint64_t ref) {
+    switch (ref) {
+        case IMAGE_NULL: return NULL;
+        case IMAGE_NIL: return &nil;
+        case IMAGE_TRUTH: return &truth;
+        default: return base + ref;
+    }
+}
+
+// ref is one of the constants or the offset of something past the header
+bool imageRefValid(uint64_t ref, uint64_t size) {
+    return ref <= IMAGE_TRUTH || (ref >= sizeof(ImageHeader) && ref < size);
+}
+
+// fixed-up pointer is one imagePointer can return for an image of size bytes at base
+bool imagePointerValid(char* base, uint64_t size, uint64_t pointer) {
+    if (pointer == 0 || pointer == (uintptr_t)&nil || pointer == (uintptr_t)&truth) return true;
+    return pointer >= (uintptr_t)base + sizeof(ImageHeader) && pointer < (uintptr_t)base + size;
+}
+
+// map image file into memory, fix up its pointers and install its global environment
+bool loadImage(const char* fileName) {
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open image");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ImageHeader)) {
+        fprintf(stderr, "Invalid image: %s\n", fileName);
+        close(fd);
+        return false;
+    }
+    // private mapping: fix-ups stay in this process, the file is untouched
+    char* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("Failed to map image");
+        return false;
+    }
 
-            // extend enviro
-            Env* newEnv = extendEnv(formalParams, evaluatedArgs, op->data.func.env);
+    ImageHeader* header = (ImageHeader*)base;
+    uint64_t size = header->size;
+    bool valid = memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) == 0 && header->layout == IMAGE_LAYOUT && size == (uint64_t)st.st_size
+        && header->relocOffset <= size && header->relocOffset % sizeof(uint64_t) == 0
+        && header->relocCount <= (size - header->relocOffset) / sizeof(uint64_t)
+        && header->formsOffset <= size && header->formsOffset % sizeof(uint64_t) == 0
+        && header->formsCount <= (size - header->formsOffset) / (2 * sizeof(uint64_t))
+        && imageRefValid(header->globalEnv, size);
+
+    // every relocation must name an aligned field inside the image, once, holding a valid ref;
+    // fix-ups only touch the private mapping, so a bad entry anywhere rejects the whole image
+    uint64_t* relocs = (uint64_t*)(base + header->relocOffset);
+    uint8_t* fixed = valid ? calloc(size / (8 * sizeof(uint64_t)) + 1, 1) : NULL;
+    for (uint64_t i = 0; valid && i < header->relocCount; i++) {
+        uint64_t offset = relocs[i];
+        if (offset % sizeof(uint64_t) != 0 || offset > size - sizeof(uint64_t)) {
+            valid = false;
+            continue;
+        }
+        uint64_t slot = offset / sizeof(uint64_t);
+        uint64_t* field = (uint64_t*)(base + offset);
+        if ((fixed[slot / 8] & (1 << (slot % 8))) || !imageRefValid(*field, size)) {
+            valid = false;
+            continue;
+        }
+        fixed[slot / 8] |= 1 << (slot % 8);
+        *field = (uint64_t)(uintptr_t)imagePointer(base, *field);
+    }
+    free(fixed);
 
-            // eval body in new env
-            return eval (op->data.func.body, newEnv);
+    // pointer fields of the forms table were fixed up with the rest
+    uint64_t* forms = (uint64_t*)(base + header->formsOffset);
+    for (uint64_t i = 0; valid && i < 2 * header->formsCount; i++) {
+        valid = imagePointerValid(base, size, forms[i]);
+    }
+    if (!valid) {
+        fprintf(stderr, "Invalid image: %s\n", fileName);
+        munmap(base, st.st_size);
+        return false;
+    }
+
+    for (uint64_t i = 0; i < header->formsCount; i++) {
+        ptrMapPut(&interp->originalForms, (void*)(uintptr_t)forms[2 * i], (void*)(uintptr_t)forms[2 * i + 1]);
+    }
 
+    interp->globalEnv = imagePointer(base, header->globalEnv);
+    // records are per process: global functions get theirs by name, so the JIT
+    // can compile their self-calls; other closures get one on their first call
+    for (Env* e = interp->globalEnv; e; e = e->parent) {
+        for (SExp *syms = e->symbols, *vals = e->values; syms != &nil && vals != &nil; syms = cdr(syms), vals = cdr(vals)) {
+            SExp* value = car(vals);
+            if (sexpType(value) == SEXP_LAMBDA && !lambdaJit(value)) jitAttachLoaded(value, car(syms)->data.atom.value.symbol_value);
         }
-        if (op->type != SEXP_LAMBDA) return sexp;
     }
-    return makeSymbol("EvalError"); // fallback
+    return true;
 }
 
+// server functions (defined after the file readers)
+bool serveRequest(int fd, char* request);
+char* readFrame(int fd, uint32_t* length);
+
 // testing functions
 SExp* evalString(const char* input) {
     SExp* expr = sexp(input);   // parse string into an S-expression
     if (!expr) {
-        printf("ParseError: %s\n", input);
+        fprintf(interp->out, "ParseError: %s\n", input);
         return &nil;             // return nil on parse failure
     }
-    SExp* result = eval(expr, globalEnv);   // evaluate the S-expression
+    SExp* result = eval(expr, interp->globalEnv);   // evaluate the S-expression
     return result;
 }
+
+#ifndef LISP_NO_MAIN // tests run from the executable only
 void assertTest(FILE *file, const char* testName, SExp* actual, const char* expected) {
     char* got = sexpToString(actual);
     if (strcmp(got, expected) == 0) {
@@ -838,6 +4779,76 @@ void assertTest(FILE *file, const char* testName, SExp* actual, const char* expe
     }
 }
 
+// native function for the embedding tests: doubles a number and counts calls in data
+SExp* testNativeDouble(SExp* args, void* data) {
+    atomic_fetch_add((atomic_long*)data, 1);
+    double value;
+    if (!getNumber(car(args), &value)) return makeSymbol("Error: not a number");
+    return makeLong((long)value * 2);
+}
+
+bool readFile(const char* filename);
+extern bool cacheEnabled;
+extern bool pipelineEnabled;
+
+// results printed by loading a file, one per line, joined by spaces
+SExp* readFileOutput(const char* fileName) {
+    FILE* saved = interp->out;
+    interp->out = tmpfile();
+    readFile(fileName);
+    long length = ftell(interp->out);
+    char* text = calloc(length + 1, 1);
+    rewind(interp->out);
+    if (fread(text, 1, length, interp->out) != (size_t)length) length = 0;
+    fclose(interp->out);
+    interp->out = saved;
+    for (long i = 0; i < length; i++) {
+        if (text[i] == '\n') text[i] = (i == length - 1) ? '\0' : ' ';
+    }
+    SExp* output = makeSymbol(text);
+    free(text);
+    return output;
+}
+
+// inode of file, 0 if missing; rebuilding a sidecar replaces it with a new one
+ino_t fileInode(const char* fileName) {
+    struct stat st;
+    return stat(fileName, &st) == 0 ? st.st_ino : 0;
+}
+
+// permissions of the mapping holding address, from /proc/self/maps, or "" if unmapped
+const char* mappingPermissions(void* address) {
+    static char perms[5];
+    perms[0] = '\0';
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (!maps) return perms;
+    char line[512];
+    while (fgets(line, sizeof(line), maps)) {
+        uintptr_t start, end;
+        char found[5];
+        if (sscanf(line, "%lx-%lx %4s", &start, &end, found) == 3 && (uintptr_t)address >= start && (uintptr_t)address < end) {
+            memcpy(perms, found, sizeof(perms));
+            break;
+        }
+    }
+    fclose(maps);
+    return perms;
+}
+
+// write image with the 8 bytes at offset replaced by value, then try to load it
+bool loadPatchedImage(const char* image, size_t size, uint64_t offset, uint64_t value) {
+    char* copy = malloc(size);
+    memcpy(copy, image, size);
+    memcpy(copy + offset, &value, sizeof(value));
+    FILE* out = fopen("test_patched.img", "wb");
+    bool written = out && fwrite(copy, 1, size, out) == size;
+    if (out) fclose(out);
+    free(copy);
+    bool loaded = written && loadImage("test_patched.img");
+    remove("test_patched.img");
+    return loaded;
+}
+
 void runTests(const char* fileName) {
     FILE *file = fopen(fileName, "w");
     if (!file) {
@@ -845,12 +4856,7 @@ void runTests(const char* fileName) {
         return;
     }
 
-    if (!globalEnv) {
-        globalEnv = malloc(sizeof(Env));
-        globalEnv->symbols = &nil;
-        globalEnv->values = &nil;
-        globalEnv->parent = NULL;
-    }
+    ensureGlobalEnv();
 
     SExp* two = makeLong(2);
     SExp* three = makeLong(3);
@@ -1088,21 +5094,642 @@ void runTests(const char* fileName) {
 
     fprintf(file, "--- nested lambda ---\n");
     assertTest(file, "((lambda (f x) (f x)) (lambda (y) (mul y 2)) 5)", evalString("((lambda (f x) (f x)) (lambda (y) (mul y 2)) 5)"), "10");
-    
+
+    fprintf(file, "=== Optimizer Tests: Constant Folding ===\n");
+
+    fprintf(file, "--- folding ---\n");
+    assertTest(file, "(add 1 2)", optimizeExpr(sexp("(add 1 2)")), "3");
+    assertTest(file, "(add x (mul 2 3))", optimizeExpr(sexp("(add x (mul 2 3))")), "(add x 6)");
+    assertTest(file, "(lt 1 2)", optimizeExpr(sexp("(lt 1 2)")), "(quote t)");
+    assertTest(file, "(cons 1 (cons 2 ()))", optimizeExpr(sexp("(cons 1 (cons 2 ()))")), "(quote (1 2))");
+    assertTest(file, "(car '(a b))", optimizeExpr(sexp("(car '(a b))")), "(quote a)");
+    assertTest(file, "'5", optimizeExpr(sexp("'5")), "5");
+    assertTest(file, "(div 1 0)", optimizeExpr(sexp("(div 1 0)")), "(div 1 0)");
+    assertTest(file, "(car 5)", optimizeExpr(sexp("(car 5)")), "(car 5)");
+    assertTest(file, "'(add 1 2)", optimizeExpr(sexp("'(add 1 2)")), "(quote (add 1 2))");
+
+    fprintf(file, "--- branch pruning ---\n");
+    assertTest(file, "(if (gt 1 2) a b)", optimizeExpr(sexp("(if (gt 1 2) a b)")), "b");
+    assertTest(file, "(if x (add 1 1) b)", optimizeExpr(sexp("(if x (add 1 1) b)")), "(if x 2 b)");
+    assertTest(file, "(cond (() a) ('t b) (x c))", optimizeExpr(sexp("(cond (() a) ('t b) (x c))")), "b");
+    assertTest(file, "(cond ((nil? L) a) ((lt 2 1) b) ('t c) (x d))", optimizeExpr(sexp("(cond ((nil? L) a) ((lt 2 1) b) ('t c) (x d))")), "(cond ((nil? L) a) ((quote t) c))");
+    assertTest(file, "(and 't x)", optimizeExpr(sexp("(and 't x)")), "x");
+    assertTest(file, "(or 5 x)", optimizeExpr(sexp("(or 5 x)")), "(quote t)");
+
+    fprintf(file, "--- optimized functions ---\n");
+    assertTest(file, "(define three () (add 1 (mul 1 2)))", evalString("(define three () (add 1 (mul 1 2)))"), "three");
+    assertTest(file, "(three)", evalString("(three)"), "3");
+    assertTest(file, "(define pick (x) (cond ((eq 1 2) no) ('t x)))", evalString("(define pick (x) (cond ((eq 1 2) no) ('t x)))"), "pick");
+    assertTest(file, "(pick 7)", evalString("(pick 7)"), "7");
+    assertTest(file, "(define calls () (undefinedFn (add 1 2)))", evalString("(define calls () (undefinedFn (add 1 2)))"), "calls");
+    assertTest(file, "(calls)", evalString("(calls)"), "(undefinedFn (add 1 2))");
+
+    fprintf(file, "=== Heap Image Tests ===\n");
+    evalString("(define adder (n) (lambda (x) (add x n)))");
+    evalString("(set add5 (adder 5))");
+    Env* savedEnv = interp->globalEnv;
+    bool saved = saveImage("test_image.img");
+    interp->globalEnv = NULL;
+    bool loaded = saved && loadImage("test_image.img");
+    remove("test_image.img");
+    assertTest(file, "save and load image", (loaded && interp->globalEnv != savedEnv) ? &truth : &nil, "t");
+    assertTest(file, "(fact 5)", evalString("(fact 5)"), "120");
+    assertTest(file, "(add5 10)", evalString("(add5 10)"), "15");
+    assertTest(file, "y", evalString("y"), "()");
+    assertTest(file, "(calls)", evalString("(calls)"), "(undefinedFn (add 1 2))");
+    assertTest(file, "(define twice (x) (mul 2 (square x)))", evalString("(define twice (x) (mul 2 (square x)))"), "twice");
+    assertTest(file, "(twice 3)", evalString("(twice 3)"), "18");
+
+    fprintf(file, "=== Binary Serialization Tests ===\n");
+    assertTest(file, "(write-binary '(a (1 -2 2.5 \"s\") a . b) \"test_binary.lspb\")", evalString("(write-binary '(a (1 -2 2.5 \"s\") a . b) \"test_binary.lspb\")"), "t");
+    assertTest(file, "(read-binary \"test_binary.lspb\")", evalString("(read-binary \"test_binary.lspb\")"), "(a (1 -2 2.500000 \"s\") a . b)");
+    assertTest(file, "(write-binary 9223372036854775807 \"test_binary.lspb\")", evalString("(write-binary 9223372036854775807 \"test_binary.lspb\")"), "t");
+    assertTest(file, "(number? (read-binary \"test_binary.lspb\"))", evalString("(number? (read-binary \"test_binary.lspb\"))"), "t");
+    evalString("(set pair '(1 2))");
+    evalString("(write-binary (cons pair pair) \"test_binary.lspb\")");
+    SExp* sharedPair = evalString("(read-binary \"test_binary.lspb\")");
+    assertTest(file, "(cons pair pair)", sharedPair, "((1 2) 1 2)");
+    assertTest(file, "shared structure read once", (car(sharedPair) == cdr(sharedPair)) ? &truth : &nil, "t");
+    assertTest(file, "(write-binary square \"test_binary.lspb\")", evalString("(write-binary square \"test_binary.lspb\")"), "Error: Cannot serialize function");
+    assertTest(file, "(read-binary \"missing.lspb\")", evalString("(read-binary \"missing.lspb\")"), "Error: Cannot read file");
+    remove("test_binary.lspb");
+
+    fprintf(file, "=== Futures Tests ===\n");
+    assertTest(file, "(touch (future (add 1 2)))", evalString("(touch (future (add 1 2)))"), "3");
+    assertTest(file, "(touch 5)", evalString("(touch 5)"), "5");
+    assertTest(file, "(touch (future (fact 10)))", evalString("(touch (future (fact 10)))"), "3628800");
+    assertTest(file, "(pmap square '(1 2 3 4))", evalString("(pmap square '(1 2 3 4))"), "(1 4 9 16)");
+    assertTest(file, "(pmap (lambda (x) (add x 1)) '(1 2 3))", evalString("(pmap (lambda (x) (add x 1)) '(1 2 3))"), "(2 3 4)");
+    assertTest(file, "(pmap car '((1 2) (3 4)))", evalString("(pmap car '((1 2) (3 4)))"), "(1 3)");
+    assertTest(file, "(pmap square ())", evalString("(pmap square ())"), "()");
+    assertTest(file, "(pmap square 5)", evalString("(pmap square 5)"), "Error: pmap called on Atom");
+    assertTest(file, "(define psum (n) (if (lte n 1) n (add (touch (future (psum (sub n 1)))) n)))", evalString("(define psum (n) (if (lte n 1) n (add (touch (future (psum (sub n 1)))) n)))"), "psum");
+    assertTest(file, "(psum 50)", evalString("(psum 50)"), "1275");
+    assertTest(file, "(touch (future (set fromFuture 7)))", evalString("(touch (future (set fromFuture 7)))"), "7");
+    assertTest(file, "fromFuture", evalString("fromFuture"), "7");
+
+    fprintf(file, "\n=== Interpreter State Tests ===\n");
+    // a second interpreter starts with its own empty global environment
+    Interpreter* other = lispCreate();
+    assertTest(file, "(set onlyHere 1) in second interpreter", lispEvalString(other, "(set onlyHere 1)"), "1");
+    assertTest(file, "(fact 3) in second interpreter", lispEvalString(other, "(fact 3)"), "(fact 3)");
+    assertTest(file, "onlyHere", evalString("onlyHere"), "onlyHere");
+    // results longer than a fixed buffer print in full
+    evalString("(define countdown (n) (if (lte n 0) () (cons n (countdown (sub n 1)))))");
+    assertTest(file, "printed length of (countdown 100)", makeLong(strlen(sexpToString(evalString("(countdown 100)")))), "293");
+
+    fprintf(file, "\n=== Embedding API Tests ===\n");
+    atomic_long nativeCalls = 0;
+    lispRegister(other, "double", testNativeDouble, &nativeCalls);
+    assertTest(file, "(double 21) with native double", lispEvalString(other, "(double 21)"), "42");
+    assertTest(file, "(double (add 1 2)) with native double", lispEvalString(other, "(double (add 1 2))"), "6");
+    assertTest(file, "(pmap double '(1 2 3)) with native double", lispEvalString(other, "(pmap double '(1 2 3))"), "(2 4 6)");
+    assertTest(file, "(double 'x) with native double", lispEvalString(other, "(double 'x)"), "Error: not a number");
+    assertTest(file, "native call count", makeLong(atomic_load(&nativeCalls)), "6");
+    assertTest(file, "(double 21) in first interpreter", evalString("(double 21)"), "(double 21)");
+    assertTest(file, "lispToString", makeString(lispToString(other, lispEvalString(other, "(cons 1 '(2))"))), "\"(1 2)\"");
+    assertTest(file, "lispText", makeString(lispText(makeSymbol("abc"))), "\"abc\"");
+    lispDestroy(other);
+
+    fprintf(file, "\n=== Stream Tests ===\n");
+    assertTest(file, "(force (delay (add 1 2)))", evalString("(force (delay (add 1 2)))"), "3");
+    assertTest(file, "(force 5)", evalString("(force 5)"), "5");
+    evalString("(set hits 0)");
+    evalString("(set counted (delay (set hits (add hits 1))))");
+    evalString("(force counted)");
+    assertTest(file, "(force counted) twice", evalString("(force counted)"), "1");
+    evalString("(define forceCount (n) (if (eq n 0) 0 (add 1 (forceCount (sub n 1)))))");
+    evalString("(set limited (delay (forceCount 5000)))");
+    assertTest(file, "(with-limits (steps 100) (force limited))", evalString("(with-limits (steps 100) (force limited))"), "Error: Step limit exceeded");
+    assertTest(file, "(force limited) after the limit", evalString("(force limited)"), "5000");
+    assertTest(file, "hits", evalString("hits"), "1");
+    assertTest(file, "(define ints (n) (stream-cons n (ints (add n 1))))", evalString("(define ints (n) (stream-cons n (ints (add n 1))))"), "ints");
+    assertTest(file, "(stream-car (ints 1))", evalString("(stream-car (ints 1))"), "1");
+    assertTest(file, "(stream-car (stream-cdr (ints 1)))", evalString("(stream-car (stream-cdr (ints 1)))"), "2");
+    assertTest(file, "(stream-take (ints 1) 5)", evalString("(stream-take (ints 1) 5)"), "(1 2 3 4 5)");
+    assertTest(file, "(stream-take (stream-map square (ints 1)) 4)", evalString("(stream-take (stream-map square (ints 1)) 4)"), "(1 4 9 16)");
+    assertTest(file, "(stream-take (stream-filter (lambda (x) (eq (mod x 2) 0)) (ints 1)) 3)", evalString("(stream-take (stream-filter (lambda (x) (eq (mod x 2) 0)) (ints 1)) 3)"), "(2 4 6)");
+    assertTest(file, "(stream-take (stream-filter (lambda (x) (eq x 5000)) (ints 1)) 1)", evalString("(stream-take (stream-filter (lambda (x) (eq x 5000)) (ints 1)) 1)"), "(5000)");
+    assertTest(file, "(stream-take (stream-map number? '(1 a 2)) 5)", evalString("(stream-take (stream-map number? '(1 a 2)) 5)"), "(t () t)");
+    evalString("(set loud (stream-cons 1 (set hits 100)))");
+    assertTest(file, "(stream-take loud 1)", evalString("(stream-take loud 1)"), "(1)");
+    assertTest(file, "hits after (stream-take loud 1)", evalString("hits"), "1");
+    assertTest(file, "(stream-take 5 2)", evalString("(stream-take 5 2)"), "Error: stream-take called on Atom");
+    assertTest(file, "(stream-take (ints 1) 'x)", evalString("(stream-take (ints 1) 'x)"), "Error: stream-take count not a number");
+
+    fprintf(file, "\n=== String Tests ===\n");
+    assertTest(file, "(string-append \"ab\" \"cd\" \"ef\")", evalString("(string-append \"ab\" \"cd\" \"ef\")"), "\"abcdef\"");
+    assertTest(file, "(string-append)", evalString("(string-append)"), "\"\"");
+    assertTest(file, "(substring \"hello world\" 6)", evalString("(substring \"hello world\" 6)"), "\"world\"");
+    assertTest(file, "(substring \"hello world\" 0 5)", evalString("(substring \"hello world\" 0 5)"), "\"hello\"");
+    assertTest(file, "(string-length \"hello\")", evalString("(string-length \"hello\")"), "5");
+    assertTest(file, "(string-ref \"hello\" 1)", evalString("(string-ref \"hello\" 1)"), "\"e\"");
+    assertTest(file, "(string->symbol \"sym\")", evalString("(string->symbol \"sym\")"), "sym");
+    assertTest(file, "(number->string 42)", evalString("(number->string 42)"), "\"42\"");
+    assertTest(file, "(number->string 2.5)", evalString("(number->string 2.5)"), "\"2.500000\"");
+    assertTest(file, "(eq (substring \"xhello\" 1) \"hello\")", evalString("(eq (substring \"xhello\" 1) \"hello\")"), "t");
+    assertTest(file, "(eq (substring \"hello!\" 0 5) \"hello\")", evalString("(eq (substring \"hello!\" 0 5) \"hello\")"), "t");
+    assertTest(file, "(eq \"abc\" \"abd\")", evalString("(eq \"abc\" \"abd\")"), "()");
+    assertTest(file, "(substring \"abc\" 2 1)", evalString("(substring \"abc\" 2 1)"), "Error: Index out of range");
+    assertTest(file, "(string-ref \"abc\" 3)", evalString("(string-ref \"abc\" 3)"), "Error: Index out of range");
+    assertTest(file, "(string-append \"a\" 5)", evalString("(string-append \"a\" 5)"), "Error: Not a string");
+    assertTest(file, "(string-length 5)", evalString("(string-length 5)"), "Error: Not a string");
+    assertTest(file, "(define repeat (s n) (if (lte n 0) s (repeat (string-append s \"abcdefghij\") (sub n 1))))", evalString("(define repeat (s n) (if (lte n 0) s (repeat (string-append s \"abcdefghij\") (sub n 1))))"), "repeat");
+    assertTest(file, "(string-length (repeat \"\" 20000))", evalString("(string-length (repeat \"\" 20000))"), "200000");
+    assertTest(file, "(substring (repeat \"\" 20000) 199990 200000)", evalString("(substring (repeat \"\" 20000) 199990 200000)"), "\"abcdefghij\"");
+    assertTest(file, "(string-ref (string-append (repeat \"\" 10) \"z\") 100)", evalString("(string-ref (string-append (repeat \"\" 10) \"z\") 100)"), "\"z\"");
+
+    fprintf(file, "\n=== File Port Tests ===\n");
+    FILE* portFile = fopen("test_port.txt", "w");
+    if (portFile) {
+        // the long line does not fit the initial 64KB buffer
+        fprintf(portFile, "first line\r\n\n");
+        for (int i = 0; i < 100000; i++) fputc('x', portFile);
+        fprintf(portFile, "\n; comment\n(a b ; inline\n  c) 42 \"s (x\" 'q last");
+        fclose(portFile);
+    }
+    evalString("(set port (open-input \"test_port.txt\"))");
+    assertTest(file, "(read-line port)", evalString("(read-line port)"), "\"first line\"");
+    assertTest(file, "(read-line port) on empty line", evalString("(read-line port)"), "\"\"");
+    SExp* longLine = evalString("(read-line port)");
+    assertTest(file, "length of 100000 character line", makeLong(stringp(longLine) == &truth ? (long)longLine->data.atom.value.string_value->length : -1), "100000");
+    assertTest(file, "(read-sexp port) across lines with comments", evalString("(read-sexp port)"), "(a b c)");
+    assertTest(file, "(read-sexp port) number", evalString("(read-sexp port)"), "42");
+    assertTest(file, "(read-sexp port) string", evalString("(read-sexp port)"), "\"s (x\"");
+    assertTest(file, "(read-sexp port) quoted", evalString("(read-sexp port)"), "(quote q)");
+    assertTest(file, "(read-sexp port) at end of file", evalString("(read-sexp port)"), "last");
+    assertTest(file, "(eof? (read-sexp port))", evalString("(eof? (read-sexp port))"), "t");
+    assertTest(file, "(eof? (read-line port))", evalString("(eof? (read-line port))"), "t");
+    assertTest(file, "(close port)", evalString("(close port)"), "t");
+    assertTest(file, "(read-line port) after close", evalString("(read-line port)"), "Error: Not an open input port");
+    evalString("(set out (open-output \"test_port.txt\"))");
+    evalString("(write-string \"one \" out)");
+    evalString("(write-string '(2 3) out)");
+    assertTest(file, "(close out)", evalString("(close out)"), "t");
+    evalString("(define countLines (p n) (if (eof? (read-line p)) n (countLines p (add n 1))))");
+    assertTest(file, "(read-line (open-input \"test_port.txt\"))", evalString("(read-line (open-input \"test_port.txt\"))"), "\"one (2 3)\"");
+    assertTest(file, "(countLines (open-input \"test_port.txt\") 0)", evalString("(countLines (open-input \"test_port.txt\") 0)"), "1");
+    assertTest(file, "(write-string \"x\" 5)", evalString("(write-string \"x\" 5)"), "Error: Not an open output port");
+    assertTest(file, "(open-input \"missing_file.txt\")", evalString("(open-input \"missing_file.txt\")"), "Error: Cannot open file");
+    remove("test_port.txt");
+
+    fprintf(file, "\n=== Server Tests ===\n");
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) {
+        uint32_t length;
+        char request[] = "(square 3) (set serverLocal 2) serverLocal";
+        serveRequest(fds[0], request);
+        const char* frameNames[] = { "reply to (square 3)", "reply to (set serverLocal 2)", "reply to serverLocal", "end of reply" };
+        const char* expected[] = { "9", "2", "2", "" };
+        for (int i = 0; i < 4; i++) {
+            char* frame = readFrame(fds[1], &length);
+            assertTest(file, frameNames[i], makeSymbol(frame ? frame : "<none>"), expected[i]);
+            free(frame);
+        }
+        assertTest(file, "serverLocal after request", evalString("serverLocal"), "serverLocal");
+
+        char unbalanced[] = "(square 3";
+        serveRequest(fds[0], unbalanced);
+        char* frame = readFrame(fds[1], &length);
+        assertTest(file, "reply to (square 3", makeSymbol(frame ? frame : "<none>"), "Error: Unbalanced parentheses");
+        free(frame);
+        free(readFrame(fds[1], &length));
+
+        char quotedParen[] = "(string-length \"a)\") ; (square 3\n(string-length \"(\")";
+        serveRequest(fds[0], quotedParen);
+        const char* quotedNames[] = { "reply to (string-length \"a)\")", "reply to (string-length \"(\") after a comment", "end of reply" };
+        const char* quotedExpected[] = { "2", "1", "" };
+        for (int i = 0; i < 3; i++) {
+            frame = readFrame(fds[1], &length);
+            assertTest(file, quotedNames[i], makeSymbol(frame ? frame : "<none>"), quotedExpected[i]);
+            free(frame);
+        }
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    fprintf(file, "\n=== Object Layout Tests ===\n");
+    assertTest(file, "cons cell size", makeLong((long)sexpSize(SEXP_LIST)), "16");
+    assertTest(file, "lambda size", makeLong((long)sexpSize(SEXP_LAMBDA)), "32");
+    SExp* first = cons(two, &nil);
+    SExp* second = cons(three, first);
+    assertTest(file, "cons cells are 16-byte aligned", ((uintptr_t)first % 16 == 0 && (uintptr_t)second % 16 == 0) ? &truth : &nil, "t");
+    assertTest(file, "consecutive cons cells are adjacent", ((char*)second - (char*)first == 16) ? &truth : &nil, "t");
+    assertTest(file, "car kept in header", (consCar(second) == three && sexpType(second) == SEXP_LIST) ? &truth : &nil, "t");
+    assertTest(file, "atom type kept in header", (sexpType(point5) == SEXP_ATOM && atomType(point5) == ATOM_DOUBLE) ? &truth : &nil, "t");
+    evalString("(write-binary '(1 2 3 4) \"test_binary.lspb\")");
+    SExp* spine = evalString("(read-binary \"test_binary.lspb\")");
+    remove("test_binary.lspb");
+    bool contiguous = true;
+    for (SExp* cell = spine; cdr(cell) != &nil; cell = cdr(cell)) {
+        if ((char*)cdr(cell) - (char*)cell != 16) contiguous = false;
+    }
+    assertTest(file, "binary list spine is contiguous", contiguous ? &truth : &nil, "t");
+    assertTest(file, "(read-binary \"test_binary.lspb\") list", spine, "(1 2 3 4)");
+
+    fprintf(file, "\n=== Recursion Tests ===\n");
+    assertTest(file, "(define countdownList (n) (if (lte n 0) () (cons n (countdownList (sub n 1)))))", evalString("(define countdownList (n) (if (lte n 0) () (cons n (countdownList (sub n 1)))))"), "countdownList");
+    assertTest(file, "(define listLength (l) (if (nil? l) 0 (add 1 (listLength (cdr l)))))", evalString("(define listLength (l) (if (nil? l) 0 (add 1 (listLength (cdr l)))))"), "listLength");
+    assertTest(file, "(listLength (countdownList 200000))", evalString("(listLength (countdownList 200000))"), "200000");
+    Interpreter* shallow = lispCreate();
+    lispSetMaxDepth(shallow, 10000);
+    lispEvalString(shallow, "(define countdownList (n) (if (lte n 0) () (cons n (countdownList (sub n 1)))))");
+    lispEvalString(shallow, "(define forever (n) (add 1 (forever n)))");
+    assertTest(file, "(forever 1) with depth 10000", lispEvalString(shallow, "(forever 1)"), "Error: Recursion limit exceeded");
+    assertTest(file, "(add 2 3) after recursion limit", lispEvalString(shallow, "(add 2 3)"), "5");
+    assertTest(file, "(touch (future (forever 1))) with depth 10000", lispEvalString(shallow, "(touch (future (forever 1)))"), "Error: Recursion limit exceeded");
+    assertTest(file, "(car (countdownList 1000)) with depth 10000", lispEvalString(shallow, "(car (countdownList 1000))"), "1000");
+    assertTest(file, "(countdownList 5000) with depth 10000", lispEvalString(shallow, "(countdownList 5000)"), "Error: Recursion limit exceeded");
+    lispDestroy(shallow);
+
+    fprintf(file, "\n=== Evaluation Limit Tests ===\n");
+    assertTest(file, "(define spin (n) (spin (add n 1)))", evalString("(define spin (n) (spin (add n 1)))"), "spin");
+    assertTest(file, "(with-limits (steps 1000) (spin 0))", evalString("(with-limits (steps 1000) (spin 0))"), "Error: Step limit exceeded");
+    assertTest(file, "(with-limits (ms 20) (spin 0))", evalString("(with-limits (ms 20) (spin 0))"), "Error: Time limit exceeded");
+    assertTest(file, "(with-limits (bytes 10000) (countdownList 10000))", evalString("(with-limits (bytes 10000) (countdownList 10000))"), "Error: Memory limit exceeded");
+    assertTest(file, "(with-limits (depth 50) (countdownList 100))", evalString("(with-limits (depth 50) (countdownList 100))"), "Error: Recursion limit exceeded");
+    assertTest(file, "(with-limits (steps 10000 depth 500) (car (countdownList 100)))", evalString("(with-limits (steps 10000 depth 500) (car (countdownList 100)))"), "100");
+    assertTest(file, "(cons 1 (with-limits (steps 10) (spin 0)))", evalString("(cons 1 (with-limits (steps 10) (spin 0)))"), "(1 . Error: Step limit exceeded)");
+    assertTest(file, "(with-limits (steps 100) (with-limits (steps 100000) (spin 0)))", evalString("(with-limits (steps 100) (with-limits (steps 100000) (spin 0)))"), "Error: Step limit exceeded");
+    assertTest(file, "(with-limits (size 5) 1)", evalString("(with-limits (size 5) 1)"), "Error: Invalid limit");
+    assertTest(file, "(with-limits (steps -1) 1)", evalString("(with-limits (steps -1) 1)"), "Error: Invalid limit");
+    Interpreter* limited = lispCreate();
+    lispSetLimits(limited, (LispLimits){ .steps = 5000, .depth = 100000 });
+    lispEvalString(limited, "(define spin (n) (spin (add n 1)))");
+    assertTest(file, "(spin 0) with 5000 steps per evaluation", lispEvalString(limited, "(spin 0)"), "Error: Step limit exceeded");
+    assertTest(file, "(add 2 3) after step limit", lispEvalString(limited, "(add 2 3)"), "5");
+    lispDestroy(limited);
+
+    fprintf(file, "\n=== Lexer Tests ===\n");
+    assertTest(file, "(1 -2 007 -0 2.0)", sexp("(1 -2 007 -0 2.0)"), "(1 -2 7 0 2)");
+    assertTest(file, "123456789012345678", sexp("123456789012345678"), "123456789012345678");
+    assertTest(file, "-123456789012345678", sexp("-123456789012345678"), "-123456789012345678");
+    assertTest(file, "(number? 1234567890123456789)", numberp(sexp("1234567890123456789")), "t");
+    assertTest(file, "(2.5 -.5 1e3 0x10)", sexp("(2.5 -.5 1e3 0x10)"), "(2.500000 -0.500000 1000 16)");
+    assertTest(file, "(- . 5a a5 1e)", sexp("(- . 5a a5 1e)"), "(- . 5a a5 1e)");
+    assertTest(file, "(symbol? 5a)", symbolp(sexp("5a")), "t");
+    assertTest(file, "tab, CR, LF and form feed between tokens", sexp("(a\t(b\r\n c)\f d)"), "(a (b c) d)");
+    assertTest(file, "(\"x (y\" 3)", sexp("(\"x (y\" 3)"), "(\"x (y\" 3)");
+    assertTest(file, "\"open", sexp("\"open"), "Error: Unterminated string");
+
+    fprintf(file, "\n=== Call Site Tests ===\n");
+    const char* siteStates[] = { "unseen", "long", "double", "generic" };
+    assertTest(file, "(define scale (x y) (mul x y))", evalString("(define scale (x y) (mul x y))"), "scale");
+    SExp* scaleSite = car(lambdaBody(evalString("scale")));
+    assertTest(file, "call site before first call", makeSymbol(siteStates[atomic_load(&scaleSite->data.site.state)]), "unseen");
+    assertTest(file, "(scale 6 7)", evalString("(scale 6 7)"), "42");
+    assertTest(file, "call site after long operands", makeSymbol(siteStates[atomic_load(&scaleSite->data.site.state)]), "long");
+    assertTest(file, "(scale 9007199254740993 1)", evalString("(scale 9007199254740993 1)"), "9007199254740992");
+    assertTest(file, "call site after a long too large for the fast path", makeSymbol(siteStates[atomic_load(&scaleSite->data.site.state)]), "long");
+    assertTest(file, "(scale 2.5 2)", evalString("(scale 2.5 2)"), "5");
+    assertTest(file, "call site after mixed operands", makeSymbol(siteStates[atomic_load(&scaleSite->data.site.state)]), "generic");
+    assertTest(file, "(scale 3 4) after deoptimizing", evalString("(scale 3 4)"), "12");
+    assertTest(file, "(define half (x) (mul x 0.5))", evalString("(define half (x) (mul x 0.5))"), "half");
+    assertTest(file, "(half 5.5)", evalString("(half 5.5)"), "2.750000");
+    assertTest(file, "(half 4.5)", evalString("(half 4.5)"), "2.250000");
+    SExp* halfSite = car(lambdaBody(evalString("half")));
+    assertTest(file, "call site after double operands", makeSymbol(siteStates[atomic_load(&halfSite->data.site.state)]), "double");
+    assertTest(file, "(half 4)", evalString("(half 4)"), "2");
+    assertTest(file, "(define ratio (x y) (div x y))", evalString("(define ratio (x y) (div x y))"), "ratio");
+    assertTest(file, "(ratio 7 2)", evalString("(ratio 7 2)"), "3.500000");
+    assertTest(file, "(ratio 7 0)", evalString("(ratio 7 0)"), "Error: Divide by zero");
+    assertTest(file, "(define below (x y) (lt x y))", evalString("(define below (x y) (lt x y))"), "below");
+    assertTest(file, "(below 1 2)", evalString("(below 1 2)"), "t");
+    assertTest(file, "(below 1 'a)", evalString("(below 1 'a)"), "Error: Operand not a number");
+    assertTest(file, "optimized body prints as source", makeSymbol(sexpToString(lambdaBody(evalString("scale")))), "(mul x y)");
+
+    fprintf(file, "\n=== JIT Tests ===\n");
+    const char* jitStates[] = { "cold", "compiled", "unsupported" };
+    assertTest(file, "(define jfib (n) (if (lt n 2) n (add (jfib (sub n 1)) (jfib (sub n 2)))))", evalString("(define jfib (n) (if (lt n 2) n (add (jfib (sub n 1)) (jfib (sub n 2)))))"), "jfib");
+    assertTest(file, "(jfib 20)", evalString("(jfib 20)"), "6765");
+    assertTest(file, "jfib after (jfib 20)", makeSymbol(jitStates[atomic_load(&lambdaJit(evalString("jfib"))->state)]), "compiled");
+    assertTest(file, "(jfib 7.5)", evalString("(jfib 7.5)"), "23.500000");
+    assertTest(file, "(jfib 10)", evalString("(jfib 10)"), "55");
+    assertTest(file, "(define jsum (l acc) (if (nil? l) acc (jsum (cdr l) (add acc (car l)))))", evalString("(define jsum (l acc) (if (nil? l) acc (jsum (cdr l) (add acc (car l)))))"), "jsum");
+    assertTest(file, "(jsum (countdownList 1000) 0)", evalString("(jsum (countdownList 1000) 0)"), "500500");
+    assertTest(file, "jsum after a 1000 element list", makeSymbol(jitStates[atomic_load(&lambdaJit(evalString("jsum"))->state)]), "compiled");
+    assertTest(file, "(jsum '(1 2.5 x) 0)", evalString("(jsum '(1 2.5 x) 0)"), "Error: Operand not a number");
+    assertTest(file, "(define jfact (n) (if (eq n 0) 1 (mul n (jfact (sub n 1)))))", evalString("(define jfact (n) (if (eq n 0) 1 (mul n (jfact (sub n 1)))))"), "jfact");
+    evalString("(jfact 100)");
+    assertTest(file, "jfact after (jfact 100)", makeSymbol(jitStates[atomic_load(&lambdaJit(evalString("jfact"))->state)]), "compiled");
+    assertTest(file, "(jfact 20)", evalString("(jfact 20)"), "2432902008176640000");
+    assertTest(file, "(jfact 25) past the long fast path", evalString("(jfact 25)"), "15511210043330986055303168.000000");
+    assertTest(file, "(define jwalk (n) (cond ((gt n 0) (jwalk (sub n 1)))))", evalString("(define jwalk (n) (cond ((gt n 0) (jwalk (sub n 1)))))"), "jwalk");
+    assertTest(file, "(jwalk 100)", evalString("(jwalk 100)"), "Error: No selected branch");
+    assertTest(file, "(define jone () 1)", evalString("(define jone () 1)"), "jone");
+    assertTest(file, "(define jcount (n) (if (eq n 0) 0 (add (jone) (jcount (sub n 1)))))", evalString("(define jcount (n) (if (eq n 0) 0 (add (jone) (jcount (sub n 1)))))"), "jcount");
+    assertTest(file, "(jcount 100)", evalString("(jcount 100)"), "100");
+    assertTest(file, "jcount calling another function", makeSymbol(jitStates[atomic_load(&lambdaJit(evalString("jcount"))->state)]), "unsupported");
+    evalString("(set joldFact jfact)");
+    assertTest(file, "(define jfact (n) 0)", evalString("(define jfact (n) 0)"), "jfact");
+    assertTest(file, "(joldFact 5) after redefining jfact", evalString("(joldFact 5)"), "0");
+    assertTest(file, "(with-limits (steps 1000) (jfib 20))", evalString("(with-limits (steps 1000) (jfib 20))"), "Error: Step limit exceeded");
+    assertTest(file, "(with-limits (depth 40) (jfib 20))", evalString("(with-limits (depth 40) (jfib 20))"), "Error: Recursion limit exceeded");
+    assertTest(file, "(with-limits (depth 200) (jfib 20))", evalString("(with-limits (depth 200) (jfib 20))"), "6765");
+    assertTest(file, "(jsum (countdownList 200000) 0) past the compiled stack", evalString("(jsum (countdownList 200000) 0)"), "20000100000");
+    jitEnabled = false;
+    assertTest(file, "(jfib 20) with -no-jit", evalString("(jfib 20)"), "6765");
+    jitEnabled = true;
+
+    fprintf(file, "\n=== Map and Vector Tests ===\n");
+    assertTest(file, "(set hm (hash-map 'a 1 'b 2))", evalString("(set hm (hash-map 'a 1 'b 2))"), "{a 1 b 2}");
+    assertTest(file, "(map-get hm 'a)", evalString("(map-get hm 'a)"), "1");
+    assertTest(file, "(map-get hm 'z)", evalString("(map-get hm 'z)"), "()");
+    assertTest(file, "(map-contains? hm 'b)", evalString("(map-contains? hm 'b)"), "t");
+    evalString("(set hm2 (map-put hm 'c 3))");
+    assertTest(file, "(map-count hm2)", evalString("(map-count hm2)"), "3");
+    assertTest(file, "(map-count hm)", evalString("(map-count hm)"), "2");
+    assertTest(file, "(map-get (map-put hm 'a 10) 'a)", evalString("(map-get (map-put hm 'a 10) 'a)"), "10");
+    assertTest(file, "(map-get hm 'a)", evalString("(map-get hm 'a)"), "1");
+    assertTest(file, "(map-count (map-remove hm2 'a))", evalString("(map-count (map-remove hm2 'a))"), "2");
+    assertTest(file, "(map-contains? (map-remove hm2 'a) 'a)", evalString("(map-contains? (map-remove hm2 'a) 'a)"), "()");
+    assertTest(file, "(map-get (hash-map '(1 2) 'pair \"k\" 'str 2.5 'dbl) '(1 2))", evalString("(map-get (hash-map '(1 2) 'pair \"k\" 'str 2.5 'dbl) '(1 2))"), "pair");
+    assertTest(file, "(map-get (hash-map \"k\" 'str) \"k\")", evalString("(map-get (hash-map \"k\" 'str) \"k\")"), "str");
+    assertTest(file, "(map? hm)", evalString("(map? hm)"), "t");
+    assertTest(file, "(map? '(a 1))", evalString("(map? '(a 1))"), "()");
+    assertTest(file, "(hash-map 'a)", evalString("(hash-map 'a)"), "Error: Missing value");
+    assertTest(file, "(map-get '(a 1) 'a)", evalString("(map-get '(a 1) 'a)"), "Error: Not a map");
+    assertTest(file, "(set hv (vector 1 2 3))", evalString("(set hv (vector 1 2 3))"), "[1 2 3]");
+    assertTest(file, "(vector-ref hv 0)", evalString("(vector-ref hv 0)"), "1");
+    assertTest(file, "(vector-ref hv 3)", evalString("(vector-ref hv 3)"), "Error: Index out of range");
+    assertTest(file, "(vector-set hv 1 'x)", evalString("(vector-set hv 1 'x)"), "[1 x 3]");
+    assertTest(file, "hv", evalString("hv"), "[1 2 3]");
+    assertTest(file, "(vector-push hv 4)", evalString("(vector-push hv 4)"), "[1 2 3 4]");
+    assertTest(file, "(vector-pop hv)", evalString("(vector-pop hv)"), "[1 2]");
+    assertTest(file, "(vector-pop (vector))", evalString("(vector-pop (vector))"), "Error: Index out of range");
+    assertTest(file, "(vector-length hv)", evalString("(vector-length hv)"), "3");
+    assertTest(file, "(vector->list hv)", evalString("(vector->list hv)"), "(1 2 3)");
+    assertTest(file, "(vector? hv)", evalString("(vector? hv)"), "t");
+    assertTest(file, "(vector? hm)", evalString("(vector? hm)"), "()");
+    assertTest(file, "(list->vector 5)", evalString("(list->vector 5)"), "Error: Not a list");
+    assertTest(file, "(vector-ref '(1 2) 0)", evalString("(vector-ref '(1 2) 0)"), "Error: Not a vector");
+    evalString("(set bigv (list->vector (countdownList 5000)))");
+    assertTest(file, "(vector-length bigv)", evalString("(vector-length bigv)"), "5000");
+    assertTest(file, "(vector-ref bigv 0)", evalString("(vector-ref bigv 0)"), "5000");
+    assertTest(file, "(vector-ref bigv 4999)", evalString("(vector-ref bigv 4999)"), "1");
+    assertTest(file, "(vector-ref (vector-set bigv 2500 'mid) 2500)", evalString("(vector-ref (vector-set bigv 2500 'mid) 2500)"), "mid");
+    assertTest(file, "(vector-ref bigv 2500)", evalString("(vector-ref bigv 2500)"), "2500");
+    assertTest(file, "(define vfill (v n) (if (eq n 0) v (vfill (vector-push v n) (sub n 1))))", evalString("(define vfill (v n) (if (eq n 0) v (vfill (vector-push v n) (sub n 1))))"), "vfill");
+    assertTest(file, "(vector-length (vfill (vector) 3000))", evalString("(vector-length (vfill (vector) 3000))"), "3000");
+    assertTest(file, "(define vdrain (v) (if (eq (vector-length v) 0) 'empty (vdrain (vector-pop v))))", evalString("(define vdrain (v) (if (eq (vector-length v) 0) 'empty (vdrain (vector-pop v))))"), "vdrain");
+    assertTest(file, "(vdrain (vfill (vector) 3000))", evalString("(vdrain (vfill (vector) 3000))"), "empty");
+    assertTest(file, "(define mfill (m n) (if (eq n 0) m (mfill (map-put m n (mul n n)) (sub n 1))))", evalString("(define mfill (m n) (if (eq n 0) m (mfill (map-put m n (mul n n)) (sub n 1))))"), "mfill");
+    evalString("(set bigm (mfill (hash-map) 2000))");
+    assertTest(file, "(map-count bigm)", evalString("(map-count bigm)"), "2000");
+    assertTest(file, "(map-get bigm 1234)", evalString("(map-get bigm 1234)"), "1522756");
+    assertTest(file, "(map-count (map-remove bigm 1234))", evalString("(map-count (map-remove bigm 1234))"), "1999");
+    assertTest(file, "(map-get bigm 1234)", evalString("(map-get bigm 1234)"), "1522756");
+
+    fprintf(file, "\n=== File Cache Tests ===\n");
+    FILE* source = fopen("test_cache.lisp", "w");
+    fputs("(define cachedSquare (x) (mul x x))\n(cachedSquare 7)\n", source);
+    fclose(source);
+    remove("test_cache.lisp.lspc");
+    assertTest(file, "load without -cache", readFileOutput("test_cache.lisp"), "cachedSquare 49");
+    assertTest(file, "no sidecar without -cache", fileInode("test_cache.lisp.lspc") == 0 ? &truth : &nil, "t");
+    cacheEnabled = true;
+    assertTest(file, "first load with -cache", readFileOutput("test_cache.lisp"), "cachedSquare 49");
+    ino_t sidecar = fileInode("test_cache.lisp.lspc");
+    assertTest(file, "sidecar written", sidecar != 0 ? &truth : &nil, "t");
+    assertTest(file, "second load with -cache", readFileOutput("test_cache.lisp"), "cachedSquare 49");
+    assertTest(file, "sidecar reused", fileInode("test_cache.lisp.lspc") == sidecar ? &truth : &nil, "t");
+    source = fopen("test_cache.lisp", "w");
+    fputs("(define cachedSquare (x) (mul x x))\n(cachedSquare 8)\n", source); // same size
+    fclose(source);
+    assertTest(file, "load after editing the source", readFileOutput("test_cache.lisp"), "cachedSquare 64");
+    assertTest(file, "sidecar rebuilt", fileInode("test_cache.lisp.lspc") != sidecar ? &truth : &nil, "t");
+    FILE* damaged = fopen("test_cache.lisp.lspc", "r+");
+    fseek(damaged, -3, SEEK_END);
+    fputs("\xff\xff\xff", damaged);
+    fclose(damaged);
+    assertTest(file, "load with a damaged sidecar", readFileOutput("test_cache.lisp"), "cachedSquare 64");
+    source = fopen("test_cache.lisp", "w");
+    fclose(source);
+    assertTest(file, "load an empty file", makeLong(strlen(sexpToString(readFileOutput("test_cache.lisp")))), "0");
+    assertTest(file, "load an empty file again", makeLong(strlen(sexpToString(readFileOutput("test_cache.lisp")))), "0");
+    cacheEnabled = false;
+    remove("test_cache.lisp");
+    remove("test_cache.lisp.lspc");
+
+    fprintf(file, "\n=== Lazy Analysis Tests ===\n");
+    assertTest(file, "(define lazyThree () (add 1 (mul 1 2)))", evalString("(define lazyThree () (add 1 (mul 1 2)))"), "lazyThree");
+    JitRecord* lazyRecord = lambdaJit(evalString("lazyThree"));
+    assertTest(file, "body not optimized before the first call", atomic_load(&lazyRecord->body) == NULL ? &truth : &nil, "t");
+    assertTest(file, "body kept as written", evalString("lazyThree")->data.func.body, "(add 1 (mul 1 2))");
+    assertTest(file, "(lazyThree)", evalString("(lazyThree)"), "3");
+    assertTest(file, "body after the first call", atomic_load(&lazyRecord->body), "3");
+    assertTest(file, "(define lazyAdder (n) (lambda (x) (add x (mul n 2))))", evalString("(define lazyAdder (n) (lambda (x) (add x (mul n 2))))"), "lazyAdder");
+    evalString("(set lazyOne (lazyAdder 1))");
+    evalString("(set lazyTwo (lazyAdder 2))");
+    assertTest(file, "(lazyOne 10)", evalString("(lazyOne 10)"), "12");
+    assertTest(file, "closures share one record", lambdaJit(evalString("lazyOne")) == lambdaJit(evalString("lazyTwo")) ? &truth : &nil, "t");
+    assertTest(file, "closure optimized by its sibling's call", atomic_load(&lambdaJit(evalString("lazyTwo"))->body) != NULL ? &truth : &nil, "t");
+    assertTest(file, "(lazyTwo 10)", evalString("(lazyTwo 10)"), "14");
+
+    fprintf(file, "\n=== Pipeline Tests ===\n");
+    source = fopen("test_pipeline.lisp", "w");
+    fputs("(define pipeSquare (x) (mul x x))\n(pipeSquare 12)\n(write-string \"side\")\n(car 5)\n'(a\n  b) 'c\n", source);
+    fclose(source);
+    char* sequential = strdup(sexpToString(readFileOutput("test_pipeline.lisp")));
+    pipelineEnabled = true;
+    assertTest(file, "results and printed text with -pipeline", readFileOutput("test_pipeline.lisp"), sequential);
+    pipelineEnabled = false;
+    free(sequential);
+    source = fopen("test_pipeline.lisp", "w");
+    for (int i = 0; i < 1000; i++) fprintf(source, "(add %d 1)\n", i);
+    fclose(source);
+    sequential = strdup(sexpToString(readFileOutput("test_pipeline.lisp")));
+    pipelineEnabled = true;
+    assertTest(file, "1000 forms in order with -pipeline", strcmp(sexpToString(readFileOutput("test_pipeline.lisp")), sequential) == 0 ? &truth : &nil, "t");
+    free(sequential);
+    source = fopen("test_pipeline.lisp", "w");
+    fclose(source);
+    assertTest(file, "empty file with -pipeline", makeLong(strlen(sexpToString(readFileOutput("test_pipeline.lisp")))), "0");
+    pipelineEnabled = false;
+    remove("test_pipeline.lisp");
+
+    fprintf(file, "\n=== Local Binding and Loop Tests ===\n");
+    assertTest(file, "(let ((x 1) (y 2)) (add x y))", evalString("(let ((x 1) (y 2)) (add x y))"), "3");
+    assertTest(file, "(let ((x 1)) (let ((x 10) (y x)) (add x y)))", evalString("(let ((x 1)) (let ((x 10) (y x)) (add x y)))"), "11");
+    assertTest(file, "(let* ((x 1) (y (add x 1)) (x (mul y 10))) (add x y))", evalString("(let* ((x 1) (y (add x 1)) (x (mul y 10))) (add x y))"), "22");
+    assertTest(file, "(letrec ((ev (lambda (n) (if (eq n 0) 't (od (sub n 1))))) (od (lambda (n) (if (eq n 0) () (ev (sub n 1)))))) (ev 101))", evalString("(letrec ((ev (lambda (n) (if (eq n 0) 't (od (sub n 1))))) (od (lambda (n) (if (eq n 0) () (ev (sub n 1)))))) (ev 101))"), "()");
+    assertTest(file, "(let () 5)", evalString("(let () 5)"), "5");
+    assertTest(file, "(let ((x 1)) (set x 2) (add x 1))", evalString("(let ((x 1)) (set x 2) (add x 1))"), "3");
+    assertTest(file, "(let ((x 1)) 'ignored x)", evalString("(let ((x 1)) 'ignored x)"), "1");
+    assertTest(file, "(let (x) x)", evalString("(let (x) x)"), "Error: Invalid binding");
+    assertTest(file, "(let ((1 2)) 3)", evalString("(let ((1 2)) 3)"), "Error: Invalid binding");
+    assertTest(file, "(do ((i 0 (add i 1)) (acc 0 (add acc i))) ((eq i 10) acc))", evalString("(do ((i 0 (add i 1)) (acc 0 (add acc i))) ((eq i 10) acc))"), "45");
+    assertTest(file, "(do ((i 0 (add i 1)) (a 0 b) (b 1 (add a b))) ((eq i 50) a))", evalString("(do ((i 0 (add i 1)) (a 0 b) (b 1 (add a b))) ((eq i 50) a))"), "12586269025");
+    assertTest(file, "(do ((i 0 (add i 1))) ((eq i 3)))", evalString("(do ((i 0 (add i 1))) ((eq i 3)))"), "()");
+    assertTest(file, "(do ((i 0 (add i 'a))) ((gt i 3)))", evalString("(do ((i 0 (add i 'a))) ((gt i 3)))"), "Error: Operand not a number");
+    assertTest(file, "(do ((i 0 (add i 1))) ())", evalString("(do ((i 0 (add i 1))) ())"), "Error: Invalid loop");
+    assertTest(file, "(do ((i 0 1 2)) ((eq i 1)))", evalString("(do ((i 0 1 2)) ((eq i 1)))"), "Error: Invalid loop");
+    assertTest(file, "(define lsum (n) (let ((i 0) (acc 0)) (while (lte i n) (set acc (add acc i)) (set i (add i 1))) acc))", evalString("(define lsum (n) (let ((i 0) (acc 0)) (while (lte i n) (set acc (add acc i)) (set i (add i 1))) acc))"), "lsum");
+    assertTest(file, "(lsum 100)", evalString("(lsum 100)"), "5050");
+    assertTest(file, "(while () 1)", evalString("(while () 1)"), "()");
+    assertTest(file, "(while (lt 'a 1) 1)", evalString("(while (lt 'a 1) 1)"), "Error: Operand not a number");
+    assertTest(file, "(define dsum (n) (do ((i 0 (add i 1)) (acc 0 (add acc i))) ((gt i n) acc)))", evalString("(define dsum (n) (do ((i 0 (add i 1)) (acc 0 (add acc i))) ((gt i n) acc)))"), "dsum");
+    assertTest(file, "(dsum 2000000) past the recursion limit", evalString("(dsum 2000000)"), "2000001000000");
+    assertTest(file, "(with-limits (steps 1000) (while 't 1))", evalString("(with-limits (steps 1000) (while 't 1))"), "Error: Step limit exceeded");
+    assertTest(file, "(with-limits (steps 1000) (dsum 100000))", evalString("(with-limits (steps 1000) (dsum 100000))"), "Error: Step limit exceeded");
+    SExp* loopClosure = evalString("(let ((i 0)) (while (lt i 1000) (set i (add i 1))) (lambda () i))");
+    assertTest(file, "while loop setting a let variable keeps one binding", makeLong(listLength(loopClosure->data.func.env->symbols)), "1");
+    SExp* stepClosure = evalString("(do ((i 0 (add i 1)) (f () (lambda () i))) ((eq i 1000) f))");
+    assertTest(file, "do loop keeps one frame", makeLong(listLength(stepClosure->data.func.env->symbols)), "2");
+    assertTest(file, "closure sees the last value of its loop variable", evalString("((do ((i 0 (add i 1)) (f () (lambda () i))) ((eq i 1000) f)))"), "1000");
+    assertTest(file, "(define lopt () (let ((x (add 1 2))) (mul x 2)))", evalString("(define lopt () (let ((x (add 1 2))) (mul x 2)))"), "lopt");
+    assertTest(file, "(lopt)", evalString("(lopt)"), "6");
+    assertTest(file, "let body optimized", lambdaBody(evalString("lopt")), "(let ((x 3)) (mul x 2))");
+
+    fprintf(file, "\n=== Heap Tests ===\n");
+    SExp* heapCell = cons(&nil, &nil);
+    char* listSlab = slabs[SEXP_LIST].end - SLAB_SIZE;
+    assertTest(file, "cons cell lies in a heap slab", ((char*)heapCell >= listSlab && (char*)heapCell < slabs[SEXP_LIST].end && (uintptr_t)listSlab % SLAB_SIZE == 0) ? &truth : &nil, "t");
+    Env* heapFrame = consEnv(&nil, &nil, NULL);
+    char* envStart = envSlab.end - SLAB_SIZE;
+    assertTest(file, "environment lies in a heap slab", ((char*)heapFrame >= envStart && (char*)heapFrame < envSlab.end && (uintptr_t)envStart % SLAB_SIZE == 0) ? &truth : &nil, "t");
+    assertTest(file, "current region ends on a huge page", ((uintptr_t)heap.end % HEAP_PAGE_SIZE == 0) ? &truth : &nil, "t");
+    size_t heapBefore = heap.used;
+    evalString("(define hbuild (n acc) (if (eq n 0) acc (hbuild (sub n 1) (cons n acc))))");
+    assertTest(file, "(car (hbuild 100000 ()))", evalString("(car (hbuild 100000 ()))"), "1");
+    assertTest(file, "heap grows by whole slabs", (heap.used >= heapBefore + 100000 * 16 && (heap.used - heapBefore) % SLAB_SIZE == 0) ? &truth : &nil, "t");
+    assertTest(file, "reserved regions cover the heap in use", (heap.used <= heap.reserved && heap.reserved == heap.regions * HEAP_REGION_SIZE) ? &truth : &nil, "t");
+
+    fprintf(file, "\n=== Image Validation Tests ===\n");
+    evalString("(define imgv (x) (cons x x))");
+    Env* validEnv = interp->globalEnv;
+    saveImage("test_image.img");
+    FILE* imageFile = fopen("test_image.img", "rb");
+    fseek(imageFile, 0, SEEK_END);
+    size_t imageSize = ftell(imageFile);
+    char* image = malloc(imageSize);
+    rewind(imageFile);
+    if (fread(image, 1, imageSize, imageFile) != imageSize) imageSize = 0;
+    fclose(imageFile);
+    remove("test_image.img");
+    ImageHeader* imageHeader = (ImageHeader*)image;
+    uint64_t* imageRelocs = (uint64_t*)(image + imageHeader->relocOffset);
+    assertTest(file, "image has relocations", (imageSize > 0 && imageHeader->relocCount > 1) ? &truth : &nil, "t");
+    assertTest(file, "overflowing relocation count rejected", loadPatchedImage(image, imageSize, offsetof(ImageHeader, relocCount), UINT64_MAX / 8 + 1) ? &truth : &nil, "()");
+    assertTest(file, "relocation past the end rejected", loadPatchedImage(image, imageSize, (char*)&imageRelocs[0] - image, imageSize - 4) ? &truth : &nil, "()");
+    assertTest(file, "relocation target past the end rejected", loadPatchedImage(image, imageSize, imageRelocs[0], imageSize + 64) ? &truth : &nil, "()");
+    assertTest(file, "repeated relocation rejected", loadPatchedImage(image, imageSize, (char*)&imageRelocs[1] - image, imageRelocs[0]) ? &truth : &nil, "()");
+    assertTest(file, "rejected images leave the environment alone", (interp->globalEnv == validEnv) ? &truth : &nil, "t");
+    assertTest(file, "intact image loads", loadPatchedImage(image, imageSize, 0, *(uint64_t*)image) ? &truth : &nil, "t");
+    assertTest(file, "(imgv 4)", evalString("(imgv 4)"), "(4 . 4)");
+    free(image);
+
+    fprintf(file, "\n=== Stack Guard Tests ===\n");
+    assertTest(file, "(listLength (countdownList 200000))", evalString("(listLength (countdownList 200000))"), "200000");
+    assertTest(file, "deep recursion leaves a spare segment", spareSegments ? &truth : &nil, "t");
+    assertTest(file, "bottom of a segment is a guard", makeString(spareSegments ? mappingPermissions(spareSegments->base) : ""), "\"---p\"");
+    assertTest(file, "segment is writable above the guard", makeString(spareSegments ? mappingPermissions(spareSegments->base + STACK_GUARD_SIZE) : ""), "\"rw-p\"");
+
+    fprintf(file, "\n=== Shared Body Tests ===\n");
+    source = fopen("test_shared.lisp", "w");
+    fputs("(define sharedG (x) x)\n(define sharedH (y x) x)\n"
+          "(define sharedLoop (n acc) (if (eq n 0) acc (sharedLoop (sub n 1) (sharedH 1 2))))\n"
+          "(sharedLoop 100 0)\n(sharedH 1 2)\n", source);
+    fclose(source);
+    remove("test_shared.lisp.lspc");
+    cacheEnabled = true;
+    assertTest(file, "first load with -cache", readFileOutput("test_shared.lisp"), "sharedG sharedH sharedLoop 2 2");
+    assertTest(file, "cached load of functions with equal bodies", readFileOutput("test_shared.lisp"), "sharedG sharedH sharedLoop 2 2");
+    cacheEnabled = false;
+    assertTest(file, "equal bodies with other params get their own record", (lambdaJit(evalString("sharedG")) != lambdaJit(evalString("sharedH"))) ? &truth : &nil, "t");
+    assertTest(file, "sharedH compiled against its own params", makeSymbol(jitStates[atomic_load(&lambdaJit(evalString("sharedH"))->state)]), "compiled");
+    remove("test_shared.lisp");
+    remove("test_shared.lisp.lspc");
+
+    fprintf(file, "\n=== Cache Integrity Tests ===\n");
+    source = fopen("test_damaged.lisp", "w");
+    fputs("(quote damagedSymbol)\n", source);
+    fclose(source);
+    remove("test_damaged.lisp.lspc");
+    cacheEnabled = true;
+    assertTest(file, "first load with -cache", readFileOutput("test_damaged.lisp"), "damagedSymbol");
+    FILE* sidecarFile = fopen("test_damaged.lisp.lspc", "r+b");
+    char sidecarBytes[512];
+    size_t sidecarSize = sidecarFile ? fread(sidecarBytes, 1, sizeof(sidecarBytes), sidecarFile) : 0;
+    char* symbolBytes = memmem(sidecarBytes, sidecarSize, "damagedSymbol", 13);
+    if (symbolBytes) {
+        fseek(sidecarFile, symbolBytes - sidecarBytes, SEEK_SET);
+        fputs("damagedSymbel", sidecarFile); // still decodes, to another symbol
+    }
+    if (sidecarFile) fclose(sidecarFile);
+    assertTest(file, "symbol found in the sidecar", symbolBytes ? &truth : &nil, "t");
+    ino_t damagedSidecar = fileInode("test_damaged.lisp.lspc");
+    assertTest(file, "damaged sidecar that still decodes", readFileOutput("test_damaged.lisp"), "damagedSymbol");
+    assertTest(file, "damaged sidecar rewritten", fileInode("test_damaged.lisp.lspc") != damagedSidecar ? &truth : &nil, "t");
+    assertTest(file, "rewritten sidecar reused", readFileOutput("test_damaged.lisp"), "damagedSymbol");
+    cacheEnabled = false;
+    remove("test_damaged.lisp");
+    remove("test_damaged.lisp.lspc");
+
+    fprintf(file, "\n=== Heap Limit Tests ===\n");
+    lispSetMaxHeap(heap.used + 1024 * 1024);
+    assertTest(file, "(hbuild 1000000 ()) past the heap limit", evalString("(hbuild 1000000 ())"), "Error: Heap limit exceeded");
+    assertTest(file, "(with-limits (steps 100000000) (hbuild 1000000 ())) past the heap limit", evalString("(with-limits (steps 100000000) (hbuild 1000000 ()))"), "Error: Heap limit exceeded");
+    assertTest(file, "(add 1 (with-limits (steps 100000000) (hbuild 1000000 ()))) aborts the whole evaluation", evalString("(add 1 (with-limits (steps 100000000) (hbuild 1000000 ())))"), "Error: Heap limit exceeded");
+    lispSetMaxHeap(0);
+    assertTest(file, "(car (hbuild 10 ())) after raising the limit", evalString("(car (hbuild 10 ()))"), "1");
+
+    fprintf(file, "\n=== Image JIT Tests ===\n");
+    evalString("(define imgFib (n) (if (lt n 2) n (add (imgFib (sub n 1)) (imgFib (sub n 2)))))");
+    evalString("(set imgAdder ((lambda (k) (lambda (x) (add x k))) 5))");
+    bool imageSaved = saveImage("test_image.img");
+    interp->globalEnv = NULL;
+    assertTest(file, "load image", (imageSaved && loadImage("test_image.img")) ? &truth : &nil, "t");
+    remove("test_image.img");
+    assertTest(file, "loaded function has a record", lambdaJit(evalString("imgFib")) ? &truth : &nil, "t");
+    assertTest(file, "(imgFib 20)", evalString("(imgFib 20)"), "6765");
+    assertTest(file, "imgFib after (imgFib 20)", makeSymbol(jitStates[atomic_load(&lambdaJit(evalString("imgFib"))->state)]), "compiled");
+    assertTest(file, "(imgAdder 10)", evalString("(imgAdder 10)"), "15");
+    assertTest(file, "loaded closure gets a record on its first call", lambdaJit(evalString("imgAdder")) ? &truth : &nil, "t");
+
+    fprintf(file, "\n=== Binary List Heap Tests ===\n");
+    SExp* spineList = evalString("(hbuild 400 ())");
+    size_t encodedSize;
+    unsigned char* encoded = binaryEncode(&spineList, 1, &encodedSize, false);
+    while ((size_t)(slabs[SEXP_LIST].end - slabs[SEXP_LIST].next) < 2 * 400 * 16) newSExp(SEXP_LIST); // room for the spine
+    size_t spineBytes = allocatedBytes;
+    BinaryReader reader;
+    SExp* decoded = binaryReaderInit(&reader, encoded, encodedSize) ? binaryRead(&reader) : NULL;
+    binaryReaderFree(&reader);
+    assertTest(file, "car of a decoded 400-element list", decoded ? car(decoded) : &nil, "1");
+    assertTest(file, "spine counted in allocated bytes", (allocatedBytes - spineBytes >= 400 * 16) ? &truth : &nil, "t");
+    char* spineSlab = slabs[SEXP_LIST].end - SLAB_SIZE;
+    assertTest(file, "spine lies in a heap slab", ((char*)decoded >= spineSlab && (char*)decoded < slabs[SEXP_LIST].end) ? &truth : &nil, "t");
+    char* listNext = slabs[SEXP_LIST].next;
+    decoded = binaryReaderInit(&reader, encoded, encodedSize - 1) ? binaryRead(&reader) : NULL;
+    binaryReaderFree(&reader);
+    assertTest(file, "list with its tail cut off", decoded ? &truth : &nil, "()");
+    assertTest(file, "failed read gives its cells back", (slabs[SEXP_LIST].next == listNext) ? &truth : &nil, "t");
+    decoded = binaryReaderInit(&reader, encoded, encodedSize / 2) ? binaryRead(&reader) : NULL;
+    binaryReaderFree(&reader);
+    assertTest(file, "list cut off halfway", decoded ? &truth : &nil, "()");
+    assertTest(file, "halfway failure gives its cells back", (slabs[SEXP_LIST].next == listNext) ? &truth : &nil, "t");
+    free(encoded);
+
     fclose(file);
 }
+#endif
 
 
 // helper to read expression from file/stdin, handles multi-line input
 char* readExpression(FILE *in) {
-    static char buffer[1024];
-    buffer[0] = '\0';
-
+    size_t length = 0;
     int parens = 0;
-    char line[256];
-    while (fgets(line, sizeof(line), in)) {
+    while (getline(&interp->lineBuffer, &interp->lineCapacity, in) != -1) {
+        char* line = interp->lineBuffer;
         stripComment(line);
-        strncat (buffer, line, sizeof(buffer) - strlen(buffer) - 1);
+        size_t lineLength = strlen(line);
+        if (length + lineLength + 1 > interp->exprCapacity) {
+            interp->exprCapacity = (length + lineLength + 1) * 2;
+            interp->exprBuffer = realloc(interp->exprBuffer, interp->exprCapacity);
+        }
+        memcpy(interp->exprBuffer + length, line, lineLength + 1);
+        length += lineLength;
 
         // count parentheses
         for (int i = 0; line[i] != '\0'; i++) {
@@ -1110,47 +5737,431 @@ char* readExpression(FILE *in) {
             else if (line[i] == ')') parens--;
         }
 
-        if (parens <= 0 && buffer[0] != '\0') {
-            return buffer;
+        if (parens <= 0 && length > 0) {
+            return interp->exprBuffer;
         }
     }
     return NULL; // EOF
 }
 
+// eval each expression stored in binary format
+bool readBinaryFile(const char* filename) {
+    size_t size;
+    unsigned char* data = readWholeFile(filename, &size);
+    if (!data) {
+        fprintf(interp->err, "Failed to open file: %s\n", strerror(errno));
+        return false;
+    }
+
+    BinaryReader r;
+    bool ok = true;
+    binaryReaderInit(&r, data, size);
+    while (!binaryAtEnd(&r)) {
+        SExp* sexpInput = binaryRead(&r);
+        if (!sexpInput) {
+            fprintf(interp->err, "Invalid binary data: %s\n", filename);
+            ok = false;
+            break;
+        }
+        SExp* result = eval(sexpInput, interp->globalEnv);
+        fprintf(interp->out, "%s\n", sexpToString(result));
+    }
+    binaryReaderFree(&r);
+    free(data);
+    return ok;
+}
+
+/* compiled file cache
+        with -cache, the forms of a source file are kept next to it in
+        <file>.lspc: a key header followed by the binary format. a later
+        load maps the sidecar and decodes it instead of parsing; if the
+        key does not match the source, or the encoded forms do not match
+        their stored hash, the file is parsed again and the sidecar
+        rewritten.
+*/
+
+#define CACHE_MAGIC "LSPCACH2"
+
+bool cacheEnabled = false; // -cache: reuse parsed forms stored beside source files
+
+typedef struct CacheHeader {
+    char magic[8];
+    uint64_t pathHash;    // hash of the source's absolute path
+    uint64_t size;        // source size in bytes
+    int64_t mtime;        // source modification time
+    int64_t mtimeNsec;
+    uint64_t contentHash; // hash of the source text
+    uint64_t formCount;
+    uint64_t payloadHash; // hash of the encoded forms after the header
+} CacheHeader;
+
+// key describing source file as it is now
+CacheHeader cacheKey(const char* fileName, struct stat* st, const unsigned char* source, size_t size) {
+    CacheHeader key;
+    memset(&key, 0, sizeof(key));
+    memcpy(key.magic, CACHE_MAGIC, sizeof(key.magic));
+    char* path = realpath(fileName, NULL);
+    key.pathHash = stringHash(path ? path : fileName);
+    free(path);
+    key.size = size;
+    key.mtime = st->st_mtim.tv_sec;
+    key.mtimeNsec = st->st_mtim.tv_nsec;
+    key.contentHash = textHash((const char*)source, size);
+    return key;
+}
+
+// sidecar name for source file, caller frees
+char* cachePath(const char* fileName) {
+    size_t length = strlen(fileName);
+    char* path = malloc(length + 6);
+    memcpy(path, fileName, length);
+    memcpy(path + length, ".lspc", 6);
+    return path;
+}
+
+// read forms stored in sidecar, false if it is missing, stale, damaged or malformed
+bool cacheLoad(const char* fileName, CacheHeader* key, SExp*** forms, size_t* count) {
+    char* path = cachePath(fileName);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+    unsigned char* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return false;
+
+    // stored count and hash are copied into the key so the whole header compares at once
+    CacheHeader* header = (CacheHeader*)base;
+    key->formCount = header->formCount;
+    key->payloadHash = header->payloadHash;
+    const unsigned char* payload = base + sizeof(CacheHeader);
+    size_t payloadSize = st.st_size - sizeof(CacheHeader);
+    bool ok = false;
+    size_t capacity = 0;
+    *forms = NULL;
+    *count = 0;
+    BinaryReader r;
+    if (memcmp(header, key, sizeof(CacheHeader)) == 0
+        && textHash((const char*)payload, payloadSize) == header->payloadHash
+        && binaryReaderInit(&r, payload, payloadSize)) {
+        SExp* form;
+        while (!binaryAtEnd(&r) && (form = binaryRead(&r)) != NULL) {
+            binaryPush(forms, count, &capacity, form);
+        }
+        ok = binaryAtEnd(&r) && *count == header->formCount;
+        binaryReaderFree(&r);
+    }
+    munmap(base, st.st_size);
+    if (!ok) {
+        free(*forms);
+        *forms = NULL;
+    }
+    return ok;
+}
+
+// write sidecar through a temporary file, so readers never see half of one
+void cacheStore(const char* fileName, CacheHeader* key, SExp** forms, size_t count) {
+    size_t size;
+    unsigned char* data = binaryEncode(forms, count, &size, false); // source forms never hold functions or shared cells
+    char* path = cachePath(fileName);
+    size_t length = strlen(path);
+    char* temp = malloc(length + 8);
+    memcpy(temp, path, length);
+    memcpy(temp + length, ".XXXXXX", 8);
+
+    int fd = mkstemp(temp);
+    if (fd >= 0) {
+        key->formCount = count;
+        key->payloadHash = textHash((const char*)data, size);
+        bool ok = write(fd, key, sizeof(CacheHeader)) == (ssize_t)sizeof(CacheHeader)
+            && write(fd, data, size) == (ssize_t)size;
+        if (close(fd) != 0) ok = false;
+        if (!ok || rename(temp, path) != 0) unlink(temp);
+    }
+    free(temp);
+    free(path);
+    free(data);
+}
+
+// parse every expression in source text
+SExp** parseSource(unsigned char* source, size_t size, size_t* count) {
+    SExp** forms = NULL;
+    size_t capacity = 0;
+    *count = 0;
+    FILE* in = size ? fmemopen(source, size, "r") : NULL;
+    if (in) {
+        char* expr;
+        while ((expr = readExpression(in)) != NULL) {
+            binaryPush(&forms, count, &capacity, sexp(expr));
+        }
+        fclose(in);
+    }
+    return forms;
+}
+
+// eval each expression of a source file, parsing it only if the sidecar is stale
+bool readCachedFile(const char* filename) {
+    struct stat st;
+    size_t size;
+    // stat before reading: a write in between leaves an old mtime, so the next load rebuilds
+    unsigned char* source = (stat(filename, &st) == 0) ? readWholeFile(filename, &size) : NULL;
+    if (!source) {
+        fprintf(interp->err, "Failed to open file: %s\n", strerror(errno));
+        return false;
+    }
+
+    CacheHeader key = cacheKey(filename, &st, source, size);
+    SExp** forms;
+    size_t count;
+    if (!cacheLoad(filename, &key, &forms, &count)) {
+        forms = parseSource(source, size, &count);
+        // stored before evaluation, so the sidecar exists even if a form never finishes
+        cacheStore(filename, &key, forms, count);
+    }
+    free(source);
+
+    for (size_t i = 0; i < count; i++) {
+        SExp* result = eval(forms[i], interp->globalEnv);
+        fprintf(interp->out, "%s\n", sexpToString(result));
+    }
+    free(forms);
+    return true;
+}
+
+/* pipelined file mode
+        with -pipeline, a reader thread parses the forms of a text file
+        and a writer thread prints the results, while the calling thread
+        only evaluates. forms and results pass between them in batches
+        through bounded queues, in file order; text printed during an
+        evaluation is captured and kept ahead of its result, so the
+        output is the same as without.
+*/
+
+#define PIPE_BATCH 64    // forms handed over at a time
+#define PIPE_CAPACITY 8  // batches waiting in each queue
+
+bool pipelineEnabled = false; // -pipeline: parse and print on their own threads
+
+typedef struct PipeItem {
+    SExp* value;            // form or result
+    char* output;           // printed while evaluating the form, NULL if nothing was
+    size_t outputLength;
+} PipeItem;
+
+typedef struct PipeBatch {
+    PipeItem items[PIPE_BATCH];
+    size_t count;
+} PipeBatch;
+
+typedef struct PipeQueue {
+    PipeBatch* batches[PIPE_CAPACITY];
+    size_t head;            // index of the oldest batch
+    size_t count;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+} PipeQueue;
+
+typedef struct Pipeline {
+    FILE* in;
+    FILE* out;
+    PipeQueue forms;        // reader -> evaluator
+    PipeQueue results;      // evaluator -> writer
+} Pipeline;
+
+void pipeInit(PipeQueue* q) {
+    q->head = 0;
+    q->count = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notEmpty, NULL);
+    pthread_cond_init(&q->notFull, NULL);
+}
+
+void pipeDestroy(PipeQueue* q) {
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->notEmpty);
+    pthread_cond_destroy(&q->notFull);
+}
+
+// append batch, waiting while the queue is full; NULL marks the end
+void pipePush(PipeQueue* q, PipeBatch* batch) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == PIPE_CAPACITY) pthread_cond_wait(&q->notFull, &q->lock);
+    q->batches[(q->head + q->count++) % PIPE_CAPACITY] = batch;
+    pthread_cond_signal(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// remove oldest batch, waiting while the queue is empty
+PipeBatch* pipePop(PipeQueue* q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0) pthread_cond_wait(&q->notEmpty, &q->lock);
+    PipeBatch* batch = q->batches[q->head];
+    q->head = (q->head + 1) % PIPE_CAPACITY;
+    q->count--;
+    pthread_cond_signal(&q->notFull);
+    pthread_mutex_unlock(&q->lock);
+    return batch;
+}
+
+// reader thread: parse every form into batches for the evaluator
+void* pipeReader(void* arg) {
+    Pipeline* p = arg;
+    Interpreter stage = {0}; // line buffers of its own; parsing uses nothing else
+    interp = &stage;
+    PipeBatch* batch = calloc(1, sizeof(PipeBatch));
+    char* expr;
+    while ((expr = readExpression(p->in)) != NULL) {
+        batch->items[batch->count++].value = sexp(expr);
+        if (batch->count == PIPE_BATCH) {
+            pipePush(&p->forms, batch);
+            batch = calloc(1, sizeof(PipeBatch));
+        }
+    }
+    if (batch->count > 0) pipePush(&p->forms, batch);
+    else free(batch);
+    pipePush(&p->forms, NULL);
+    free(stage.lineBuffer);
+    free(stage.exprBuffer);
+    return NULL;
+}
+
+// writer thread: print captured text and each result in order
+void* pipeWriter(void* arg) {
+    Pipeline* p = arg;
+    Interpreter stage = {0}; // print buffer of its own
+    interp = &stage;
+    PipeBatch* batch;
+    while ((batch = pipePop(&p->results)) != NULL) {
+        for (size_t i = 0; i < batch->count; i++) {
+            PipeItem* item = &batch->items[i];
+            if (item->output) {
+                fwrite(item->output, 1, item->outputLength, p->out);
+                free(item->output);
+            }
+            fprintf(p->out, "%s\n", sexpToString(item->value));
+        }
+        free(batch);
+    }
+    free(stage.stringBuffer);
+    return NULL;
+}
+
+// eval each form of an open text file with parsing and printing on other threads
+bool readFilePipelined(FILE* file) {
+    Pipeline p = { .in = file, .out = interp->out };
+    pipeInit(&p.forms);
+    pipeInit(&p.results);
+    char* captured = NULL;
+    size_t capturedLength = 0;
+    FILE* capture = open_memstream(&captured, &capturedLength);
+    interp->out = capture;
+
+    pthread_t reader, writer;
+    pthread_create(&reader, NULL, pipeReader, &p);
+    pthread_create(&writer, NULL, pipeWriter, &p);
+    PipeBatch* batch;
+    while ((batch = pipePop(&p.forms)) != NULL) {
+        // each form is replaced by its result, and the batch goes on to the writer
+        for (size_t i = 0; i < batch->count; i++) {
+            PipeItem* item = &batch->items[i];
+            item->value = eval(item->value, interp->globalEnv);
+            fflush(capture);
+            if (capturedLength > 0) {
+                item->output = malloc(capturedLength);
+                memcpy(item->output, captured, capturedLength);
+                item->outputLength = capturedLength;
+                rewind(capture); // the next form's text overwrites this one's
+            }
+        }
+        pipePush(&p.results, batch);
+    }
+    pipePush(&p.results, NULL);
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+
+    interp->out = p.out;
+    fclose(capture);
+    free(captured);
+    pipeDestroy(&p.forms);
+    pipeDestroy(&p.results);
+    fclose(file);
+    return true;
+}
+
 // read file and eval each expression
-void readFile(const char* filename) {
+bool readFile(const char* filename) {
     FILE *file = fopen(filename, "r");
     if (!file) {
-        perror("Failed to open file");
-        return;
+        fprintf(interp->err, "Failed to open file: %s\n", strerror(errno));
+        return false;
     }
 
-    if (!globalEnv) {
-        globalEnv = malloc(sizeof(Env));
-        globalEnv->symbols = &nil;
-        globalEnv->values = &nil;
-        globalEnv->parent = NULL;
+    ensureGlobalEnv();
+
+    // files written by write-binary or -to-binary start with a magic header
+    char magic[BINARY_MAGIC_SIZE];
+    if (fread(magic, 1, BINARY_MAGIC_SIZE, file) == BINARY_MAGIC_SIZE && memcmp(magic, BINARY_MAGIC, BINARY_MAGIC_SIZE) == 0) {
+        fclose(file);
+        return readBinaryFile(filename);
+    }
+    if (cacheEnabled) {
+        fclose(file);
+        return readCachedFile(filename);
+    }
+    rewind(file);
+    if (pipelineEnabled) {
+        return readFilePipelined(file);
     }
 
     char* expr;
     while ((expr = readExpression(file)) != NULL) {
         SExp* sexpInput = sexp(expr);
-        SExp* result = eval(sexpInput, globalEnv);
-        printf("%s\n", sexpToString(result));
+        SExp* result = eval(sexpInput, interp->globalEnv);
+        fprintf(interp->out, "%s\n", sexpToString(result));
+    }
+    fclose(file);
+    return true;
+}
+
+// parse every expression in source file and store them in binary format
+bool convertToBinary(const char* filename, const char* outputName) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        perror("Failed to open file");
+        return false;
+    }
+
+    SExp** forms = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    char* expr;
+    while ((expr = readExpression(file)) != NULL) {
+        binaryPush(&forms, &count, &capacity, sexp(expr));
     }
     fclose(file);
+
+    size_t size;
+    unsigned char* data = binaryEncode(forms, count, &size, false); // source forms never hold functions or shared cells
+    free(forms);
+    FILE* out = fopen(outputName, "wb");
+    bool ok = out && fwrite(data, 1, size, out) == size;
+    if (out && fclose(out) != 0) ok = false;
+    if (!ok) perror("Failed to write file");
+    free(data);
+    return ok;
 }
 
+#ifndef LISP_NO_MAIN
 // read from stdin and eval each expression
 void repl() {
     printf("Type 'exit' to quit.\n");
 
-    if (!globalEnv) {
-        globalEnv = malloc(sizeof(Env));
-        globalEnv->symbols = &nil;
-        globalEnv->values = &nil;
-        globalEnv->parent = NULL;
-    }
+    ensureGlobalEnv();
 
     char* expr;
     while (1) {
@@ -1164,26 +6175,595 @@ void repl() {
 
         // parse and evaluate
         SExp* sexpInput = sexp(expr);
-        SExp* result = eval(sexpInput, globalEnv);
+        SExp* result = eval(sexpInput, interp->globalEnv);
 
         // print result
         printf("%s\n", sexpToString(result));
     }
 }
+#endif
+
+/* embedding API (declared in lisp.h) */
+
+Interpreter* lispCreate(void) {
+    Interpreter* lisp = calloc(1, sizeof(Interpreter));
+    pthread_mutex_init(&lisp->envLock, NULL);
+    pthread_mutex_init(&lisp->optimizerLock, NULL);
+    lisp->globalEnv = consEnv(&nil, &nil, NULL);
+    lisp->out = stdout;
+    lisp->err = stderr;
+    lisp->limits.depth = DEFAULT_MAX_DEPTH;
+    return lisp;
+}
+
+// frees the instance's buffers and tables; values it created stay valid
+void lispDestroy(Interpreter* lisp) {
+    free(lisp->exprBuffer);
+    free(lisp->lineBuffer);
+    free(lisp->stringBuffer);
+    free(lisp->optimizedBodies.keys);
+    free(lisp->optimizedBodies.values);
+    free(lisp->originalForms.keys);
+    free(lisp->originalForms.values);
+    free(lisp->jitRecords.keys);
+    free(lisp->jitRecords.values);
+    pthread_mutex_destroy(&lisp->envLock);
+    pthread_mutex_destroy(&lisp->optimizerLock);
+    free(lisp);
+}
+
+void lispSetOutput(Interpreter* lisp, FILE* out, FILE* err) {
+    lisp->out = out;
+    lisp->err = err;
+}
+
+void lispSetMaxDepth(Interpreter* lisp, size_t depth) {
+    lisp->limits.depth = depth;
+}
+
+void lispSetLimits(Interpreter* lisp, LispLimits limits) {
+    lisp->limits = limits;
+}
+
+SExp* lispEvalString(Interpreter* lisp, const char* source) {
+    Interpreter* saved = interp;
+    interp = lisp;
+    SExp* result = evalString(source);
+    interp = saved;
+    return result;
+}
+
+bool lispEvalFile(Interpreter* lisp, const char* fileName) {
+    Interpreter* saved = interp;
+    interp = lisp;
+    bool ok = readFile(fileName);
+    interp = saved;
+    return ok;
+}
+
+void lispRegister(Interpreter* lisp, const char* name, NativeFunction fn, void* data) {
+    SExp* native = newSExp(SEXP_NATIVE);
+    native->data.native.fn = fn;
+    native->data.native.data = data;
+    native->data.native.name = strdup(name);
+
+    Interpreter* saved = interp;
+    interp = lisp;
+    set(makeSymbol(name), native, lisp->globalEnv);
+    interp = saved;
+}
+
+const char* lispToString(Interpreter* lisp, SExp* value) {
+    Interpreter* saved = interp;
+    interp = lisp;
+    const char* text = sexpToString(value);
+    interp = saved;
+    return text;
+}
+
+const char* lispText(SExp* value) {
+    if (sexpType(value) != SEXP_ATOM) return NULL;
+    if (atomType(value) == ATOM_STRING) return stringCString(value->data.atom.value.string_value);
+    if (atomType(value) != ATOM_SYMBOL) return NULL;
+    return value->data.atom.value.symbol_value;
+}
+
+/* batch mode: evaluate many files in parallel, one interpreter per file */
+
+typedef struct BatchJob {
+    const char* fileName;
+    char* output;       // everything the file printed, results and errors
+    size_t outputSize;
+} BatchJob;
+
+typedef struct Batch {
+    BatchJob* jobs;
+    int count;
+    atomic_int next;    // index of the next job nobody has claimed
+} Batch;
+
+// claim jobs until none are left; each file gets a fresh global environment
+void* batchWorker(void* arg) {
+    Batch* batch = arg;
+    int i;
+    while ((i = atomic_fetch_add(&batch->next, 1)) < batch->count) {
+        BatchJob* job = &batch->jobs[i];
+        FILE* out = open_memstream(&job->output, &job->outputSize);
+        if (!out) {
+            perror("Failed to open output buffer");
+            continue;
+        }
+        Interpreter* lisp = lispCreate();
+        lispSetOutput(lisp, out, out); // keep errors in order with the results they follow
+        lispSetLimits(lisp, mainInterpreter.limits); // from the command line
+        lispEvalFile(lisp, job->fileName);
+        lispDestroy(lisp);
+        fclose(out);
+    }
+    return NULL;
+}
+
+// run files on threadCount threads, then print each file's output in input order
+void runBatch(const char** files, int count, int threadCount) {
+    Batch batch = { .jobs = calloc(count, sizeof(BatchJob)), .count = count };
+    atomic_init(&batch.next, 0);
+    for (int i = 0; i < count; i++) {
+        batch.jobs[i].fileName = files[i];
+    }
+
+    if (threadCount > count) threadCount = count;
+    pthread_t* threads = malloc(threadCount * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; i < threadCount; i++) {
+        if (pthread_create(&threads[started], NULL, batchWorker, &batch) == 0) started++;
+    }
+    if (started == 0) batchWorker(&batch); // no threads available: run jobs here
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < count; i++) {
+        printf(";; %s\n", files[i]);
+        if (batch.jobs[i].output) fwrite(batch.jobs[i].output, 1, batch.jobs[i].outputSize, stdout);
+        free(batch.jobs[i].output);
+    }
+    free(threads);
+    free(batch.jobs);
+}
+
+
+/* bench mode: time a file over several runs in fresh interpreters */
+
+// parser throughput: the file's expressions are read once, then parsed runs times
+void benchParse(const char* fileName, int runs) {
+    FILE* file = fopen(fileName, "r");
+    if (!file) return;
+    char** exprs = NULL;
+    size_t count = 0, size = 0;
+    char* expr;
+    while ((expr = readExpression(file)) != NULL) {
+        exprs = realloc(exprs, (count + 1) * sizeof(char*));
+        exprs[count++] = strdup(expr);
+        size += strlen(expr);
+    }
+    fclose(file);
+
+    double best = 0;
+    for (int run = 0; run < runs; run++) {
+        double start = monotonicSeconds();
+        for (size_t i = 0; i < count; i++) sexp(exprs[i]);
+        double elapsed = monotonicSeconds() - start;
+        if (run == 0 || elapsed < best) best = elapsed;
+    }
+    if (best > 0) printf("parse: %.1f MB/s (%zu bytes of expressions)\n", size / best / 1e6, size);
+    for (size_t i = 0; i < count; i++) free(exprs[i]);
+    free(exprs);
+}
+
+// evaluate file runs times in fresh interpreters writing to sink; false if it failed
+bool benchTime(const char* fileName, int runs, FILE* sink, double* best, double* mean) {
+    double total = 0;
+    for (int run = 0; run < runs; run++) {
+        Interpreter* lisp = lispCreate();
+        lispSetOutput(lisp, sink, stderr);
+        double start = monotonicSeconds();
+        bool ok = lispEvalFile(lisp, fileName);
+        double elapsed = monotonicSeconds() - start;
+        lispDestroy(lisp);
+        if (!ok) return false;
+        if (run == 0 || elapsed < *best) *best = elapsed;
+        total += elapsed;
+    }
+    *mean = total / runs;
+    return true;
+}
+
+// evaluate file runs times with output discarded, then report timings and allocations
+bool runBench(const char* fileName, int runs) {
+    FILE* sink = fopen("/dev/null", "w");
+    if (!sink) {
+        perror("Failed to open /dev/null");
+        return false;
+    }
+    size_t objects[SEXP_TYPE_COUNT] = {0};
+    for (int type = 0; type < SEXP_TYPE_COUNT; type++) objects[type] = slabs[type].objects;
+
+    double best = 0, mean = 0;
+    if (!benchTime(fileName, runs, sink, &best, &mean)) {
+        fclose(sink);
+        return false;
+    }
+
+    size_t count = 0, bytes = 0;
+    for (int type = 0; type < SEXP_TYPE_COUNT; type++) {
+        objects[type] = (slabs[type].objects - objects[type]) / runs;
+        count += objects[type];
+        bytes += objects[type] * sexpSize(type);
+    }
+    printf("%s: best %.3f ms, mean %.3f ms over %d runs\n", fileName, best * 1e3, mean * 1e3, runs);
+    printf("per run: %zu objects in %zu bytes (%zu cons cells, %zu atoms)\n", count, bytes, objects[SEXP_LIST], objects[SEXP_ATOM]);
+    printHeapStats(stdout);
+
+    // the same runs with every function interpreted
+    if (jitEnabled) {
+        double interpBest = 0, interpMean = 0;
+        jitEnabled = false;
+        bool ok = benchTime(fileName, runs, sink, &interpBest, &interpMean);
+        jitEnabled = true;
+        if (ok) printf("interpreter only: best %.3f ms, mean %.3f ms (jit %.2fx)\n", interpBest * 1e3, interpMean * 1e3, interpBest / best);
+    }
+    fclose(sink);
+    benchParse(fileName, runs);
+    return true;
+}
+
+
+/* server mode: one warm interpreter shared by clients of a Unix domain socket
+        frames are a 4-byte big-endian length followed by that many bytes.
+        a request frame holds one or more expressions; the reply is one frame
+        per printed result, then an empty frame.
+*/
+
+#define FRAME_MAX (64u << 20) // refuse requests larger than 64MB
+
+// send or receive exactly length bytes; false on error or closed connection
+bool sendAll(int fd, const void* data, size_t length) {
+    const char* p = data;
+    while (length > 0) {
+        ssize_t n = send(fd, p, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+bool receiveAll(int fd, void* data, size_t length) {
+    char* p = data;
+    while (length > 0) {
+        ssize_t n = recv(fd, p, length, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool writeFrame(int fd, const char* data, uint32_t length) {
+    unsigned char header[4] = { length >> 24, length >> 16, length >> 8, length };
+    return sendAll(fd, header, 4) && sendAll(fd, data, length);
+}
+
+// read one frame into a malloc'd, null-terminated buffer
+char* readFrame(int fd, uint32_t* length) {
+    unsigned char header[4];
+    if (!receiveAll(fd, header, 4)) return NULL;
+    *length = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 | (uint32_t)header[2] << 8 | header[3];
+    if (*length > FRAME_MAX) return NULL;
+
+    char* data = malloc(*length + 1);
+    if (!receiveAll(fd, data, *length)) {
+        free(data);
+        return NULL;
+    }
+    data[*length] = '\0';
+    return data;
+}
+
+// send the printed form of value as one frame
+bool writeResult(int fd, SExp* value) {
+    char* text;
+    size_t size;
+    FILE* out = open_memstream(&text, &size);
+    if (!out) return false;
+    fprintSExp(out, value); // sexpToString's buffer is not shared between client threads
+    fclose(out);
+    bool ok = writeFrame(fd, text, size);
+    free(text);
+    return ok;
+}
+
+// evaluate each expression of request in a fresh child of the global environment
+// blank out comments and check that the parentheses outside strings balance,
+// by the same rules as portExpressionEnd
+bool requestBalanced(char* text) {
+    int depth = 0;
+    bool inString = false;
+    bool inComment = false;
+    for (char* p = text; *p != '\0'; p++) {
+        if (inComment) {
+            if (*p == '\n') inComment = false;
+            else *p = ' ';
+        }
+        else if (inString) {
+            if (*p == '"') inString = false;
+        }
+        else if (*p == ';') {
+            inComment = true;
+            *p = ' ';
+        }
+        else if (*p == '"') inString = true;
+        else if (*p == '(') depth++;
+        else if (*p == ')' && --depth < 0) return false;
+    }
+    return depth == 0;
+}
+
+bool serveRequest(int fd, char* request) {
+    // the parser needs balanced input to terminate
+    if (!requestBalanced(request)) {
+        return writeResult(fd, makeSymbol("Error: Unbalanced parentheses")) && writeFrame(fd, "", 0);
+    }
+
+    Env* env = consEnv(&nil, &nil, interp->globalEnv); // sets stay local to this request
+    char* cursor = request;
+    while (1) {
+        skipWhitespace(&cursor);
+        if (*cursor == '\0') break;
+        SExp* result = eval(readSExpHelper(&cursor), env);
+        if (!writeResult(fd, result)) return false;
+    }
+    return writeFrame(fd, "", 0);
+}
+
+typedef struct Client {
+    int fd;
+    Interpreter* lisp; // server instance: its globals and optimizer tables are shared
+} Client;
+
+void* serveClient(void* arg) {
+    Client* client = arg;
+    interp = client->lisp;
+
+    char* request;
+    uint32_t length;
+    while ((request = readFrame(client->fd, &length)) != NULL) {
+        bool ok = serveRequest(client->fd, request);
+        free(request);
+        if (!ok) break;
+    }
+    close(client->fd);
+    free(client);
+    return NULL;
+}
+
+// accept clients until the process is stopped, one thread each
+bool serve(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    // replace a socket left behind by an earlier server, but never another kind of file
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+    ensureGlobalEnv();
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server, SOMAXCONN) < 0) {
+        perror("Failed to open socket");
+        if (server >= 0) close(server);
+        return false;
+    }
+    fprintf(stderr, "Serving on %s\n", path);
+
+    while (1) {
+        int fd = accept(server, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("Failed to accept connection");
+            break;
+        }
+        Client* client = malloc(sizeof(Client));
+        client->fd = fd;
+        client->lisp = interp;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serveClient, client) != 0) {
+            close(fd);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    close(server);
+    return false;
+}
+
+// send each expression of a file (or stdin) to a server and print the replies
+bool connectClient(const char* path, const char* fileName) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
 
+    FILE* in = fileName ? fopen(fileName, "r") : stdin;
+    if (!in) {
+        perror("Failed to open file");
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Failed to connect");
+        if (fd >= 0) close(fd);
+        if (in != stdin) fclose(in);
+        return false;
+    }
 
+    bool ok = true;
+    char* expr;
+    while (ok && (expr = readExpression(in)) != NULL) {
+        ok = writeFrame(fd, expr, strlen(expr));
+        // print result frames until the empty frame that ends the reply
+        while (ok) {
+            uint32_t length;
+            char* reply = readFrame(fd, &length);
+            if (!reply) {
+                ok = false;
+                break;
+            }
+            bool done = (length == 0);
+            if (!done) printf("%s\n", reply);
+            free(reply);
+            if (done) break;
+        }
+    }
+    if (!ok) fprintf(stderr, "Connection to %s lost\n", path);
+    close(fd);
+    if (in != stdin) fclose(in);
+    return ok;
+}
 
+#ifndef LISP_NO_MAIN
 int main(int argc, char* argv[]){
-    if (argc == 2) { // file input or test mode
-        if (strcmp(argv[1], "-test") == 0) {
-            runTests("test_results.txt");
+    const char* fileName = NULL;
+    const char* saveImagePath = NULL;
+    const char* loadImagePath = NULL;
+    const char* binaryPath = NULL;
+    const char* servePath = NULL;
+    const char* connectPath = NULL;
+    bool testMode = false;
+    bool batchMode = false;
+    bool heapStats = false;
+    int threadCount = 0;
+    int benchRuns = 0;
+    const char** files = malloc(argc * sizeof(char*));
+    int fileCount = 0;
+
+    mainInterpreter.out = stdout;
+    mainInterpreter.err = stderr;
+
+    // flags may appear anywhere; the remaining arguments are input files
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-test") == 0) {
+            testMode = true;
+        }
+        else if (strcmp(argv[i], "-batch") == 0) {
+            batchMode = true;
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threadCount = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-bench") == 0 && i + 1 < argc) {
+            benchRuns = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-max-depth") == 0 && i + 1 < argc) {
+            mainInterpreter.limits.depth = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-max-steps") == 0 && i + 1 < argc) {
+            mainInterpreter.limits.steps = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-max-ms") == 0 && i + 1 < argc) {
+            mainInterpreter.limits.ms = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-max-bytes") == 0 && i + 1 < argc) {
+            mainInterpreter.limits.bytes = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-max-heap") == 0 && i + 1 < argc) {
+            lispSetMaxHeap(strtoul(argv[++i], NULL, 10));
+        }
+        else if (strcmp(argv[i], "-heap-stats") == 0) {
+            heapStats = true;
+        }
+        else if (strcmp(argv[i], "-dump-opt") == 0) {
+            dumpOptimized = true;
+        }
+        else if (strcmp(argv[i], "-no-jit") == 0) {
+            jitEnabled = false;
+        }
+        else if (strcmp(argv[i], "-cache") == 0) {
+            cacheEnabled = true;
+        }
+        else if (strcmp(argv[i], "-pipeline") == 0) {
+            pipelineEnabled = true;
+        }
+        else if (strcmp(argv[i], "-save-image") == 0 && i + 1 < argc) {
+            saveImagePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-load-image") == 0 && i + 1 < argc) {
+            loadImagePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-to-binary") == 0 && i + 1 < argc) {
+            binaryPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-serve") == 0 && i + 1 < argc) {
+            servePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-connect") == 0 && i + 1 < argc) {
+            connectPath = argv[++i];
         }
         else {
-            readFile(argv[1]);
+            fileName = argv[i];
+            files[fileCount++] = argv[i];
+        }
+    }
+
+    // start from a saved global environment instead of an empty one
+    if (loadImagePath && !loadImage(loadImagePath)) {
+        return 1;
+    }
+
+    if (testMode) {         // test mode
+        runTests("test_results.txt");
+    }
+    else if (batchMode) {   // many files, evaluated in parallel
+        if (threadCount <= 0) {
+            long cores = sysconf(_SC_NPROCESSORS_ONLN);
+            threadCount = (cores > 0) ? (int)cores : 1;
         }
+        if (fileCount > 0) runBatch(files, fileCount, threadCount);
     }
-    else {          // standard input
+    else if (benchRuns > 0) { // time a file over repeated runs
+        if (!fileName || !runBench(fileName, benchRuns)) return 1;
+    }
+    else if (servePath) {   // load library file (if any), then answer clients
+        if (fileName && !readFile(fileName)) return 1;
+        fflush(stdout);
+        if (!serve(servePath)) return 1;
+    }
+    else if (connectPath) { // send file or stdin to a server
+        if (!connectClient(connectPath, fileName)) return 1;
+    }
+    else if (binaryPath) {  // convert source file to binary format
+        if (!fileName || !convertToBinary(fileName, binaryPath)) return 1;
+    }
+    else if (fileName) {    // file input
+        readFile(fileName);
+    }
+    else {                  // standard input
         repl();
     }
+
+    if (heapStats) printHeapStats(stderr);
+    free(files);
+    if (saveImagePath && !saveImage(saveImagePath)) {
+        return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
+#endif